@@ -0,0 +1,131 @@
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "affinity.h"
+
+bool parse_cpu_list( const char* text, std::vector<int>& cpus ) {
+    cpus.clear();
+    const char* p = text;
+    while ( *p ) {
+        char* end = NULL;
+        long first = strtol( p, &end, 10 );
+        if ( end == p || first < 0 || first >= CPU_SETSIZE ) {
+            return false;
+        }
+        long last = first;
+        p = end;
+        if ( *p == '-' ) {
+            ++p;
+            last = strtol( p, &end, 10 );
+            if ( end == p || last < first || last >= CPU_SETSIZE ) {
+                return false;
+            }
+            p = end;
+        }
+        for ( long cpu = first; cpu <= last; ++cpu ) {
+            cpus.push_back( ( int )cpu );
+        }
+        if ( *p == ',' ) {
+            ++p;
+        } else if ( *p ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int cpu_to_node( int cpu ) {
+    // 结果缓存起来，接受连接时查询不需要再读sysfs。只在主线程中调用
+    static int nodes[ CPU_SETSIZE ];
+    static bool inited = false;
+    if ( cpu < 0 || cpu >= CPU_SETSIZE ) {
+        return 0;
+    }
+    if ( !inited ) {
+        for ( int i = 0; i < CPU_SETSIZE; ++i ) {
+            nodes[i] = -1;
+        }
+        inited = true;
+    }
+    if ( nodes[cpu] >= 0 ) {
+        return nodes[cpu];
+    }
+
+    // /sys/devices/system/cpu/cpuN/ 下有一个指向所在节点的 nodeM 链接
+    char path[ 64 ];
+    snprintf( path, sizeof( path ), "/sys/devices/system/cpu/cpu%d", cpu );
+    DIR* dir = opendir( path );
+    if ( !dir ) {
+        return 0;
+    }
+    int node = 0;
+    struct dirent* ent;
+    while ( ( ent = readdir( dir ) ) != NULL ) {
+        if ( strncmp( ent->d_name, "node", 4 ) == 0 && ent->d_name[4] >= '0' && ent->d_name[4] <= '9' ) {
+            node = atoi( ent->d_name + 4 );
+            break;
+        }
+    }
+    closedir( dir );
+    nodes[cpu] = node;
+    return node;
+}
+
+int numa_node_count() {
+    DIR* dir = opendir( "/sys/devices/system/node" );
+    if ( !dir ) {
+        return 1;
+    }
+    int count = 1;
+    struct dirent* ent;
+    while ( ( ent = readdir( dir ) ) != NULL ) {
+        if ( strncmp( ent->d_name, "node", 4 ) == 0 && ent->d_name[4] >= '0' && ent->d_name[4] <= '9' ) {
+            int node = atoi( ent->d_name + 4 );
+            if ( node + 1 > count ) {
+                count = node + 1;
+            }
+        }
+    }
+    closedir( dir );
+    return count;
+}
+
+bool set_attr_cpu( pthread_attr_t* attr, int cpu ) {
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    CPU_SET( cpu, &set );
+    return pthread_attr_setaffinity_np( attr, sizeof( set ), &set ) == 0;
+}
+
+bool pin_current_thread( int cpu ) {
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    CPU_SET( cpu, &set );
+    return pthread_setaffinity_np( pthread_self(), sizeof( set ), &set ) == 0;
+}
+
+char* alloc_on_node( size_t len, int node ) {
+    // 匿名映射的物理页在第一次访问时才分配，先设置好内存策略，之后无论哪个线程先访问都从node分配
+    void* addr = mmap( NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( addr == MAP_FAILED ) {
+        return NULL;
+    }
+    if ( node >= 0 && node < ( int )( sizeof( unsigned long ) * 8 ) ) {
+        // MPOL_PREFERRED：节点内存不足时允许退回其他节点；内核不支持NUMA时mbind失败，忽略即可
+        unsigned long mask = 1UL << node;
+        syscall( SYS_mbind, addr, len, MPOL_PREFERRED, &mask, sizeof( mask ) * 8, 0 );
+    }
+    return ( char* )addr;
+}
+
+void free_on_node( char* addr, size_t len ) {
+    if ( addr ) {
+        munmap( addr, len );
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <vector>
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+    CPU亲和性与NUMA相关的辅助函数
+    在多路服务器上，把主线程（epoll）和工作线程绑定到指定的CPU，按NUMA节点划分请求队列，
+    并让连接的缓冲区分配在处理它的节点本地的内存上，避免跨节点的缓存行来回迁移。
+*/
+
+// 解析CPU列表，格式如 "0-3,8,10-11"。空串得到空列表
+bool parse_cpu_list( const char* text, std::vector<int>& cpus );
+
+// cpu所在的NUMA节点，无法得知时返回0。结果会被缓存，非线程安全，只在主线程中调用
+int cpu_to_node( int cpu );
+
+// 系统中最大的NUMA节点编号+1
+int numa_node_count();
+
+// 设置线程属性，使新线程运行在cpu上（在pthread_create之前调用，这样线程栈也在本地节点上分配）
+bool set_attr_cpu( pthread_attr_t* attr, int cpu );
+
+// 把当前线程绑定到cpu上
+bool pin_current_thread( int cpu );
+
+// 分配len字节内存，并优先从node节点分配物理页（node < 0 表示不指定）。失败返回NULL
+char* alloc_on_node( size_t len, int node );
+void free_on_node( char* addr, size_t len );
+
+#endif
@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <malloc.h>
+#include <execinfo.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <atomic>
+#include "../http_conn.h"
+#include "../threadpool.h"
+#include "../log.h"
+
+/*
+    检查稳态下处理请求不分配堆内存
+    替换malloc系列函数计数，在进程内驱动真实的请求路径：主线程按main.cpp的事件循环读请求、交给线程池，
+    工作线程解析、查缓存、生成并发送应答，长连接上重复同一个请求。预热之后的请求中发生的分配都算作违例，
+    另外检查异步日志在队列中的string都用过一遍之后写日志不再分配。
+    用法：alloc_check [-v] [每种场景的请求数]，有分配时返回1，-v打印前几次分配的调用栈
+*/
+
+#ifndef BENCH_DOC_ROOT
+#define BENCH_DOC_ROOT "../resources"
+#endif
+
+extern "C" {
+void* __libc_malloc( size_t size );
+void* __libc_calloc( size_t n, size_t size );
+void* __libc_realloc( void* p, size_t size );
+void* __libc_memalign( size_t align, size_t size );
+void __libc_free( void* p );
+}
+
+static std::atomic< bool > counting( false );
+static std::atomic< long > alloc_count( 0 );
+static std::atomic< long > alloc_bytes( 0 );
+static bool verbose = false;
+
+// 记录前几次分配的调用栈。backtrace自己可能分配内存，用in_hook防止递归
+static const int MAX_TRACES = 4;
+static const int TRACE_DEPTH = 16;
+static void* traces[ MAX_TRACES ][ TRACE_DEPTH ];
+static int trace_depth[ MAX_TRACES ];
+static std::atomic< int > trace_count( 0 );
+static thread_local bool in_hook = false;
+
+static void count_alloc( size_t size ) {
+    if ( !counting.load( std::memory_order_relaxed ) || in_hook ) {
+        return;
+    }
+    alloc_count.fetch_add( 1, std::memory_order_relaxed );
+    alloc_bytes.fetch_add( size, std::memory_order_relaxed );
+    if ( verbose ) {
+        int i = trace_count.fetch_add( 1, std::memory_order_relaxed );
+        if ( i < MAX_TRACES ) {
+            in_hook = true;
+            trace_depth[i] = backtrace( traces[i], TRACE_DEPTH );
+            in_hook = false;
+        }
+    }
+}
+
+extern "C" {
+void* malloc( size_t size ) {
+    count_alloc( size );
+    return __libc_malloc( size );
+}
+void* calloc( size_t n, size_t size ) {
+    count_alloc( n * size );
+    return __libc_calloc( n, size );
+}
+void* realloc( void* p, size_t size ) {
+    count_alloc( size );
+    return __libc_realloc( p, size );
+}
+void* memalign( size_t align, size_t size ) {
+    count_alloc( size );
+    return __libc_memalign( align, size );
+}
+void* aligned_alloc( size_t align, size_t size ) {
+    count_alloc( size );
+    return __libc_memalign( align, size );
+}
+int posix_memalign( void** p, size_t align, size_t size ) {
+    count_alloc( size );
+    *p = __libc_memalign( align, size );
+    return *p ? 0 : ENOMEM;
+}
+void free( void* p ) {
+    __libc_free( p );
+}
+}
+
+static const int MAX_FD = 64;
+static http_conn* users = NULL;
+static threadpool< http_conn >* pool = NULL;
+static char response[ 256 * 1024 ];
+
+// main.cpp中事件循环处理一个连接事件的部分，不等待，返回处理的事件数
+static int poll_once() {
+    epoll_event events[ 8 ];
+    int n = epoll_wait( http_conn::m_epollfd, events, 8, 0 );
+    for ( int i = 0; i < n; ++i ) {
+        http_conn* conn = users + events[i].data.fd;
+        if ( !conn->claim() ) {
+            continue;
+        }
+        if ( events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) {
+            conn->close_conn();
+            continue;
+        }
+        if ( http_conn::m_io_model == http_conn::IO_REACTOR ) {
+            conn->to_worker( ( events[i].events & EPOLLIN ) ? EPOLLIN : EPOLLOUT );
+        } else if ( events[i].events & EPOLLIN ) {
+            if ( !conn->read() ) {
+                conn->close_conn();
+                continue;
+            }
+            conn->to_worker( EPOLLIN );
+        } else {
+            if ( !conn->write() ) {
+                conn->close_conn();
+            }
+            continue;
+        }
+        int node = conn->node();
+        int lane = conn->lane();
+        http_conn* rejected = NULL;
+        if ( pool->append_batch( &conn, &node, &lane, 1, &rejected ) ) {
+            rejected->shed();
+        }
+    }
+    return n > 0 ? n : 0;
+}
+
+// 服务端没有事件、客户端也没有数据可读时，等待其中之一，不空转
+static void wait_either( int fd ) {
+    struct pollfd fds[2] = { { http_conn::m_epollfd, POLLIN, 0 }, { fd, POLLIN, 0 } };
+    poll( fds, 2, 100 );
+}
+
+// 发送一个请求并读完应答，返回应答的状态码，出错返回-1
+static int round_trip( int fd, const char* request, size_t len ) {
+    if ( send( fd, request, len, 0 ) != ( ssize_t )len ) {
+        return -1;
+    }
+    size_t got = 0;
+    size_t total = 0;
+    while ( total == 0 || got < total ) {
+        int events = poll_once();
+        ssize_t n = recv( fd, response + got, sizeof( response ) - got, MSG_DONTWAIT );
+        if ( n == 0 || ( n < 0 && errno != EAGAIN ) ) {
+            return -1;
+        }
+        if ( n < 0 && events == 0 ) {
+            wait_either( fd );
+        }
+        got += n > 0 ? n : 0;
+        if ( got >= sizeof( response ) ) {
+            return -1;
+        }
+        response[ got ] = '\0';
+        const char* end = total == 0 ? strstr( response, "\r\n\r\n" ) : NULL;
+        if ( end ) {
+            const char* length = strstr( response, "Content-Length:" );
+            if ( !length ) {
+                return -1;
+            }
+            total = end + 4 - response + atol( length + 15 );
+        }
+    }
+    return atoi( response + 9 );
+}
+
+struct scenario {
+    const char* m_name;
+    http_conn::IO_MODEL m_model;
+    bool m_tracing;
+    const char* m_url;
+};
+
+// 在一个新的长连接上预热之后重复requests次请求，返回这期间的分配次数，请求出错返回-1
+static long run( const scenario& s, int requests, long& bytes ) {
+    http_conn::m_io_model = s.m_model;
+    metrics::get_instance()->set_tracing( s.m_tracing, 0 );
+    int fds[2];
+    if ( socketpair( AF_UNIX, SOCK_STREAM, 0, fds ) == -1 ) {
+        return -1;
+    }
+    sockaddr_storage addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.ss_family = AF_UNIX;
+    users[ fds[1] ].init( fds[1], addr );
+
+    char request[ 256 ];
+    int len = snprintf( request, sizeof( request ), "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n", s.m_url );
+    long allocs = 0;
+    for ( int i = 0; i < requests + 1000 && allocs >= 0; ++i ) {
+        if ( i == 1000 ) {
+            alloc_count = 0;
+            alloc_bytes = 0;
+            counting = true;
+        }
+        if ( round_trip( fds[0], request, len ) != 200 ) {
+            allocs = -1;
+        }
+    }
+    counting = false;
+    if ( allocs == 0 ) {
+        allocs = alloc_count;
+        bytes = alloc_bytes;
+    }
+
+    // 连接回到epoll之后由这里关闭
+    close( fds[0] );
+    while ( http_conn::m_user_count > 0 ) {
+        if ( poll_once() == 0 ) {
+            wait_either( -1 );
+        }
+    }
+    return allocs;
+}
+
+// 异步日志：队列中的string都装过一条日志之后，写日志不再分配
+static long run_log( int lines, long& bytes ) {
+    for ( int i = 0; i < lines + 2000; ++i ) {
+        if ( i == 2000 ) {
+            alloc_count = 0;
+            alloc_bytes = 0;
+            counting = true;
+        }
+        LOG_INFO( "client(%s) is connected", "127.0.0.1:40000" );
+    }
+    counting = false;
+    bytes = alloc_bytes;
+    return alloc_count;
+}
+
+// 删除日志目录和其中的日志文件。异步日志的线程不会退出，日志文件删除之后仍然打开着，进程退出时关闭
+static void remove_dir( const char* dir ) {
+    Log::get_instance()->flush();
+    DIR* d = opendir( dir );
+    if ( d ) {
+        for ( struct dirent* e = readdir( d ); e; e = readdir( d ) ) {
+            if ( strcmp( e->d_name, "." ) != 0 && strcmp( e->d_name, ".." ) != 0 ) {
+                unlinkat( dirfd( d ), e->d_name, 0 );
+            }
+        }
+        closedir( d );
+    }
+    rmdir( dir );
+}
+
+int main( int argc, char* argv[] ) {
+    int requests = 10000;
+    for ( int i = 1; i < argc; ++i ) {
+        if ( strcmp( argv[i], "-v" ) == 0 ) {
+            verbose = true;
+            void* frames[ 2 ];
+            backtrace( frames, 2 );     // 先加载libgcc_s，之后记录调用栈时不再分配
+        } else {
+            requests = atoi( argv[i] ) > 0 ? atoi( argv[i] ) : requests;
+        }
+    }
+
+    signal( SIGPIPE, SIG_IGN );
+    char dir[] = "/tmp/webserver_alloc_XXXXXX";
+    if ( !mkdtemp( dir ) ) {
+        perror( "mkdtemp" );
+        return 2;
+    }
+    char log_file[ 64 ];
+    snprintf( log_file, sizeof( log_file ), "%s/alloc.log", dir );
+    if ( !Log::get_instance()->init( log_file, 0, 2000, 800000, 800 )
+         || !file_cache::get_instance()->init( BENCH_DOC_ROOT, 65536, 32 * 1024 * 1024, 1024 )
+         || !http_conn::init_buffers( MAX_FD, 1 ) ) {
+        fprintf( stderr, "init failed\n" );
+        remove_dir( dir );
+        return 2;
+    }
+    http_conn::m_epollfd = epoll_create( 5 );
+    users = new http_conn[ MAX_FD ];
+    pool = new threadpool< http_conn >( 1, 10000 );
+
+    static const scenario scenarios[] = {
+        { "proactor cached",        http_conn::IO_PROACTOR, false, "/index.html" },
+        { "proactor mmap",          http_conn::IO_PROACTOR, false, "/images/image1.jpg" },
+        { "proactor cached traced", http_conn::IO_PROACTOR, true,  "/index.html" },
+        { "reactor cached",         http_conn::IO_REACTOR,  false, "/index.html" },
+        { "reactor mmap traced",    http_conn::IO_REACTOR,  true,  "/images/image1.jpg" },
+    };
+    const int count = sizeof( scenarios ) / sizeof( scenarios[0] );
+    long allocs[ count + 1 ];
+    long bytes[ count + 1 ];
+
+    // 解析请求时打印的调试信息不输出
+    fflush( stdout );
+    int saved_stdout = dup( 1 );
+    int null = open( "/dev/null", O_WRONLY );
+    dup2( null, 1 );
+    for ( int i = 0; i < count; ++i ) {
+        bytes[i] = 0;
+        allocs[i] = run( scenarios[i], requests, bytes[i] );
+    }
+    bytes[ count ] = 0;
+    allocs[ count ] = run_log( requests, bytes[ count ] );
+    fflush( stdout );
+    dup2( saved_stdout, 1 );
+    close( null );
+    pool->stop();
+
+    bool ok = true;
+    printf( "%-24s %10s %12s %10s\n", "scenario", "requests", "allocations", "bytes" );
+    for ( int i = 0; i <= count; ++i ) {
+        const char* name = i < count ? scenarios[i].m_name : "async log line";
+        if ( allocs[i] < 0 ) {
+            printf( "%-24s %10d %12s\n", name, requests, "error" );
+        } else {
+            printf( "%-24s %10d %12ld %10ld\n", name, requests, allocs[i], bytes[i] );
+        }
+        ok = ok && allocs[i] == 0;
+    }
+    for ( int i = 0; i < trace_count && i < MAX_TRACES; ++i ) {
+        printf( "allocation %d:\n", i + 1 );
+        fflush( stdout );
+        backtrace_symbols_fd( traces[i], trace_depth[i], 1 );
+    }
+    printf( "%s\n", ok ? "PASS" : "FAIL" );
+    remove_dir( dir );
+    return ok ? 0 : 1;
+}
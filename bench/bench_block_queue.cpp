@@ -0,0 +1,71 @@
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+#include <vector>
+#include "benchmark.h"
+#include "../block_queue.h"
+
+/*
+    阻塞队列在多个生产者、一个消费者（日志线程的用法）下的push/pop吞吐量
+    参数是生产者线程数，每次迭代是一个元素从push到被pop
+*/
+
+struct queue_bench {
+    block_queue< int >* m_queue;
+    long m_items;                           // 每个生产者push的元素数
+    std::atomic< bool >* m_start;
+};
+
+static void* producer( void* arg ) {
+    queue_bench* b = ( queue_bench* )arg;
+    while ( !b->m_start->load() ) {
+        sched_yield();
+    }
+    for ( long i = 0; i < b->m_items; ++i ) {
+        // 队列满时push失败（日志会因此退化为同步写），这里重试
+        while ( !b->m_queue->push( 1 ) ) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void BM_block_queue_push_pop( bench_state& state ) {
+    int producers = state.range( 0 );
+    long per_producer = ( state.iterations() + producers - 1 ) / producers;
+    block_queue< int > queue( 1000 );
+    std::atomic< bool > start( false );
+    queue_bench arg = { &queue, per_producer, &start };
+    std::vector< pthread_t > threads( producers );
+    for ( int i = 0; i < producers; ++i ) {
+        pthread_create( &threads[i], NULL, producer, &arg );
+    }
+
+    state.resume_timing();
+    start = true;
+    long total = per_producer * producers;
+    int item;
+    for ( long i = 0; i < total; ++i ) {
+        queue.pop( item );
+    }
+    state.pause_timing();
+
+    for ( int i = 0; i < producers; ++i ) {
+        pthread_join( threads[i], NULL );
+    }
+    state.set_items_processed( total );
+}
+BENCHMARK( BM_block_queue_push_pop )->arg( 1 )->arg( 2 )->arg( 4 )->arg( 8 );
+
+// 没有竞争时一次push加一次pop的开销
+static void BM_block_queue_uncontended( bench_state& state ) {
+    block_queue< int > queue( 1000 );
+    int item = 0;
+    for ( auto _ : state ) {
+        queue.push( item );
+        queue.pop( item );
+    }
+    do_not_optimize( item );
+    state.set_items_processed( state.iterations() );
+}
+BENCHMARK( BM_block_queue_uncontended );
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "benchmark.h"
+#include "../http_conn.h"
+
+/*
+    HTTP请求解析的微基准测试
+    parse_line    只切分行（从状态机）
+    process_read  完整的解析过程：请求行、请求头，以及do_request中的路径规范化和文件缓存查找
+*/
+
+#ifndef BENCH_DOC_ROOT
+#define BENCH_DOC_ROOT "../resources"
+#endif
+
+// 测试用的请求
+static const char* corpus[] = {
+    // 0: 最短的请求
+    "GET /index.html HTTP/1.1\r\n"
+    "\r\n",
+    // 1: 典型的长连接请求
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: 127.0.0.1:9006\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n",
+    // 2: 浏览器发出的请求，包含很多不认识的头部
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/103.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+    "\r\n",
+    // 3: 需要解码和规范化的路径
+    "GET /a/../%69ndex.html HTTP/1.1\r\n"
+    "Host: 127.0.0.1\r\n"
+    "\r\n",
+    // 4: 请求行错误
+    "FOO /index.html HTTP/1.1\r\n"
+    "\r\n",
+};
+
+// http_conn的友元，用于直接访问解析状态机
+struct http_conn_bench {
+    char m_read_buf[ 2048 ];
+    char m_write_buf[ 1024 ];
+    char m_path[ http_conn::FILENAME_LEN ];
+    http_conn m_conn;
+
+    http_conn_bench() {
+        static bool cache_ready = false;
+        if ( !cache_ready ) {
+            file_cache::get_instance()->init( BENCH_DOC_ROOT, 65536, 32 * 1024 * 1024, 1024 );
+            cache_ready = true;
+        }
+        m_conn.m_read_buf = m_read_buf;
+        m_conn.m_write_buf = m_write_buf;
+        m_conn.m_real_file = m_path;
+        http_conn::m_read_buf_size = sizeof( m_read_buf );
+        http_conn::m_write_buf_size = sizeof( m_write_buf );
+    }
+
+    // 模拟一个请求读完之后的状态
+    void load( const char* request, int len ) {
+        m_conn.init();
+        memcpy( m_read_buf, request, len );
+        m_conn.m_read_idx = len;
+    }
+
+    // 切分出所有的行，返回行数
+    int parse_lines() {
+        int lines = 0;
+        while ( m_conn.parse_line() == http_conn::LINE_OK ) {
+            m_conn.m_start_line = m_conn.m_checked_idx;
+            ++lines;
+        }
+        return lines;
+    }
+
+    // 又读入了一段数据
+    void append( const char* data, int off, int n ) {
+        memcpy( m_read_buf + off, data, n );
+        m_conn.m_read_idx = off + n;
+    }
+
+    http_conn::HTTP_CODE process_read() {
+        http_conn::HTTP_CODE ret = m_conn.process_read();
+        m_conn.unmap();
+        return ret;
+    }
+
+    // 长连接上一个请求结束时的重置
+    static void reset( http_conn& conn ) {
+        conn.init();
+    }
+    static void attach( http_conn& conn, char* buffer ) {
+        conn.m_read_buf = buffer;
+        conn.m_write_buf = buffer + http_conn::m_read_buf_size;
+        conn.m_real_file = conn.m_write_buf + http_conn::m_write_buf_size;
+    }
+};
+
+static void BM_http_parse_line( bench_state& state ) {
+    const char* request = corpus[ state.range( 0 ) ];
+    int len = strlen( request );
+    http_conn_bench bench;
+    int lines = 0;
+    for ( auto _ : state ) {
+        bench.load( request, len );
+        lines += bench.parse_lines();
+    }
+    do_not_optimize( lines );
+    state.set_items_processed( state.iterations() );
+    state.set_bytes_processed( state.iterations() * len );
+}
+BENCHMARK( BM_http_parse_line )->arg( 0 )->arg( 1 )->arg( 2 )->arg( 3 );
+
+static void BM_http_process_read( bench_state& state ) {
+    const char* request = corpus[ state.range( 0 ) ];
+    int len = strlen( request );
+    http_conn_bench bench;
+    stdout_silencer silence;          // process_read会把每一行打印出来
+    int result = 0;
+    for ( auto _ : state ) {
+        bench.load( request, len );
+        result = bench.process_read();
+    }
+    do_not_optimize( result );
+    state.set_items_processed( state.iterations() );
+    state.set_bytes_processed( state.iterations() * len );
+    static const char* names[] = { "NO_REQUEST", "GET_REQUEST", "BAD_REQUEST", "NO_RESOURCE",
+                                   "FORBIDDEN_REQUEST", "FILE_REQUEST", "INTERNAL_ERROR", "SERVICE_UNAVAILABLE", "TOO_MANY_REQUESTS", "CLOSED_CONNECTION",
+                                   "FILE_PENDING" };
+    state.set_label( names[ result ] );
+}
+BENCHMARK( BM_http_process_read )->arg( 0 )->arg( 1 )->arg( 2 )->arg( 3 )->arg( 4 );
+
+// 一个请求分多次到达：每次多读入一段，都要重新调用process_read
+static void BM_http_process_read_partial( bench_state& state ) {
+    const char* request = corpus[ 2 ];
+    int len = strlen( request );
+    int chunk = state.range( 0 );
+    http_conn_bench bench;
+    stdout_silencer silence;          // process_read会把每一行打印出来
+    int result = 0;
+    for ( auto _ : state ) {
+        bench.load( request, 0 );
+        for ( int off = 0; off < len; off += chunk ) {
+            int n = ( len - off < chunk ) ? len - off : chunk;
+            bench.append( request + off, off, n );
+            result = bench.process_read();
+        }
+    }
+    do_not_optimize( result );
+    state.set_items_processed( state.iterations() );
+    state.set_bytes_processed( state.iterations() * len );
+}
+BENCHMARK( BM_http_process_read_partial )->arg( 16 )->arg( 64 )->arg( 256 );
+
+// 长连接上每个请求结束时的重置，轮流作用在n个连接上：连接多时它们的状态和缓冲区都不在缓存中
+static void BM_http_reset( bench_state& state ) {
+    int n = state.range( 0 );
+    http_conn_bench bench;          // 设置缓冲区大小
+    size_t slot = http_conn::m_read_buf_size + http_conn::m_write_buf_size + http_conn::FILENAME_LEN;
+    std::vector< char > buffers( slot * n );
+    http_conn* conns = new http_conn[ n ];
+    for ( int i = 0; i < n; ++i ) {
+        http_conn_bench::attach( conns[i], &buffers[ slot * i ] );
+    }
+    int i = 0;
+    for ( auto _ : state ) {
+        http_conn_bench::reset( conns[i] );
+        i = ( i + 1 == n ) ? 0 : i + 1;
+    }
+    delete [] conns;
+    state.set_items_processed( state.iterations() );
+}
+BENCHMARK( BM_http_reset )->arg( 1 )->arg( 4096 );
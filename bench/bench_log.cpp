@@ -0,0 +1,77 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <vector>
+#include "benchmark.h"
+#include "../log.h"
+
+/*
+    Log::write_log 的开销，用法和服务器中的LOG_INFO相同（每条日志之后flush）
+    参数是同时写日志的线程数，日志写到临时目录中
+    Log是单例，只能从同步切换到异步，所以同步的测试必须先运行（注册顺序保证了这一点）
+*/
+
+static bool log_init( bool async ) {
+    static char dir[] = "/tmp/webserver_bench_XXXXXX";
+    static bool have_dir = false;
+    static int mode = -1;           // -1 未初始化，0 同步，1 异步
+    if ( mode == ( async ? 1 : 0 ) ) {
+        return true;
+    }
+    if ( mode == 1 ) {
+        return false;
+    }
+    if ( !have_dir ) {
+        if ( !mkdtemp( dir ) ) {
+            return false;
+        }
+        have_dir = true;
+    }
+    std::string file = std::string( dir ) + "/bench.log";
+    if ( !Log::get_instance()->init( file.c_str(), 0, 2000, 800000, async ? 800 : 0 ) ) {
+        return false;
+    }
+    mode = async ? 1 : 0;
+    return true;
+}
+
+struct log_writer {
+    long m_lines;
+};
+
+static void* write_lines( void* arg ) {
+    log_writer* w = ( log_writer* )arg;
+    for ( long i = 0; i < w->m_lines; ++i ) {
+        LOG_INFO( "%s", "GET /index.html HTTP/1.1 200 keep-alive" );
+    }
+    return NULL;
+}
+
+static void run_log( bench_state& state, bool async ) {
+    if ( !log_init( async ) ) {
+        state.set_label( "skipped: log already async or init failed" );
+        return;
+    }
+    int threads = state.range( 0 );
+    log_writer w = { ( state.iterations() + threads - 1 ) / threads };
+    std::vector< pthread_t > tids( threads );
+    state.resume_timing();
+    for ( int i = 0; i < threads; ++i ) {
+        pthread_create( &tids[i], NULL, write_lines, &w );
+    }
+    for ( int i = 0; i < threads; ++i ) {
+        pthread_join( tids[i], NULL );
+    }
+    state.pause_timing();
+    state.set_items_processed( w.m_lines * threads );
+}
+
+static void BM_log_write_sync( bench_state& state ) {
+    run_log( state, false );
+}
+BENCHMARK( BM_log_write_sync )->arg( 1 )->arg( 4 );
+
+static void BM_log_write_async( bench_state& state ) {
+    run_log( state, true );
+}
+BENCHMARK( BM_log_write_async )->arg( 1 )->arg( 4 );
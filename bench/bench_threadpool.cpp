@@ -0,0 +1,103 @@
+#include <sched.h>
+#include <atomic>
+#include "benchmark.h"
+#include "../threadpool.h"
+
+/*
+    线程池的吞吐量：主线程不断append空任务，工作线程取出并执行
+    参数是工作线程数，每次迭代是一个任务从入队到执行完
+    BM_threadpool_append_batch的第二个参数是每次append_batch添加的任务数，模拟一轮epoll_wait返回的事件；
+    标签中的per_dequeue是工作线程平均每次从队列取出的任务数
+    BM_threadpool_lanes同BM_threadpool_append_batch，但任务交替放进权重为8和1的两个优先级通道，多出的是加权轮询的开销
+*/
+
+struct empty_task {
+    std::atomic< long >* m_done;
+    void process() { m_done->fetch_add( 1, std::memory_order_relaxed ); }
+    void shed() { m_done->fetch_add( 1, std::memory_order_relaxed ); }
+};
+
+static std::string per_dequeue( threadpool< empty_task >& pool ) {
+    unsigned long dequeues = pool.dequeues( 0 );
+    char buf[ 32 ];
+    snprintf( buf, sizeof( buf ), "%.1f", dequeues ? ( double )pool.processed( 0 ) / dequeues : 0.0 );
+    return buf;
+}
+
+static void BM_threadpool_append( bench_state& state ) {
+    std::atomic< long > done( 0 );
+    empty_task task = { &done };
+    stdout_silencer silence;          // 创建线程时会打印
+    threadpool< empty_task > pool( state.range( 0 ), 10000 );
+    long rejected = 0;
+    for ( auto _ : state ) {
+        // 请求队列满时append失败，让出CPU等工作线程取走一些再试
+        while ( !pool.append( &task ) ) {
+            ++rejected;
+            sched_yield();
+        }
+    }
+    // 计时包括等待所有任务执行完
+    state.resume_timing();
+    while ( done.load() < state.iterations() ) {
+        sched_yield();
+    }
+    state.pause_timing();
+    state.set_items_processed( state.iterations() );
+    state.set_label( "rejected=" + std::to_string( rejected ) + " per_dequeue=" + per_dequeue( pool ) );
+}
+BENCHMARK( BM_threadpool_append )->arg( 1 )->arg( 2 )->arg( 4 )->arg( 8 );
+
+static void run_append_batch( bench_state& state, int lane_number ) {
+    std::atomic< long > done( 0 );
+    empty_task task = { &done };
+    stdout_silencer silence;
+    threadpool< empty_task > pool( state.range( 0 ), 10000 );
+    std::vector< int > weights( 1, 8 );
+    weights.resize( lane_number, 1 );
+    pool.set_lanes( weights );
+    int batch_size = state.range( 1 );
+    std::vector< empty_task* > batch( batch_size, &task );
+    std::vector< int > lanes( batch_size );
+    for ( int i = 0; i < batch_size; ++i ) {
+        lanes[i] = i % lane_number;
+    }
+    std::vector< empty_task* > rejected( batch_size );
+    std::vector< empty_task* > retry( batch_size );
+    long rejected_count = 0;
+    // 添加n个任务，被拒绝的让出CPU之后重新添加（重新添加的都放进通道0）
+    auto push = [&]( int n ) {
+        n = pool.append_batch( batch.data(), NULL, lanes.data(), n, rejected.data() );
+        while ( n > 0 ) {
+            rejected_count += n;
+            sched_yield();
+            retry.swap( rejected );
+            n = pool.append_batch( retry.data(), NULL, NULL, n, rejected.data() );
+        }
+    };
+    int pending = 0;
+    for ( auto _ : state ) {
+        if ( ++pending == batch_size ) {
+            push( pending );
+            pending = 0;
+        }
+    }
+    state.resume_timing();
+    push( pending );
+    while ( done.load() < state.iterations() ) {
+        sched_yield();
+    }
+    state.pause_timing();
+    state.set_items_processed( state.iterations() );
+    state.set_label( "rejected=" + std::to_string( rejected_count ) + " per_dequeue=" + per_dequeue( pool ) );
+}
+
+static void BM_threadpool_append_batch( bench_state& state ) {
+    run_append_batch( state, 1 );
+}
+BENCHMARK( BM_threadpool_append_batch )->args( { 4, 1 } )->args( { 4, 16 } )->args( { 4, 64 } )->args( { 8, 64 } );
+
+static void BM_threadpool_lanes( bench_state& state ) {
+    run_append_batch( state, 2 );
+}
+BENCHMARK( BM_threadpool_lanes )->args( { 4, 16 } )->args( { 4, 64 } );
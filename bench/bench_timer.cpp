@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include <vector>
+#include "benchmark.h"
+#include "../noactive/lst_timer.h"
+
+/*
+    升序定时器链表 sort_timer_lst 的各项操作，参数是链表中已有的定时器个数
+    add_timer和adjust_timer都要从头（或当前位置）线性查找插入位置，开销随定时器个数线性增长
+*/
+
+static void noop( client_data* ) {}
+
+static util_timer* new_timer( time_t expire ) {
+    util_timer* timer = new util_timer;
+    timer->expire = expire;
+    timer->cb_func = noop;
+    timer->user_data = NULL;
+    return timer;
+}
+
+// 添加一个随机超时时间的定时器，再删除它
+static void BM_timer_add_del( bench_state& state ) {
+    int n = state.range( 0 );
+    sort_timer_lst lst;
+    for ( int i = 0; i < n; ++i ) {
+        lst.add_timer( new_timer( i ) );
+    }
+    unsigned int seed = 1;
+    for ( auto _ : state ) {
+        util_timer* timer = new_timer( rand_r( &seed ) % ( n + 1 ) );
+        lst.add_timer( timer );
+        lst.del_timer( timer );
+    }
+    state.set_items_processed( state.iterations() );
+}
+BENCHMARK( BM_timer_add_del )->range( 8, 4096 );
+
+// 连接上有数据到达时延长它的定时器（服务器最频繁的操作）：把最早到期的定时器移到最后
+static void BM_timer_adjust( bench_state& state ) {
+    int n = state.range( 0 );
+    sort_timer_lst lst;
+    std::vector< util_timer* > timers;
+    for ( int i = 0; i < n; ++i ) {
+        timers.push_back( new_timer( i ) );
+        lst.add_timer( timers.back() );
+    }
+    time_t next = n;
+    size_t i = 0;
+    for ( auto _ : state ) {
+        util_timer* timer = timers[ i ];
+        timer->expire = next++;
+        lst.adjust_timer( timer );
+        i = ( i + 1 ) % timers.size();
+    }
+    state.set_items_processed( state.iterations() );
+}
+BENCHMARK( BM_timer_adjust )->range( 8, 4096 );
+
+// tick处理到期的定时器，每次迭代处理n个
+static void BM_timer_tick( bench_state& state ) {
+    int n = state.range( 0 );
+    sort_timer_lst lst;
+    stdout_silencer silence;          // tick每次都会打印
+    for ( auto _ : state ) {
+        state.pause_timing();
+        for ( int i = 0; i < n; ++i ) {
+            lst.add_timer( new_timer( 0 ) );
+        }
+        state.resume_timing();
+        lst.tick();
+    }
+    state.set_items_processed( state.iterations() * n );
+}
+BENCHMARK( BM_timer_tick )->range( 8, 4096 );
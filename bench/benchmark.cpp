@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <regex.h>
+#include "benchmark.h"
+
+static int64_t clock_ns( clockid_t clock ) {
+    struct timespec ts;
+    clock_gettime( clock, &ts );
+    return ( int64_t )ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+bench_state::bench_state( int64_t iterations, const std::vector< int64_t >& args )
+        : m_iterations( iterations ), m_args( args ), m_items( 0 ), m_bytes( 0 ), m_running( false ),
+          m_real_start( 0 ), m_cpu_start( 0 ), m_real_ns( 0 ), m_cpu_ns( 0 ) {
+    m_args.resize( 4, 0 );
+}
+
+bench_state::iterator bench_state::begin() {
+    resume_timing();
+    iterator it = { this, m_iterations };
+    return it;
+}
+
+void bench_state::pause_timing() {
+    if ( m_running ) {
+        m_real_ns += clock_ns( CLOCK_MONOTONIC ) - m_real_start;
+        m_cpu_ns += clock_ns( CLOCK_PROCESS_CPUTIME_ID ) - m_cpu_start;
+        m_running = false;
+    }
+}
+
+void bench_state::resume_timing() {
+    if ( !m_running ) {
+        m_real_start = clock_ns( CLOCK_MONOTONIC );
+        m_cpu_start = clock_ns( CLOCK_PROCESS_CPUTIME_ID );
+        m_running = true;
+    }
+}
+
+void bench_state::finish() {
+    pause_timing();
+}
+
+static std::vector< bench_registration* >& registry() {
+    static std::vector< bench_registration* > benchmarks;
+    return benchmarks;
+}
+
+bench_registration::bench_registration( const char* name, function fn ) : m_name( name ), m_fn( fn ) {
+    registry().push_back( this );
+}
+
+bench_registration* bench_registration::arg( int64_t value ) {
+    m_arg_sets.push_back( std::vector< int64_t >( 1, value ) );
+    return this;
+}
+
+bench_registration* bench_registration::args( const std::vector< int64_t >& values ) {
+    m_arg_sets.push_back( values );
+    return this;
+}
+
+bench_registration* bench_registration::range( int64_t start, int64_t limit ) {
+    for ( int64_t v = start; v < limit; v *= 8 ) {
+        arg( v );
+    }
+    return arg( limit );
+}
+
+// 一次测试的结果
+struct bench_result {
+    std::string name;
+    int64_t iterations;
+    double real_time;       // 每次迭代的纳秒数
+    double cpu_time;
+    double items_per_second;
+    double bytes_per_second;
+    std::string label;
+};
+
+class bench_runner {
+public:
+    bench_runner() : m_min_time( 0.5 ), m_repetitions( 1 ), m_json( false ), m_list( false ), m_has_filter( false ) {}
+    ~bench_runner() {
+        if ( m_has_filter ) {
+            regfree( &m_filter );
+        }
+    }
+
+    bool parse_arg( int argc, char* argv[] );
+    int run();
+
+private:
+    bench_result run_one( bench_registration* b, const std::string& name, const std::vector< int64_t >& args );
+    void print_console( const bench_result& r );
+    bool write_json( FILE* fp, const char* executable );
+
+    double m_min_time;
+    int m_repetitions;
+    bool m_json;
+    bool m_list;
+    bool m_has_filter;
+    regex_t m_filter;
+    std::string m_out;
+    std::string m_executable;
+    std::vector< bench_result > m_results;
+};
+
+static bool starts_with( const char* s, const char* prefix, const char** value ) {
+    size_t n = strlen( prefix );
+    if ( strncmp( s, prefix, n ) != 0 ) {
+        return false;
+    }
+    *value = s + n;
+    return true;
+}
+
+bool bench_runner::parse_arg( int argc, char* argv[] ) {
+    m_executable = argv[0];
+    for ( int i = 1; i < argc; ++i ) {
+        const char* v = NULL;
+        if ( starts_with( argv[i], "--benchmark_filter=", &v ) ) {
+            if ( regcomp( &m_filter, v, REG_EXTENDED | REG_NOSUB ) != 0 ) {
+                fprintf( stderr, "invalid filter: %s\n", v );
+                return false;
+            }
+            m_has_filter = true;
+        } else if ( starts_with( argv[i], "--benchmark_min_time=", &v ) ) {
+            m_min_time = atof( v );
+        } else if ( starts_with( argv[i], "--benchmark_repetitions=", &v ) ) {
+            m_repetitions = atoi( v ) > 0 ? atoi( v ) : 1;
+        } else if ( starts_with( argv[i], "--benchmark_format=", &v ) ) {
+            m_json = strcmp( v, "json" ) == 0;
+        } else if ( starts_with( argv[i], "--benchmark_out=", &v ) ) {
+            m_out = v;
+        } else if ( strcmp( argv[i], "--benchmark_list_tests" ) == 0 ) {
+            m_list = true;
+        } else {
+            fprintf( stderr, "usage: %s [--benchmark_filter=<regex>] [--benchmark_min_time=<sec>] "
+                     "[--benchmark_repetitions=<n>] [--benchmark_format=console|json] [--benchmark_out=<file>] "
+                     "[--benchmark_list_tests]\n", argv[0] );
+            return false;
+        }
+    }
+    return true;
+}
+
+bench_result bench_runner::run_one( bench_registration* b, const std::string& name, const std::vector< int64_t >& args ) {
+    // 从1次迭代开始，按照已经用掉的时间估计需要的迭代次数，直到运行时间超过m_min_time
+    int64_t iterations = 1;
+    while ( true ) {
+        bench_state state( iterations, args );
+        b->m_fn( state );
+        state.finish();
+        double seconds = state.m_real_ns / 1e9;
+        if ( seconds >= m_min_time || iterations >= 1000000000LL ) {
+            bench_result r;
+            r.name = name;
+            r.iterations = iterations;
+            r.real_time = ( double )state.m_real_ns / iterations;
+            r.cpu_time = ( double )state.m_cpu_ns / iterations;
+            r.items_per_second = seconds > 0 ? state.m_items / seconds : 0;
+            r.bytes_per_second = seconds > 0 ? state.m_bytes / seconds : 0;
+            r.label = state.m_label;
+            return r;
+        }
+        double multiplier = seconds > 0 ? m_min_time * 1.4 / seconds : 10;
+        if ( multiplier > 10 || seconds / m_min_time < 0.1 ) {
+            multiplier = 10;
+        }
+        int64_t next = ( int64_t )( iterations * multiplier );
+        iterations = next > iterations ? next : iterations + 1;
+    }
+}
+
+static std::string human( double value, const char* unit ) {
+    static const char* prefixes[] = { "", "k", "M", "G", "T" };
+    int i = 0;
+    while ( value >= 1000 && i < 4 ) {
+        value /= 1000;
+        ++i;
+    }
+    char buf[ 64 ];
+    snprintf( buf, sizeof( buf ), "%.4g%s%s", value, prefixes[i], unit );
+    return buf;
+}
+
+void bench_runner::print_console( const bench_result& r ) {
+    printf( "%-48s %12.0f ns %12.0f ns %12lld", r.name.c_str(), r.real_time, r.cpu_time, ( long long )r.iterations );
+    if ( r.items_per_second > 0 ) {
+        printf( " items_per_second=%s", human( r.items_per_second, "/s" ).c_str() );
+    }
+    if ( r.bytes_per_second > 0 ) {
+        printf( " bytes_per_second=%s", human( r.bytes_per_second, "B/s" ).c_str() );
+    }
+    if ( !r.label.empty() ) {
+        printf( " %s", r.label.c_str() );
+    }
+    printf( "\n" );
+    fflush( stdout );
+}
+
+static void json_string( FILE* fp, const std::string& s ) {
+    fputc( '"', fp );
+    for ( size_t i = 0; i < s.size(); ++i ) {
+        unsigned char c = s[i];
+        if ( c == '"' || c == '\\' ) {
+            fprintf( fp, "\\%c", c );
+        } else if ( c < 0x20 ) {
+            fprintf( fp, "\\u%04x", c );
+        } else {
+            fputc( c, fp );
+        }
+    }
+    fputc( '"', fp );
+}
+
+bool bench_runner::write_json( FILE* fp, const char* executable ) {
+    char date[ 64 ];
+    time_t t = time( NULL );
+    strftime( date, sizeof( date ), "%Y-%m-%dT%H:%M:%S%z", localtime( &t ) );
+    char host[ 256 ] = { 0 };
+    gethostname( host, sizeof( host ) - 1 );
+
+    fprintf( fp, "{\n  \"context\": {\n" );
+    fprintf( fp, "    \"date\": \"%s\",\n", date );
+    fprintf( fp, "    \"host_name\": " );
+    json_string( fp, host );
+    fprintf( fp, ",\n    \"executable\": " );
+    json_string( fp, executable );
+    fprintf( fp, ",\n    \"num_cpus\": %ld,\n", sysconf( _SC_NPROCESSORS_ONLN ) );
+#ifdef NDEBUG
+    fprintf( fp, "    \"library_build_type\": \"release\"\n" );
+#else
+    fprintf( fp, "    \"library_build_type\": \"debug\"\n" );
+#endif
+    fprintf( fp, "  },\n  \"benchmarks\": [\n" );
+    for ( size_t i = 0; i < m_results.size(); ++i ) {
+        const bench_result& r = m_results[i];
+        fprintf( fp, "    {\n      \"name\": " );
+        json_string( fp, r.name );
+        fprintf( fp, ",\n      \"run_name\": " );
+        json_string( fp, r.name );
+        fprintf( fp, ",\n      \"run_type\": \"iteration\",\n" );
+        fprintf( fp, "      \"iterations\": %lld,\n", ( long long )r.iterations );
+        fprintf( fp, "      \"real_time\": %.6e,\n", r.real_time );
+        fprintf( fp, "      \"cpu_time\": %.6e,\n", r.cpu_time );
+        fprintf( fp, "      \"time_unit\": \"ns\"" );
+        if ( r.items_per_second > 0 ) {
+            fprintf( fp, ",\n      \"items_per_second\": %.6e", r.items_per_second );
+        }
+        if ( r.bytes_per_second > 0 ) {
+            fprintf( fp, ",\n      \"bytes_per_second\": %.6e", r.bytes_per_second );
+        }
+        if ( !r.label.empty() ) {
+            fprintf( fp, ",\n      \"label\": " );
+            json_string( fp, r.label );
+        }
+        fprintf( fp, "\n    }%s\n", i + 1 < m_results.size() ? "," : "" );
+    }
+    fprintf( fp, "  ]\n}\n" );
+    return !ferror( fp );
+}
+
+int bench_runner::run() {
+    if ( !m_json && !m_list ) {
+        printf( "%-48s %15s %15s %12s\n", "Benchmark", "Time", "CPU", "Iterations" );
+        printf( "%s\n", std::string( 94, '-' ).c_str() );
+    }
+    std::vector< bench_registration* >& benchmarks = registry();
+    for ( size_t i = 0; i < benchmarks.size(); ++i ) {
+        bench_registration* b = benchmarks[i];
+        std::vector< std::vector< int64_t > > arg_sets = b->m_arg_sets;
+        if ( arg_sets.empty() ) {
+            arg_sets.push_back( std::vector< int64_t >() );
+        }
+        for ( size_t j = 0; j < arg_sets.size(); ++j ) {
+            std::string name = b->m_name;
+            for ( size_t k = 0; k < arg_sets[j].size(); ++k ) {
+                name += "/" + std::to_string( ( long long )arg_sets[j][k] );
+            }
+            if ( m_has_filter && regexec( &m_filter, name.c_str(), 0, NULL, 0 ) != 0 ) {
+                continue;
+            }
+            if ( m_list ) {
+                printf( "%s\n", name.c_str() );
+                continue;
+            }
+            for ( int rep = 0; rep < m_repetitions; ++rep ) {
+                bench_result r = run_one( b, name, arg_sets[j] );
+                m_results.push_back( r );
+                if ( !m_json ) {
+                    print_console( r );
+                }
+            }
+        }
+    }
+    if ( m_list ) {
+        return 0;
+    }
+    if ( m_json ) {
+        write_json( stdout, m_executable.c_str() );
+    }
+    if ( !m_out.empty() ) {
+        FILE* fp = fopen( m_out.c_str(), "w" );
+        if ( !fp || !write_json( fp, m_executable.c_str() ) ) {
+            fprintf( stderr, "cannot write %s\n", m_out.c_str() );
+            if ( fp ) {
+                fclose( fp );
+            }
+            return 1;
+        }
+        fclose( fp );
+    }
+    return 0;
+}
+
+int main( int argc, char* argv[] ) {
+    bench_runner runner;
+    if ( !runner.parse_arg( argc, argv ) ) {
+        return 2;
+    }
+    return runner.run();
+}
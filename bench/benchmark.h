@@ -0,0 +1,132 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+/*
+    微基准测试框架，接口和输出格式模仿 Google Benchmark，但不依赖它
+    用法：
+        static void BM_foo( bench_state& state ) {
+            // 准备工作，不计时
+            for ( auto _ : state ) {
+                // 被测的代码，执行 state.iterations() 次
+            }
+            state.set_items_processed( state.iterations() );
+        }
+        BENCHMARK( BM_foo )->arg( 8 )->arg( 64 );      // 每个arg单独运行一次，用 state.range() 取得
+
+    框架自动增加迭代次数，直到一次运行的时间超过 --benchmark_min_time 秒。
+    命令行：
+        --benchmark_filter=<正则>       只运行名字匹配的测试
+        --benchmark_min_time=<秒>       每个测试至少运行的时间，默认0.5
+        --benchmark_repetitions=<n>     每个测试重复运行n次
+        --benchmark_format=console|json 标准输出的格式
+        --benchmark_out=<文件>          另外把JSON结果写到文件中（可以用Google Benchmark的compare.py比较两次的结果）
+        --benchmark_list_tests          只列出测试的名字
+*/
+
+class bench_state {
+public:
+    // 支持 for ( auto _ : state )，循环结束时自动停止计时
+    struct iterator {
+        bench_state* m_state;
+        int64_t m_left;
+        bool operator!=( const iterator& ) {
+            if ( m_left != 0 ) {
+                return true;
+            }
+            m_state->pause_timing();
+            return false;
+        }
+        void operator++() { --m_left; }
+        struct __attribute__(( unused )) value {};   // 循环变量_不会被用到
+        value operator*() const { return value(); }
+    };
+    iterator begin();
+    iterator end() { iterator it = { this, 0 }; return it; }
+
+    int64_t iterations() const { return m_iterations; }
+    int64_t range( int i = 0 ) const { return m_args[i]; }
+
+    void pause_timing();            // 暂停计时，用于循环中不需要计时的准备工作
+    void resume_timing();
+    void set_items_processed( int64_t items ) { m_items = items; }
+    void set_bytes_processed( int64_t bytes ) { m_bytes = bytes; }
+    void set_label( const std::string& label ) { m_label = label; }
+
+private:
+    friend class bench_runner;
+    bench_state( int64_t iterations, const std::vector< int64_t >& args );
+    void finish();
+
+    int64_t m_iterations;
+    std::vector< int64_t > m_args;
+    int64_t m_items;
+    int64_t m_bytes;
+    std::string m_label;
+
+    bool m_running;
+    int64_t m_real_start;       // 本段计时开始时的挂钟时间和进程CPU时间（纳秒）
+    int64_t m_cpu_start;
+    int64_t m_real_ns;          // 累计的计时
+    int64_t m_cpu_ns;
+};
+
+class bench_registration {
+public:
+    typedef void ( *function )( bench_state& );
+    bench_registration( const char* name, function fn );
+
+    bench_registration* arg( int64_t value );                       // 增加一组参数
+    bench_registration* args( const std::vector< int64_t >& values );
+    bench_registration* range( int64_t start, int64_t limit );     // start, start*8, ... , limit
+
+private:
+    friend class bench_runner;
+    std::string m_name;
+    function m_fn;
+    std::vector< std::vector< int64_t > > m_arg_sets;
+};
+
+#define BENCHMARK_CONCAT2( a, b ) a##b
+#define BENCHMARK_CONCAT( a, b ) BENCHMARK_CONCAT2( a, b )
+#define BENCHMARK( fn ) \
+    static bench_registration* BENCHMARK_CONCAT( bench_registration_, __LINE__ ) __attribute__(( unused )) = \
+        ( new bench_registration( #fn, fn ) )
+
+// 防止编译器把结果没有被用到的计算优化掉
+template< typename T >
+inline void do_not_optimize( const T& value ) {
+    asm volatile( "" : : "r,m"( value ) : "memory" );
+}
+
+inline void clobber_memory() {
+    asm volatile( "" : : : "memory" );
+}
+
+// 被测的代码会往标准输出打印调试信息，在作用域内把标准输出重定向到/dev/null，以免和测试结果混在一起
+class stdout_silencer {
+public:
+    stdout_silencer() {
+        fflush( stdout );
+        m_saved = dup( STDOUT_FILENO );
+        int null = open( "/dev/null", O_WRONLY );
+        dup2( null, STDOUT_FILENO );
+        close( null );
+    }
+    ~stdout_silencer() {
+        fflush( stdout );
+        dup2( m_saved, STDOUT_FILENO );
+        close( m_saved );
+    }
+
+private:
+    int m_saved;
+};
+
+#endif
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <vector>
+#include "../http_conn.h"
+#include "../classifier.h"
+#include "../io_offload.h"
+
+/*
+    检查交给I/O线程打开文件的请求回到主线程之后仍然进入正确的通道
+    IO_PROACTOR模型下主线程按请求行中的路径分类；文件不在缓存中时工作线程把请求交给I/O线程打开，
+    完成后主线程再按lane()把它交给工作线程，这时请求行已经被解析改写，只能沿用之前的结果或者按文件大小分类。
+    在临时的网站根目录下放三个没有缓存的文件：bulk_prefixes下的小文件、超过bulk_size的大文件和普通的小文件，
+    按main.cpp的顺序驱动请求，检查读完请求和打开文件之后两次选择的通道。
+    用法：lane_check，出错时返回1
+*/
+
+static const int MAX_FD = 64;
+static const int BULK_SIZE = 64 * 1024;
+static http_conn* users = NULL;
+static std::vector< http_conn* > done;
+
+struct lane_case {
+    const char* m_url;
+    int m_size;
+    int m_read_lane;        // 读完请求时的通道
+    int m_open_lane;        // 打开文件之后的通道
+};
+
+static bool write_file( const char* dir, const char* name, int size ) {
+    char path[ 256 ];
+    snprintf( path, sizeof( path ), "%s/%s", dir, name );
+    int fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if ( fd == -1 ) {
+        return false;
+    }
+    std::vector< char > data( size, 'x' );
+    bool ok = write( fd, data.data(), size ) == size;
+    close( fd );
+    return ok;
+}
+
+// 按main.cpp的顺序处理一个请求，本线程同时充当工作线程。结果写到line，返回错误数
+static int run( const lane_case& c, char* line, size_t size ) {
+    int fds[2];
+    if ( socketpair( AF_UNIX, SOCK_STREAM, 0, fds ) == -1 ) {
+        return 1;
+    }
+    sockaddr_storage addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.ss_family = AF_UNIX;
+    http_conn* conn = users + fds[1];
+    conn->init( fds[1], addr );
+
+    char request[ 256 ];
+    int len = snprintf( request, sizeof( request ), "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n", c.m_url );
+    send( fds[0], request, len, 0 );
+    unsigned long opened = io_offload::get_instance()->submitted( io_offload::OP_OPEN );
+
+    int errors = 0;
+    int read_lane = -1, open_lane = -1;
+    if ( !conn->claim() || !conn->read() ) {
+        errors = 1;
+    } else {
+        conn->to_worker( EPOLLIN );
+        read_lane = conn->lane();
+        conn->process();
+        if ( io_offload::get_instance()->submitted( io_offload::OP_OPEN ) == opened ) {
+            errors = 1;         // 没有交给I/O线程
+        } else {
+            struct pollfd pfd = { io_offload::get_instance()->notify_fd(), POLLIN, 0 };
+            poll( &pfd, 1, 5000 );
+            io_offload::get_instance()->take_completed( done );
+            if ( done.size() != 1 || done[0] != conn ) {
+                errors = 1;
+            } else {
+                conn->from_io();
+                conn->to_worker( EPOLLIN );
+                open_lane = conn->lane();
+                conn->process();
+            }
+        }
+    }
+    errors += read_lane != c.m_read_lane;
+    errors += open_lane != c.m_open_lane;
+    snprintf( line, size, "%-24s read lane %2d (want %d), lane after open %2d (want %d)",
+              c.m_url, read_lane, c.m_read_lane, open_lane, c.m_open_lane );
+
+    // 应答发完之后连接回到epoll中，从这里关闭
+    close( fds[0] );
+    if ( conn->claim() ) {
+        conn->close_conn();
+    }
+    return errors;
+}
+
+int main() {
+    signal( SIGPIPE, SIG_IGN );
+    char dir[] = "/tmp/webserver_lane_XXXXXX";
+    if ( !mkdtemp( dir ) ) {
+        perror( "mkdtemp" );
+        return 2;
+    }
+    char sub[ 64 ];
+    snprintf( sub, sizeof( sub ), "%s/download", dir );
+    mkdir( sub, 0755 );
+    const int interactive = request_classifier::LANE_INTERACTIVE;
+    const int bulk = request_classifier::LANE_BULK;
+    static const lane_case cases[] = {
+        { "/download/small.bin", 1000,          bulk,        bulk },            // 按路径
+        { "/big.bin",            BULK_SIZE * 2, interactive, bulk },            // 打开之后按大小
+        { "/small.html",         1000,          interactive, interactive },
+    };
+    const int count = sizeof( cases ) / sizeof( cases[0] );
+    bool ok = write_file( dir, "download/small.bin", cases[0].m_size )
+              && write_file( dir, "big.bin", cases[1].m_size )
+              && write_file( dir, "small.html", cases[2].m_size );
+
+    ok = ok && request_classifier::get_instance()->init( "8,1", "/download/", BULK_SIZE, "" )
+         && file_cache::get_instance()->init( dir, 4 * BULK_SIZE, 32 * 1024 * 1024, 1024 )
+         && io_offload::get_instance()->init( 1, 16 )
+         && http_conn::init_buffers( MAX_FD, 1 );
+    int errors = 0;
+    if ( !ok ) {
+        fprintf( stderr, "init failed\n" );
+        errors = -1;
+    } else {
+        http_conn::m_epollfd = epoll_create( 5 );
+        users = new http_conn[ MAX_FD ];
+        done.reserve( 16 );
+        // 解析请求时打印的调试信息不输出
+        char lines[ count ][ 128 ];
+        fflush( stdout );
+        int saved_stdout = dup( 1 );
+        int null = open( "/dev/null", O_WRONLY );
+        dup2( null, 1 );
+        for ( int i = 0; i < count; ++i ) {
+            errors += run( cases[i], lines[i], sizeof( lines[i] ) );
+        }
+        fflush( stdout );
+        dup2( saved_stdout, 1 );
+        close( null );
+        for ( int i = 0; i < count; ++i ) {
+            printf( "%s\n", lines[i] );
+        }
+        io_offload::get_instance()->stop();
+    }
+
+    snprintf( sub, sizeof( sub ), "%s/download/small.bin", dir );
+    unlink( sub );
+    snprintf( sub, sizeof( sub ), "%s/download", dir );
+    rmdir( sub );
+    snprintf( sub, sizeof( sub ), "%s/big.bin", dir );
+    unlink( sub );
+    snprintf( sub, sizeof( sub ), "%s/small.html", dir );
+    unlink( sub );
+    rmdir( dir );
+    if ( errors < 0 ) {
+        return 2;
+    }
+    printf( "%s\n", errors == 0 ? "PASS" : "FAIL" );
+    return errors == 0 ? 0 : 1;
+}
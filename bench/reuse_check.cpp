@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <atomic>
+#include "../http_conn.h"
+
+/*
+    检查工作线程关闭连接时，fd马上被主线程复用的情况
+    工作线程调用close_conn的同时，主线程一看到连接标记为CONN_CLOSED（即main.cpp中accept之后closed()的检查）
+    就不停地dup，拿到和被关闭的连接相同的fd号之后立即init。close_conn必须在标记之前完成对连接对象的所有写入，
+    否则init之后工作线程又会把新连接改成CONN_CLOSED、再减一次连接数、释放新连接的限速表项。
+    两个线程真正交错的机会取决于调度，所以另外替换close：工作线程关闭socket的那一刻，连接必须已经是CONN_CLOSED、
+    连接数已经减掉，这一点不依赖时机，单CPU上也能检查出来。
+    用法：reuse_check [次数]，出错时返回1。用TSan构建（cmake -DCMAKE_BUILD_TYPE=TSan）运行时还会检查
+    init和close_conn之间的数据竞争
+*/
+
+static http_conn* users = NULL;
+static std::atomic< int > closing( -1 );    // 要工作线程关闭的fd，-1表示没有
+static std::atomic< bool > stop( false );
+static std::atomic< int > early_close( 0 );     // 关闭socket时连接对象还没有处理完的次数
+
+// 工作线程在close_conn中关闭socket时，对象的写入必须都已经完成
+extern "C" int close( int fd ) {
+    if ( fd >= 0 && fd == closing.load( std::memory_order_relaxed ) ) {
+        if ( !users[ fd ].closed() || http_conn::m_user_count != 0 ) {
+            early_close.fetch_add( 1, std::memory_order_relaxed );
+        }
+    }
+    return syscall( SYS_close, fd );
+}
+
+// 工作线程：关闭主线程交过来的连接
+static void* closer( void* ) {
+    while ( !stop.load( std::memory_order_acquire ) ) {
+        int fd = closing.load( std::memory_order_acquire );
+        if ( fd < 0 ) {
+            sched_yield();
+            continue;
+        }
+        users[ fd ].close_conn();
+        closing.store( -1, std::memory_order_release );
+    }
+    return NULL;
+}
+
+int main( int argc, char* argv[] ) {
+    int rounds = argc > 1 && atoi( argv[1] ) > 0 ? atoi( argv[1] ) : 20000;
+    const int max_fd = 1024;
+    if ( !http_conn::init_buffers( max_fd, 1 ) ) {
+        fprintf( stderr, "init failed\n" );
+        return 2;
+    }
+    http_conn::m_epollfd = epoll_create( 5 );
+    users = new http_conn[ max_fd ];
+    int peer[2];
+    if ( socketpair( AF_UNIX, SOCK_STREAM, 0, peer ) == -1 ) {
+        perror( "socketpair" );
+        return 2;
+    }
+    sockaddr_storage addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.ss_family = AF_UNIX;
+
+    pthread_t tid;
+    pthread_create( &tid, NULL, closer, NULL );
+    int errors = 0;
+    int reused = 0;
+    int fd = dup( peer[1] );
+    users[ fd ].init( fd, addr );
+    for ( int i = 0; i < rounds && fd < max_fd; ++i ) {
+        // 取得所有权之后交给工作线程关闭，同时抢着复用这个fd号。等待的CONN_CLOSED就是main.cpp在accept之后检查的状态
+        if ( !users[ fd ].claim() ) {
+            ++errors;
+            break;
+        }
+        int old = fd;
+        closing.store( old, std::memory_order_release );
+        int next = -1;
+        while ( !users[ old ].closed() ) {
+            sched_yield();
+        }
+        while ( true ) {
+            next = dup( peer[1] );
+            if ( next == old || closing.load( std::memory_order_acquire ) == -1 ) {
+                break;
+            }
+            close( next );
+            sched_yield();
+        }
+        if ( next == old ) {
+            ++reused;
+        }
+        users[ next ].init( next, addr );
+        while ( closing.load( std::memory_order_acquire ) != -1 ) {
+            sched_yield();
+        }
+        // 工作线程结束之后，新连接仍然注册在epoll中，连接数只有它一个
+        if ( users[ next ].state() != http_conn::CONN_POLLING || http_conn::m_user_count != 1 ) {
+            ++errors;
+            http_conn::m_user_count = 1;
+        }
+        fd = next;
+    }
+    stop.store( true, std::memory_order_release );
+    pthread_join( tid, NULL );
+
+    errors += early_close;
+    printf( "%d rounds, fd reused while closing %d times, socket closed before the connection %d times, %d errors\n",
+            rounds, reused, ( int )early_close, errors );
+    printf( "%s\n", errors == 0 ? "PASS" : "FAIL" );
+    return errors == 0 ? 0 : 1;
+}
@@ -1,6 +1,7 @@
 /*************************************************************
 *循环数组实现的阻塞队列，m_back = (m_back + 1) % m_max_size;  
 *线程安全，每个操作前都要先加互斥锁，操作完后，再解锁
+*等待元素用notifier：计数是队列中的元素数，push只在有线程等待时唤醒其中一个
 **************************************************************/
 
 #ifndef BLOCK_QUEUE_H
@@ -11,6 +12,7 @@
 #include <pthread.h>
 #include <sys/time.h>
 #include "locker.h"
+#include "notifier.h"
 using namespace std;
 
 template <class T>
@@ -107,13 +109,13 @@ public:
         return tmp;
     }
 
-    //往队列添加元素，需要将所有使用队列的线程先唤醒
-    //当有元素push进队列,相当于生产者生产了一个元素
-    //若当前没有线程等待条件变量,则唤醒无意义
-    bool push(const T &item) {
+    //往队列添加元素，当有元素push进队列,相当于生产者生产了一个元素
+    //有线程在等待时只唤醒一个，没有线程等待时不进入内核
+    //item可以是能赋值给T的其他类型（如T是string时直接传入char*），赋值给数组中已有的元素，内存够用时不再分配
+    template <class U>
+    bool push(const U &item) {
         m_mutex.lock();
         if (m_size >= m_max_size) {  //队列已满
-            m_cond.broadcast();
             m_mutex.unlock();
             return false;
         }
@@ -122,59 +124,45 @@ public:
         m_array[m_back] = item;
 
         m_size++;
-
-        m_cond.broadcast();
         m_mutex.unlock();
+
+        m_ready.post();
         return true;
     }
 
-    //pop时,如果当前队列没有元素,将会等待条件变量
+    //pop时,如果当前队列没有元素,将会等待
     bool pop(T &item) {
-        m_mutex.lock();
-        while (m_size <= 0) {
-            if (!m_cond.wait(m_mutex.get())) {
-                m_mutex.unlock();
-                return false;
+        while (true) {
+            m_ready.wait();
+            if (take(item)) {
+                return true;
             }
+            //clear()清掉了这个计数对应的元素，继续等待
         }
-
-        m_front = (m_front + 1) % m_max_size;  //头删
-        item = m_array[m_front];
-        m_size--;
-        m_mutex.unlock();
-        return true;
     }
 
     //增加了超时处理
     bool pop(T &item, int ms_timeout) {
-        struct timespec t = {0, 0};
-        struct timeval now = {0, 0};
-        gettimeofday(&now, NULL);
-        m_mutex.lock();
-        if (m_size <= 0) {
-            t.tv_sec = now.tv_sec + ms_timeout / 1000;
-            t.tv_nsec = (ms_timeout % 1000) * 1000;
-            if (!m_cond.timewait(m_mutex.get(), t)) {
-                m_mutex.unlock();
-                return false;
-            }
-        }
+        return m_ready.wait(ms_timeout) && take(item);
+    }
 
+private:
+    //取出队首元素，wait成功之后调用
+    bool take(T &item) {
+        m_mutex.lock();
         if (m_size <= 0) {
             m_mutex.unlock();
             return false;
         }
-
-        m_front = (m_front + 1) % m_max_size;
+        m_front = (m_front + 1) % m_max_size;  //头删
         item = m_array[m_front];
         m_size--;
         m_mutex.unlock();
         return true;
     }
 
-private:
     locker m_mutex;
-    cond m_cond;
+    notifier m_ready;           //队列中可以取出的元素
 
     T *m_array;      //数组，因为是log，所以T是string
     int m_size;      //循环数组当前size
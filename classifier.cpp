@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "classifier.h"
+#include "file_cache.h"
+
+// 把逗号分隔的列表拆开，去掉两端的空白和空项
+static std::vector< std::string > split_list( const char* text ) {
+    std::vector< std::string > items;
+    std::string list = text;
+    size_t start = 0;
+    while ( start <= list.size() ) {
+        size_t comma = list.find( ',', start );
+        if ( comma == std::string::npos ) {
+            comma = list.size();
+        }
+        size_t b = list.find_first_not_of( " \t", start );
+        size_t e = list.find_last_not_of( " \t", comma - 1 );
+        if ( b != std::string::npos && b < comma && e != std::string::npos && e >= b ) {
+            items.push_back( list.substr( b, e - b + 1 ) );
+        }
+        start = comma + 1;
+    }
+    return items;
+}
+
+request_classifier::request_classifier() : m_bulk_size( 0 ), m_hook( NULL ) {
+    m_weights.push_back( 1 );
+}
+
+bool request_classifier::parse_cidr( const std::string& text, cidr& net ) {
+    std::string host = text;
+    int bits = -1;
+    size_t slash = text.find( '/' );
+    if ( slash != std::string::npos ) {
+        host = text.substr( 0, slash );
+        char* end = NULL;
+        bits = strtol( text.c_str() + slash + 1, &end, 10 );
+        if ( *end != '\0' || end == text.c_str() + slash + 1 ) {
+            return false;
+        }
+    }
+    struct in_addr v4;
+    if ( inet_pton( AF_INET, host.c_str(), &v4 ) == 1 ) {
+        bits = bits < 0 ? 32 : bits;
+        if ( bits > 32 ) {
+            return false;
+        }
+        memset( net.m_addr, 0, 10 );
+        net.m_addr[10] = net.m_addr[11] = 0xff;
+        memcpy( net.m_addr + 12, &v4, 4 );
+        net.m_bits = 96 + bits;
+        return true;
+    }
+    if ( inet_pton( AF_INET6, host.c_str(), net.m_addr ) == 1 ) {
+        bits = bits < 0 ? 128 : bits;
+        net.m_bits = bits;
+        return bits <= 128;
+    }
+    return false;
+}
+
+bool request_classifier::init( const char* lane_weights, const char* bulk_prefixes, int bulk_size, const char* bulk_clients ) {
+    std::vector< std::string > weights = split_list( lane_weights );
+    m_weights.clear();
+    for ( size_t i = 0; i < weights.size(); ++i ) {
+        char* end = NULL;
+        long w = strtol( weights[i].c_str(), &end, 10 );
+        if ( *end != '\0' || w <= 0 || w > 1000 ) {
+            printf( "invalid lane weight: %s\n", weights[i].c_str() );
+            return false;
+        }
+        m_weights.push_back( w );
+    }
+    if ( m_weights.empty() ) {
+        m_weights.push_back( 1 );
+    }
+
+    std::vector< std::string > prefixes = split_list( bulk_prefixes );
+    for ( size_t i = 0; i < prefixes.size(); ++i ) {
+        size_t start = prefixes[i].find_first_not_of( '/' );
+        if ( start != std::string::npos ) {
+            m_prefixes.push_back( prefixes[i].substr( start ) );
+        }
+    }
+
+    std::vector< std::string > clients = split_list( bulk_clients );
+    for ( size_t i = 0; i < clients.size(); ++i ) {
+        cidr net;
+        if ( !parse_cidr( clients[i], net ) ) {
+            printf( "invalid bulk client: %s\n", clients[i].c_str() );
+            return false;
+        }
+        m_clients.push_back( net );
+    }
+    m_bulk_size = bulk_size;
+    return true;
+}
+
+bool request_classifier::bulk_client( const struct sockaddr_storage& addr ) const {
+    if ( m_clients.empty() ) {
+        return false;
+    }
+    unsigned char ip[ 16 ];
+    if ( addr.ss_family == AF_INET ) {
+        memset( ip, 0, 10 );
+        ip[10] = ip[11] = 0xff;
+        memcpy( ip + 12, &( ( const struct sockaddr_in* )&addr )->sin_addr, 4 );
+    } else {
+        memcpy( ip, &( ( const struct sockaddr_in6* )&addr )->sin6_addr, 16 );
+    }
+    for ( size_t i = 0; i < m_clients.size(); ++i ) {
+        const cidr& net = m_clients[i];
+        int bytes = net.m_bits / 8;
+        int rest = net.m_bits % 8;
+        if ( memcmp( ip, net.m_addr, bytes ) != 0 ) {
+            continue;
+        }
+        unsigned char mask = ( unsigned char )( 0xff << ( 8 - rest ) );
+        if ( rest == 0 || ( ip[ bytes ] & mask ) == ( net.m_addr[ bytes ] & mask ) ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int request_classifier::classify( const char* path, off_t size, bool bulk_client ) const {
+    int last = m_weights.size() - 1;
+    if ( last == 0 ) {
+        return LANE_INTERACTIVE;
+    }
+    if ( m_hook ) {
+        int lane = m_hook( path, size, bulk_client );
+        if ( lane >= 0 ) {
+            return lane < last ? lane : last;
+        }
+    }
+    if ( bulk_client ) {
+        return LANE_BULK;
+    }
+    for ( size_t i = 0; i < m_prefixes.size(); ++i ) {
+        if ( strncmp( path, m_prefixes[i].c_str(), m_prefixes[i].size() ) == 0 ) {
+            return LANE_BULK;
+        }
+    }
+    if ( m_bulk_size > 0 ) {
+        if ( size < 0 ) {
+            std::shared_ptr< const file_cache_entry > entry = file_cache::get_instance()->get( path );
+            size = entry ? entry->file_stat.st_size : 0;
+        }
+        if ( size > m_bulk_size ) {
+            return LANE_BULK;
+        }
+    }
+    return LANE_INTERACTIVE;
+}
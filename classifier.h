@@ -0,0 +1,62 @@
+#ifndef CLASSIFIER_H
+#define CLASSIFIER_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+    请求分类：主线程把请求交给线程池之前决定它进入哪个优先级通道（见threadpool::set_lanes）
+    LANE_INTERACTIVE    页面、小文件等很快就能处理完的请求
+    LANE_BULK           大文件下载等耗时长的请求，和普通请求按lane_weights加权轮流处理，大量下载时不拖慢普通请求
+    内置的规则依次是：
+        1. 客户端地址在bulk_clients（CIDR列表，如 10.0.0.0/8,2001:db8::/32）中，如备份、镜像、爬虫
+        2. 路径以bulk_prefixes（逗号分隔，如 /download/,/video/）中的某个开头
+        3. 文件大小超过bulk_size：主线程只查文件缓存，还没有缓存的文件按普通请求处理
+    set_hook可以换成自己的规则
+*/
+class request_classifier {
+public:
+    enum LANE { LANE_INTERACTIVE = 0, LANE_BULK };
+
+    // 自定义规则：path是规范化后相对网站根目录的路径，size是文件大小（-1表示还不知道），
+    // bulk_client表示客户端在bulk_clients中。返回通道编号，-1表示使用内置规则
+    typedef int ( *hook )( const char* path, off_t size, bool bulk_client );
+
+    static request_classifier* get_instance() {
+        static request_classifier instance;
+        return &instance;
+    }
+
+    // lane_weights是逗号分隔的各通道权重，如 "8,1"，只有一个权重时不分类。出错时打印原因并返回false
+    bool init( const char* lane_weights, const char* bulk_prefixes, int bulk_size, const char* bulk_clients );
+    void set_hook( hook h ) { m_hook = h; }
+    const std::vector< int >& weights() const { return m_weights; }
+    bool enabled() const { return m_weights.size() > 1; }
+
+    bool bulk_client( const struct sockaddr_storage& addr ) const;     // 连接建立时调用一次
+    // 返回 0 ~ weights().size()-1 的通道编号。size为-1时从文件缓存中查文件大小
+    int classify( const char* path, off_t size, bool bulk_client ) const;
+
+private:
+    request_classifier();
+    request_classifier( const request_classifier& );
+    request_classifier& operator=( const request_classifier& );
+
+    // 一个CIDR，IPv4地址按IPv4映射的IPv6地址保存
+    struct cidr {
+        unsigned char m_addr[ 16 ];
+        int m_bits;
+    };
+    static bool parse_cidr( const std::string& text, cidr& net );
+
+    std::vector< int > m_weights;
+    std::vector< std::string > m_prefixes;      // 去掉了开头的'/'，和规范化后的路径比较
+    std::vector< cidr > m_clients;
+    off_t m_bulk_size;                          // 0表示不按大小分类
+    hook m_hook;
+};
+
+#endif
@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <libgen.h>
+#include "config.h"
+
+// 一个可配置的参数：整数参数用number，字符串参数用text
+struct config_item {
+    const char* name;                   // 配置文件中的键，同时也是命令行的长选项名
+    char short_name;                    // 命令行的短选项，0表示没有
+    int config::* number;
+    std::string config::* text;
+    int min_value;                      // 整数参数允许的最小值
+    const char* help;
+};
+
+static const config_item items[] = {
+    { "port",              'p', &config::port,              NULL,               1, "监听端口" },
+    { "listen",             0,  NULL,                       &config::listen,    0, "监听地址列表，逗号分隔，如 80,127.0.0.1:8080,[::1]:8080，设置后忽略port" },
+    { "tls_cert",           0,  NULL,                       &config::tls_cert,  0, "TLS证书链文件（PEM），listen中有ssl地址时需要" },
+    { "tls_key",            0,  NULL,                       &config::tls_key,   0, "TLS私钥文件（PEM）" },
+    { "tls_ticket_key",     0,  NULL,                       &config::tls_ticket_key, 0, "80字节的会话票据密钥文件，多个进程共用时可以互相恢复会话，空表示随机生成" },
+    { "listen_backlog",    'b', &config::listen_backlog,    NULL,               1, "内核监听队列的最大长度" },
+    { "max_fd",            'm', &config::max_fd,            NULL,               1, "最大的文件描述符个数，即最大连接数" },
+    { "max_event_number",  'e', &config::max_event_number,  NULL,               1, "一次epoll_wait最多返回的事件数量" },
+    { "thread_number",     't', &config::thread_number,     NULL,               1, "线程池中线程的数量" },
+    { "thread_min",         0,  &config::thread_min,        NULL,               0, "自适应线程数的下限，0表示等于thread_number" },
+    { "thread_max",         0,  &config::thread_max,        NULL,               0, "自适应线程数的上限，0表示等于thread_number；大于thread_min时开启自适应线程数" },
+    { "thread_grow_delay",  0,  &config::thread_grow_delay, NULL,               1, "平均排队时间超过它（毫秒）时增加线程" },
+    { "max_requests",      'r', &config::max_requests,      NULL,               1, "请求队列中最多等待处理的请求数量" },
+    { "queue_delay_target", 0,  &config::queue_delay_target, NULL,              0, "请求排队时间持续高于它（毫秒）时开始丢弃请求并回复503，0表示不丢弃" },
+    { "queue_delay_interval", 0, &config::queue_delay_interval, NULL,          1, "排队时间持续高于queue_delay_target多久（毫秒）之后开始丢弃" },
+    { "lane_weights",       0,  NULL,                       &config::lane_weights, 0, "线程池各优先级通道的权重，逗号分隔，如 8,1（普通请求、大文件请求），一个权重表示不分通道" },
+    { "bulk_size",          0,  &config::bulk_size,         NULL,               0, "文件大于这么多字节的请求进入大文件通道，0表示不按大小分类" },
+    { "bulk_prefixes",      0,  NULL,                       &config::bulk_prefixes, 0, "以这些路径开头的请求进入大文件通道，逗号分隔，如 /download/,/video/" },
+    { "bulk_clients",       0,  NULL,                       &config::bulk_clients, 0, "来自这些地址（CIDR，逗号分隔）的请求都进入大文件通道" },
+    { "max_conns_per_ip",   0,  &config::max_conns_per_ip,  NULL,               0, "每个客户端IP最多同时打开的连接数，0表示不限制" },
+    { "rate_per_ip",        0,  &config::rate_per_ip,       NULL,               0, "每个客户端IP每秒最多的请求数，0表示不限制" },
+    { "rate_burst",         0,  &config::rate_burst,        NULL,               1, "每个客户端IP最多可以连续发送的请求数" },
+    { "retry_after",        0,  &config::retry_after,       NULL,               1, "过载时回复的503中Retry-After的秒数" },
+    { "io_model",           0,  NULL,                       &config::io_model,  0, "I/O模型：proactor（主线程读请求）或reactor（工作线程读写）" },
+    { "io_threads",         0,  &config::io_threads,        NULL,               0, "打开文件、读入文件页面等可能等待磁盘的操作交给这么多个I/O线程，0表示不使用I/O线程" },
+    { "io_queue_size",      0,  &config::io_queue_size,     NULL,               1, "等待I/O线程的操作数上限，满了由工作线程或主线程自己完成" },
+    { "populate_size",      0,  &config::populate_size,     NULL,               0, "不超过这么多字节的文件映射时预先建立页表（MAP_POPULATE），更大的文件按顺序预读" },
+    { "hot_files",          0,  NULL,                       &config::hot_files, 0, "整个映射并用mlock锁定在内存中的文件，逗号分隔、相对网站根目录的路径，如 index.html,video/intro.mp4" },
+    { "worker_cpus",        0,  NULL,                       &config::worker_cpus, 0, "工作线程绑定的CPU列表，如 0-7,16-23，空表示不绑定" },
+    { "reactor_cpu",        0,  &config::reactor_cpu,       NULL,              -1, "主线程（epoll）绑定的CPU，-1表示不绑定" },
+    { "drain_timeout",      0,  &config::drain_timeout,     NULL,               0, "优雅退出时等待已有连接处理完的最长秒数" },
+    { "upgrade_socket",    'u', NULL,                       &config::upgrade_socket, 0, "不停机重启用的UNIX socket路径，空表示不启用" },
+    { "metrics_port",       0,  &config::metrics_port,      NULL,               0, "统计端点（/metrics、/status）的端口，0表示不启用" },
+    { "trace_stages",       0,  &config::trace_stages,      NULL,               0, "1表示统计每个请求各处理阶段的耗时" },
+    { "slow_request_us",    0,  &config::slow_request_us,   NULL,               0, "总耗时超过这么多微秒的请求记录各阶段耗时，0表示不记录" },
+    { "read_buffer_size",   0,  &config::read_buffer_size,  NULL,              64, "每个连接读缓冲区的大小" },
+    { "write_buffer_size",  0,  &config::write_buffer_size, NULL,              64, "每个连接写缓冲区的大小" },
+    { "doc_root",          'd', NULL,                       &config::doc_root,  0, "网站根目录" },
+    { "cache_file_size",    0,  &config::cache_file_size,   NULL,               0, "缓存完整应答的最大文件大小，0表示不缓存完整应答" },
+    { "cache_total_size",   0,  &config::cache_total_size,  NULL,               0, "缓存的完整应答的总大小" },
+    { "cache_max_files",    0,  &config::cache_max_files,   NULL,               0, "缓存的文件数量上限，0表示关闭文件缓存" },
+    { "log_file",          'l', NULL,                       &config::log_file,  0, "日志文件名" },
+    { "close_log",         'c', &config::close_log,         NULL,               0, "1表示关闭日志" },
+    { "log_buf_size",       0,  &config::log_buf_size,      NULL,             256, "日志缓冲区大小" },
+    { "log_split_lines",    0,  &config::log_split_lines,   NULL,               1, "单个日志文件的最大行数" },
+    { "log_queue_size",    'q', &config::log_queue_size,    NULL,               0, "日志阻塞队列的长度，0表示同步写日志" },
+};
+static const int ITEM_COUNT = sizeof( items ) / sizeof( items[0] );
+
+config::config() {
+    port = 0;
+    listen = "";
+    tls_cert = "";
+    tls_key = "";
+    tls_ticket_key = "";
+    listen_backlog = 5;
+    max_fd = 65536;
+    max_event_number = 10000;
+    thread_number = 8;
+    thread_min = 0;
+    thread_max = 0;
+    thread_grow_delay = 5;
+    max_requests = 10000;
+    queue_delay_target = 20;
+    queue_delay_interval = 100;
+    lane_weights = "8,1";
+    bulk_size = 1024 * 1024;
+    bulk_prefixes = "";
+    bulk_clients = "";
+    max_conns_per_ip = 0;
+    rate_per_ip = 0;
+    rate_burst = 100;
+    retry_after = 1;
+    io_model = "proactor";
+    io_threads = 2;
+    io_queue_size = 1024;
+    populate_size = 256 * 1024;
+    hot_files = "";
+    worker_cpus = "";
+    reactor_cpu = -1;
+    drain_timeout = 30;
+    upgrade_socket = "";
+    metrics_port = 0;
+    trace_stages = 0;
+    slow_request_us = 0;
+    read_buffer_size = 2048;
+    write_buffer_size = 1024;
+    doc_root = "/home/zdb/webserver/resources";
+    cache_file_size = 65536;
+    cache_total_size = 32 * 1024 * 1024;
+    cache_max_files = 1024;
+    log_file = "./ServerLog";
+    close_log = 0;
+    log_buf_size = 2000;
+    log_split_lines = 800000;
+    log_queue_size = 0;
+}
+
+bool config::set( const char* name, const char* value, const char* source ) {
+    for ( int i = 0; i < ITEM_COUNT; ++i ) {
+        if ( strcmp( items[i].name, name ) != 0 ) {
+            continue;
+        }
+
+        if ( items[i].text ) {
+            this->*items[i].text = value;
+            return true;
+        }
+        char* end = NULL;
+        errno = 0;
+        long n = strtol( value, &end, 10 );
+        if ( errno != 0 || end == value || *end != '\0' || n < items[i].min_value || n > 0x7fffffff ) {
+            printf( "%s: invalid value '%s' for %s (integer >= %d expected)\n", source, value, items[i].name, items[i].min_value );
+            return false;
+        }
+        this->*items[i].number = ( int )n;
+        return true;
+    }
+    printf( "%s: unknown option %s\n", source, name );
+    return false;
+}
+
+bool config::load_file( const char* path ) {
+    FILE* fp = fopen( path, "r" );
+    if ( !fp ) {
+        printf( "cannot open config file %s: %s\n", path, strerror( errno ) );
+        return false;
+    }
+
+    char line[ 1024 ];
+    char source[ 300 ];
+    int lineno = 0;
+    bool ret = true;
+    while ( ret && fgets( line, sizeof( line ), fp ) ) {
+        ++lineno;
+        snprintf( source, sizeof( source ), "%s:%d", path, lineno );
+        // 去掉注释和行尾的换行
+        char* p = strpbrk( line, "#\r\n" );
+        if ( p ) {
+            *p = '\0';
+        }
+        char* key = line + strspn( line, " \t" );
+        if ( *key == '\0' ) {
+            continue;
+        }
+        char* eq = strchr( key, '=' );
+        if ( !eq ) {
+            printf( "%s: expected key = value\n", source );
+            ret = false;
+            break;
+        }
+        // 去掉键和值两端的空白
+        char* value = eq + 1;
+        value += strspn( value, " \t" );
+        for ( p = eq; p > key && ( p[-1] == ' ' || p[-1] == '\t' ); --p ) {
+        }
+        *p = '\0';
+        for ( p = value + strlen( value ); p > value && ( p[-1] == ' ' || p[-1] == '\t' ); --p ) {
+        }
+        *p = '\0';
+        ret = set( key, value, source );
+    }
+    fclose( fp );
+    return ret;
+}
+
+bool config::parse_arg( int argc, char* argv[] ) {
+    // 根据参数表生成getopt_long需要的长选项和短选项
+    struct option long_opts[ ITEM_COUNT + 3 ];
+    char short_opts[ ITEM_COUNT * 2 + 8 ] = "f:h";
+    int n = strlen( short_opts );
+    for ( int i = 0; i < ITEM_COUNT; ++i ) {
+        long_opts[i].name = items[i].name;
+        long_opts[i].has_arg = required_argument;
+        long_opts[i].flag = NULL;
+        long_opts[i].val = items[i].short_name ? items[i].short_name : 256 + i;
+        if ( items[i].short_name ) {
+            short_opts[ n++ ] = items[i].short_name;
+            short_opts[ n++ ] = ':';
+        }
+    }
+    short_opts[ n ] = '\0';
+    struct option extra[] = {
+        { "config", required_argument, NULL, 'f' },
+        { "help",   no_argument,       NULL, 'h' },
+        { NULL,     0,                 NULL, 0 },
+    };
+    memcpy( long_opts + ITEM_COUNT, extra, sizeof( extra ) );
+
+    // 第一遍只读取配置文件，第二遍再应用其他选项，这样不管-f写在哪里，命令行参数都覆盖配置文件。
+    // 第一遍不报错，错误的选项留给第二遍报告
+    int opt;
+    opterr = 0;
+    while ( ( opt = getopt_long( argc, argv, short_opts, long_opts, NULL ) ) != -1 ) {
+        if ( opt == 'f' && !load_file( optarg ) ) {
+            return false;
+        }
+    }
+    opterr = 1;
+    optind = 0;     // glibc：optind为0时重新初始化getopt的内部状态
+    while ( ( opt = getopt_long( argc, argv, short_opts, long_opts, NULL ) ) != -1 ) {
+        if ( opt == 'f' ) {
+            continue;
+        }
+        if ( opt == 'h' || opt == '?' ) {
+            usage( argv[0] );
+            return false;
+        }
+        int i = ( opt >= 256 ) ? opt - 256 : 0;
+        while ( opt < 256 && items[i].short_name != opt ) {
+            ++i;
+        }
+        if ( !set( items[i].name, optarg, "command line" ) ) {
+            return false;
+        }
+    }
+
+    // 兼容以前的用法：./server port_number
+    if ( optind < argc && !set( "port", argv[ optind ], "command line" ) ) {
+        return false;
+    }
+    if ( port == 0 && listen.empty() ) {
+        usage( argv[0] );
+        return false;
+    }
+    return true;
+}
+
+void config::usage( const char* prog ) const {
+    char name[ 256 ];
+    snprintf( name, sizeof( name ), "%s", prog );
+    printf( "按照如下格式运行: %s [-f 配置文件] [选项] [port_number]\n", basename( name ) );
+    printf( "  -f, --config FILE        从配置文件读取参数，命令行的其他选项会覆盖它\n" );
+    for ( int i = 0; i < ITEM_COUNT; ++i ) {
+        char opt[ 64 ];
+        if ( items[i].short_name ) {
+            snprintf( opt, sizeof( opt ), "-%c, --%s", items[i].short_name, items[i].name );
+        } else {
+            snprintf( opt, sizeof( opt ), "    --%s", items[i].name );
+        }
+        if ( items[i].text ) {
+            printf( "  %-24s %s（默认 %s）\n", opt, items[i].help, ( this->*items[i].text ).c_str() );
+        } else {
+            printf( "  %-24s %s（默认 %d）\n", opt, items[i].help, this->*items[i].number );
+        }
+    }
+}
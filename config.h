@@ -0,0 +1,75 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <string>
+
+/*
+    服务器的运行参数
+    优先级：命令行参数 > 配置文件（-f 指定） > 默认值
+    配置文件每行一个 "键 = 值"，'#' 之后为注释；命令行用同名的长选项（如 --thread_number 16）或短选项覆盖。
+    为了兼容以前的用法，第一个非选项参数视为端口号。
+*/
+class config {
+public:
+    config();
+
+    // 解析命令行参数（遇到 -f 时先加载配置文件）。出错时打印原因并返回false
+    bool parse_arg( int argc, char* argv[] );
+    // 加载配置文件
+    bool load_file( const char* path );
+    // 打印所有参数的说明
+    void usage( const char* prog ) const;
+
+    int port;                   // 监听端口，没有设置listen时监听所有地址的这个端口（IPv4和IPv6双栈）
+    std::string listen;         // 监听地址列表，如 "80,127.0.0.1:8080,[::1]:8080"，见listener.h
+    std::string tls_cert;       // TLS证书链文件（PEM），listen中有ssl地址时需要
+    std::string tls_key;        // TLS私钥文件（PEM）
+    std::string tls_ticket_key; // 80字节的会话票据密钥文件，空表示每个进程随机生成
+    int listen_backlog;         // listen的backlog，内核监听队列的最大长度
+    int max_fd;                 // 最大的文件描述符个数，即最大连接数
+    int max_event_number;       // 一次epoll_wait最多返回的事件数量
+    int thread_number;          // 线程池中线程的数量（开启自适应线程数时是启动时的数量）
+    int thread_min;             // 自适应线程数的下限，0表示等于thread_number
+    int thread_max;             // 自适应线程数的上限，0表示等于thread_number；大于thread_min时开启自适应线程数
+    int thread_grow_delay;      // 平均排队时间超过它（毫秒）时增加线程
+    int max_requests;           // 请求队列中最多允许的、等待处理的请求的数量
+    int queue_delay_target;     // 请求排队时间持续高于它（毫秒）时开始丢弃请求并回复503，0表示不丢弃
+    int queue_delay_interval;   // 排队时间持续高于queue_delay_target多久（毫秒）之后开始丢弃
+    std::string lane_weights;   // 线程池各优先级通道的权重，逗号分隔，如 "8,1"（普通请求、大文件请求）
+    int bulk_size;              // 文件大于这么多字节的请求进入大文件通道，0表示不按大小分类
+    std::string bulk_prefixes;  // 以这些路径开头的请求进入大文件通道，逗号分隔
+    std::string bulk_clients;   // 来自这些地址（CIDR，逗号分隔）的请求都进入大文件通道
+    int max_conns_per_ip;       // 每个客户端IP最多同时打开的连接数，0表示不限制
+    int rate_per_ip;            // 每个客户端IP每秒最多的请求数，0表示不限制
+    int rate_burst;             // 每个客户端IP最多可以连续发送的请求数
+    int retry_after;            // 过载时回复的503中Retry-After的秒数
+    std::string io_model;       // proactor：主线程读请求，工作线程处理并发送应答；reactor：工作线程自己读写
+    int io_threads;             // 打开文件、读入文件页面等阻塞操作的I/O线程数，0表示在工作线程和主线程中直接做
+    int io_queue_size;          // 等待I/O线程的操作最多有多少个，满了由调用者自己做
+    int populate_size;          // 不超过这么大（字节）的文件映射时预先建立页表，更大的文件按顺序预读
+    std::string hot_files;      // 常驻内存（mmap + mlock）的文件，逗号分隔、相对网站根目录的路径，需要启用文件缓存
+    std::string worker_cpus;    // 工作线程绑定的CPU列表，如 "0-7,16-23"，空表示不绑定
+    int reactor_cpu;            // 主线程（epoll）绑定的CPU，-1表示不绑定
+    int drain_timeout;          // 优雅退出时等待已有连接处理完的最长秒数
+    std::string upgrade_socket; // 不停机重启用的UNIX socket路径，空表示不启用
+    int metrics_port;           // 统计端点（/metrics、/status）的端口，0表示不启用
+    int trace_stages;           // 1表示统计每个请求各处理阶段的耗时
+    int slow_request_us;        // 总耗时超过这么多微秒的请求记录各阶段耗时，0表示不记录
+    int read_buffer_size;       // 每个连接读缓冲区的大小
+    int write_buffer_size;      // 每个连接写缓冲区的大小
+    std::string doc_root;       // 网站根目录
+    int cache_file_size;        // 可以缓存完整应答的最大文件大小，0表示不缓存完整应答
+    int cache_total_size;       // 缓存的完整应答的总大小
+    int cache_max_files;        // 缓存的文件数量上限，0表示关闭文件缓存
+    std::string log_file;       // 日志文件名
+    int close_log;              // 1表示关闭日志
+    int log_buf_size;           // 日志缓冲区大小
+    int log_split_lines;        // 单个日志文件的最大行数
+    int log_queue_size;         // 日志阻塞队列的长度，0表示同步写日志
+
+private:
+    // 按名字设置一个参数，source用于出错时指明来源
+    bool set( const char* name, const char* value, const char* source );
+};
+
+#endif
@@ -0,0 +1,307 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#if defined(__has_include)
+#if __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>
+#endif
+#endif
+#include "file_cache.h"
+
+// 目录中任何可能改变文件内容、权限或名字的事件都会使对应的缓存项失效
+static const uint32_t WATCH_MASK = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE
+                                 | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+file_cache::file_cache() : m_root_fd(-1), m_openat2(false), m_notify_fd(-1), m_max_file_size(0), m_max_bytes(0), m_max_files(0),
+        m_bytes(0), m_generation(0), m_pinned(0) {
+}
+
+file_cache_entry::~file_cache_entry() {
+    if (mapping) {
+        munmap( mapping, file_stat.st_size );
+        file_cache::get_instance()->m_pinned.fetch_sub( locked, std::memory_order_relaxed );
+    }
+    if (fd != -1) {
+        ::close(fd);
+    }
+}
+
+file_cache::~file_cache() {
+    if (m_notify_fd != -1) {
+        close(m_notify_fd);
+    }
+    if (m_root_fd != -1) {
+        close(m_root_fd);
+    }
+}
+
+bool file_cache::init( const char* doc_root, size_t max_file_size, size_t max_bytes, int max_files ) {
+    m_doc_root = doc_root;
+    m_max_file_size = max_file_size;
+    m_max_bytes = max_bytes;
+    m_max_files = max_files > 0 ? max_files : 0;
+
+    // 之后所有文件都相对这个目录打开
+    m_root_fd = open( doc_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if (m_root_fd == -1) {
+        return false;
+    }
+    // 在启动工作线程之前试一次openat2，内核不支持时之后都用openat
+    int fd = openat2_beneath( ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    m_openat2 = fd != -1 || errno != ENOSYS;
+    if (fd != -1) {
+        close(fd);
+    }
+    if (m_max_files == 0) {   // 关闭缓存
+        return true;
+    }
+    // 没有inotify就无法保证失效，此时不启用缓存
+    m_notify_fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+    return true;
+}
+
+void file_cache::set_hot_files( const char* hot_files ) {
+    std::string list = hot_files;
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t comma = list.find( ',', start );
+        if (comma == std::string::npos) {
+            comma = list.size();
+        }
+        // 去掉两端的空白和开头的'/'，和规范化后的路径一致
+        size_t b = list.find_first_not_of( " \t/", start );
+        size_t e = list.find_last_not_of( " \t", comma - 1 );
+        if (b != std::string::npos && b < comma && e != std::string::npos && e >= b) {
+            m_hot.insert( list.substr( b, e - b + 1 ) );
+        }
+        start = comma + 1;
+    }
+}
+
+void file_cache::pin( file_cache_entry* entry ) {
+    size_t size = entry->file_stat.st_size;
+    if (size == 0) {
+        return;
+    }
+    // MAP_POPULATE把整个文件读进来并建立好页表，之后发送时不再缺页
+    void* addr = mmap( NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, entry->fd, 0 );
+    if (addr == MAP_FAILED) {
+        return;
+    }
+    entry->mapping = ( char* )addr;
+    // 超过RLIMIT_MEMLOCK时不锁定，映射照样共用
+    if (mlock( addr, size ) == 0) {
+        entry->locked = size;
+        m_pinned.fetch_add( size, std::memory_order_relaxed );
+    }
+}
+
+int file_cache::open_file( const char* path ) {
+    // 空路径即网站根目录本身
+    if (path[0] == '\0') {
+        path = ".";
+    }
+    // O_NONBLOCK防止打开FIFO之类的特殊文件时阻塞工作线程
+    int flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
+    if (m_openat2) {
+        return openat2_beneath( path, flags );
+    }
+    // 路径已经去掉了".."，这里只可能通过根目录内的符号链接越界
+    return openat( m_root_fd, path, flags );
+}
+
+int file_cache::openat2_beneath( const char* path, int flags ) {
+#if defined(SYS_openat2) && defined(RESOLVE_BENEATH)
+    // RESOLVE_BENEATH：路径解析（包括符号链接）不允许越出根目录，越界时返回EXDEV
+    struct open_how how;
+    memset( &how, 0, sizeof( how ) );
+    how.flags = flags;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    return syscall( SYS_openat2, m_root_fd, path, &how, sizeof( how ) );
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+std::shared_ptr< const file_cache_entry > file_cache::get( const char* path ) {
+    std::shared_ptr< const file_cache_entry > entry;
+    if (m_notify_fd == -1) {
+        return entry;
+    }
+    // 查找用的key每个线程一个，长路径的string在第一次用到之后就不再为每次查找分配内存
+    static thread_local std::string key;
+    key.assign( path );
+    m_mutex.lock();
+    entry_map::iterator it = m_entries.find( key );
+    if (it != m_entries.end()) {
+        entry = it->second;
+    }
+    m_mutex.unlock();
+    return entry;
+}
+
+unsigned long file_cache::generation() {
+    m_mutex.lock();
+    unsigned long gen = m_generation;
+    m_mutex.unlock();
+    return gen;
+}
+
+void file_cache::put( const char* path, const std::shared_ptr< const file_cache_entry >& entry, unsigned long gen ) {
+    size_t bytes = entry->keep_alive.size() + entry->close.size();
+    if (m_notify_fd == -1 || bytes > m_max_bytes || path[0] == '\0') {
+        return;
+    }
+
+    std::string key( path );
+    std::string::size_type slash = key.rfind( '/' );
+    std::string dir = ( slash == std::string::npos ) ? std::string() : key.substr( 0, slash );
+
+    m_mutex.lock();
+    // 读取文件期间发生过失效，读到的内容可能已经过期
+    if (gen != m_generation || !watch_dir( dir )) {
+        m_mutex.unlock();
+        return;
+    }
+    // 目录的watch可能是刚刚加上的，再确认一次文件在读取之后没有被改动过
+    struct stat st;
+    if (fstatat( m_root_fd, path, &st, 0 ) == -1 || st.st_ino != entry->file_stat.st_ino || st.st_size != entry->file_stat.st_size
+        || st.st_mtim.tv_sec != entry->file_stat.st_mtim.tv_sec || st.st_mtim.tv_nsec != entry->file_stat.st_mtim.tv_nsec) {
+        m_mutex.unlock();
+        return;
+    }
+
+    erase( key );
+    // 超出总容量或数量上限时随意淘汰一些旧的缓存项
+    while (( m_bytes + bytes > m_max_bytes || m_entries.size() >= m_max_files ) && !m_entries.empty()) {
+        erase( m_entries.begin()->first );
+    }
+    m_entries[ key ] = entry;
+    m_bytes += bytes;
+    m_mutex.unlock();
+}
+
+// 调用者需持有锁。从根目录起监视路径上的每一级目录：任何一级被改名、移走或删除时，
+// 它的上一级目录会收到事件，这时其下所有的缓存项都要失效
+bool file_cache::watch_dir( const std::string& dir ) {
+    std::string::size_type end = 0;
+    while (true) {
+        if (!watch_one( dir.substr( 0, end ) )) {
+            return false;
+        }
+        if (end == dir.size()) {
+            return true;
+        }
+        end = dir.find( '/', end + 1 );
+        end = ( end == std::string::npos ) ? dir.size() : end;
+    }
+}
+
+// 调用者需持有锁
+bool file_cache::watch_one( const std::string& dir ) {
+    for (std::unordered_map< int, std::string >::iterator it = m_watches.begin(); it != m_watches.end(); ++it) {
+        if (it->second == dir) {
+            return true;
+        }
+    }
+    std::string full = dir.empty() ? m_doc_root : m_doc_root + "/" + dir;
+    int wd = inotify_add_watch( m_notify_fd, full.c_str(), WATCH_MASK );
+    if (wd == -1) {
+        return false;
+    }
+    m_watches[ wd ] = dir;
+    return true;
+}
+
+// 调用者需持有锁
+void file_cache::erase( const std::string& path ) {
+    entry_map::iterator it = m_entries.find( path );
+    if (it == m_entries.end()) {
+        return;
+    }
+    m_bytes -= it->second->keep_alive.size() + it->second->close.size();
+    m_entries.erase( it );
+}
+
+// 调用者需持有锁。目录dir被改名、移走或删除：删除其下所有的缓存项，其下的watch跟着目录走了，
+// 得到的路径不再对，一并移除，之后的插入会按新的路径重新建立
+void file_cache::erase_dir( const std::string& dir ) {
+    std::string prefix = dir + "/";
+    for (entry_map::iterator it = m_entries.begin(); it != m_entries.end(); ) {
+        if (it->first.compare( 0, prefix.size(), prefix ) == 0) {
+            m_bytes -= it->second->keep_alive.size() + it->second->close.size();
+            it = m_entries.erase( it );
+        } else {
+            ++it;
+        }
+    }
+    for (std::unordered_map< int, std::string >::iterator it = m_watches.begin(); it != m_watches.end(); ) {
+        if (it->second == dir || it->second.compare( 0, prefix.size(), prefix ) == 0) {
+            inotify_rm_watch( m_notify_fd, it->first );
+            it = m_watches.erase( it );
+        } else {
+            ++it;
+        }
+    }
+}
+
+// 调用者需持有锁
+void file_cache::clear() {
+    m_entries.clear();
+    m_bytes = 0;
+}
+
+// 读取inotify事件，使被改动的文件对应的缓存项失效。正在发送旧应答的连接仍持有旧缓存项的引用，不受影响
+void file_cache::handle_notify() {
+    char buf[ 4096 ] __attribute__(( aligned( __alignof__( struct inotify_event ) ) ));
+    while (true) {
+        ssize_t len = ::read( m_notify_fd, buf, sizeof( buf ) );
+        if (len <= 0) {
+            break;
+        }
+        m_mutex.lock();
+        m_generation++;
+        for (char* p = buf; p < buf + len; ) {
+            struct inotify_event* event = ( struct inotify_event* )p;
+            p += sizeof( struct inotify_event ) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {   // 事件丢失，无法知道哪些文件变了
+                clear();
+                continue;
+            }
+            std::unordered_map< int, std::string >::iterator it = m_watches.find( event->wd );
+            if (it == m_watches.end()) {
+                continue;
+            }
+            if (event->len > 0) {
+                std::string path = it->second.empty() ? std::string( event->name ) : it->second + "/" + event->name;
+                erase( path );
+                if (event->mask & IN_ISDIR) {
+                    // 子目录被改名、移走、删除或者被别的目录替换。只会移除它下面的watch，it仍然有效
+                    erase_dir( path );
+                }
+            }
+            if (event->mask & ( IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED )) {
+                // 目录本身没了或换了位置，直接清空，之后的插入会重新建立watch
+                if (!( event->mask & IN_IGNORED )) {
+                    inotify_rm_watch( m_notify_fd, event->wd );
+                }
+                m_watches.erase( it );
+                clear();
+            }
+        }
+        m_mutex.unlock();
+    }
+}
+
+void file_cache::stats( size_t& files, size_t& bytes ) {
+    m_mutex.lock();
+    files = m_entries.size();
+    bytes = m_bytes;
+    m_mutex.unlock();
+}
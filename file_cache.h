@@ -0,0 +1,107 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <string>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "locker.h"
+
+/*
+    网站根目录下文件的缓存
+    1. 路径解析缓存：持有网站根目录的目录文件描述符，所有文件都通过openat相对它打开（内核支持时使用RESOLVE_BENEATH，
+       保证解析结果不会越出根目录）。打开后的文件描述符和文件状态按规范化后的相对路径缓存，命中时不再需要内核遍历路径。
+    2. 小文件应答缓存：对于不超过阈值的小文件（favicon、robots.txt、首页等），还缓存序列化好的完整HTTP应答
+       （响应头+文件内容），命中时只需一次发送，省去 stat + open + mmap + munmap。
+    3. 常驻内存的热点文件：hot_files中超过小文件阈值的文件，打开时整个映射并用mlock锁定在内存中，
+       各个请求直接发送这份映射，不再每次mmap，页面也不会被换出。
+    缓存项创建后只读，通过shared_ptr在多个连接之间共享；文件被修改、删除、改名时由inotify通知失效。
+*/
+
+// 一个缓存项：已打开的文件，以及小文件针对长连接和短连接的两份完整应答
+struct file_cache_entry {
+    int fd;                     // 以只读方式打开的文件，缓存项销毁时关闭
+    struct stat file_stat;      // 打开时文件的状态
+    std::string keep_alive;     // Connection: keep-alive 的完整应答，只有小文件才有
+    std::string close;          // Connection: close 的完整应答
+    char* mapping;              // 热点文件整个文件的只读映射，缓存项销毁时解除
+    size_t locked;              // mapping中被mlock锁定的字节数，超过RLIMIT_MEMLOCK时为0
+
+    file_cache_entry() : fd(-1), mapping(NULL), locked(0) {}
+    ~file_cache_entry();
+
+    bool has_response() const { return !keep_alive.empty(); }
+    const std::string& response( bool linger ) const { return linger ? keep_alive : close; }
+};
+
+class file_cache {
+public:
+    static file_cache* get_instance() {
+        static file_cache instance;
+        return &instance;
+    }
+
+    // doc_root：网站根目录，max_file_size：缓存完整应答的最大文件大小，
+    // max_bytes：完整应答的总字节数上限，max_files：缓存的文件（即常驻打开的文件描述符）数量上限
+    bool init( const char* doc_root, size_t max_file_size, size_t max_bytes, int max_files );
+
+    // 查找规范化后的相对路径对应的缓存项，未命中返回空指针
+    std::shared_ptr< const file_cache_entry > get( const char* path );
+
+    // 相对网站根目录打开文件，不会越出根目录。失败返回-1并设置errno
+    int open_file( const char* path );
+
+    // 插入前取得的代数，插入时若代数已变化（期间发生过失效）则放弃插入
+    unsigned long generation();
+    bool small_file( off_t size ) const { return m_notify_fd != -1 && size <= (off_t)m_max_file_size; }
+    void put( const char* path, const std::shared_ptr< const file_cache_entry >& entry, unsigned long gen );
+
+    // hot_files是逗号分隔、相对网站根目录的路径，在init之后设置；启用了缓存时这些文件打开后由pin常驻内存
+    void set_hot_files( const char* hot_files );
+    bool hot( const char* path ) const { return m_notify_fd != -1 && m_hot.count( path ) > 0; }
+    void pin( file_cache_entry* entry );
+    size_t pinned_bytes() const { return m_pinned.load( std::memory_order_relaxed ); }
+
+    // inotify文件描述符，由主线程注册到epoll中，可读时调用handle_notify
+    int get_notify_fd() const { return m_notify_fd; }
+    void handle_notify();
+
+    // 当前的缓存项个数和完整应答的总字节数
+    void stats( size_t& files, size_t& bytes );
+
+private:
+    friend struct file_cache_entry;
+
+    file_cache();
+    ~file_cache();
+
+    int openat2_beneath( const char* path, int flags );
+    bool watch_dir( const std::string& dir );
+    bool watch_one( const std::string& dir );
+    void erase( const std::string& path );
+    void erase_dir( const std::string& dir );
+    void clear();
+
+    typedef std::unordered_map< std::string, std::shared_ptr< const file_cache_entry > > entry_map;
+
+    std::string m_doc_root;                             // 网站根目录
+    int m_root_fd;                                      // 网站根目录的目录文件描述符
+    bool m_openat2;                                     // 内核支持openat2，init时检查，之后只读
+    int m_notify_fd;                                    // inotify实例
+    size_t m_max_file_size;                             // 缓存完整应答的最大文件大小
+    size_t m_max_bytes;                                 // 完整应答的总字节数上限
+    size_t m_max_files;                                 // 缓存项数量上限
+    size_t m_bytes;                                     // 当前缓存的完整应答的总字节数
+    unsigned long m_generation;                         // 每次失效加1
+    entry_map m_entries;                                // 相对路径 -> 缓存项
+    std::unordered_map< int, std::string > m_watches;   // inotify watch -> 被监视的目录（相对路径）
+    std::unordered_set< std::string > m_hot;            // 常驻内存的文件，启动后只读
+    std::atomic< size_t > m_pinned;                     // 被锁定在内存中的字节数
+    locker m_mutex;
+};
+
+#endif
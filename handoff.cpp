@@ -0,0 +1,108 @@
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "handoff.h"
+
+static bool make_address( const char* path, struct sockaddr_un* addr ) {
+    memset( addr, 0, sizeof( *addr ) );
+    addr->sun_family = AF_UNIX;
+    if ( strlen( path ) >= sizeof( addr->sun_path ) ) {
+        return false;
+    }
+    strcpy( addr->sun_path, path );
+    return true;
+}
+
+int handoff_listen( const char* path ) {
+    struct sockaddr_un addr;
+    if ( !make_address( path, &addr ) ) {
+        return -1;
+    }
+    int fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if ( fd == -1 ) {
+        return -1;
+    }
+    unlink( path );
+    if ( bind( fd, ( struct sockaddr* )&addr, sizeof( addr ) ) == -1 || listen( fd, 1 ) == -1 ) {
+        close( fd );
+        return -1;
+    }
+    return fd;
+}
+
+int handoff_connect( const char* path ) {
+    struct sockaddr_un addr;
+    if ( !make_address( path, &addr ) ) {
+        return -1;
+    }
+    int fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if ( fd == -1 ) {
+        return -1;
+    }
+    if ( connect( fd, ( struct sockaddr* )&addr, sizeof( addr ) ) == -1 ) {
+        close( fd );
+        return -1;
+    }
+    // 旧进程可能已经卡死，不要无限等待
+    struct timeval tv = { 5, 0 };
+    setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof( tv ) );
+    return fd;
+}
+
+bool send_fds( int sock, const std::vector< int >& fds ) {
+    if ( fds.empty() || fds.size() > ( size_t )HANDOFF_MAX_FDS ) {
+        return false;
+    }
+    // 至少要带一个字节的普通数据，文件描述符放在辅助数据里
+    char data = 'L';
+    struct iovec iov;
+    iov.iov_base = &data;
+    iov.iov_len = 1;
+
+    char control[ CMSG_SPACE( sizeof( int ) * HANDOFF_MAX_FDS ) ];
+    memset( control, 0, sizeof( control ) );
+    struct msghdr msg;
+    memset( &msg, 0, sizeof( msg ) );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE( sizeof( int ) * fds.size() );
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR( &msg );
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN( sizeof( int ) * fds.size() );
+    memcpy( CMSG_DATA( cmsg ), fds.data(), sizeof( int ) * fds.size() );
+
+    return sendmsg( sock, &msg, MSG_NOSIGNAL ) == 1;
+}
+
+bool recv_fds( int sock, std::vector< int >& fds ) {
+    char data;
+    struct iovec iov;
+    iov.iov_base = &data;
+    iov.iov_len = 1;
+
+    char control[ CMSG_SPACE( sizeof( int ) * HANDOFF_MAX_FDS ) ];
+    struct msghdr msg;
+    memset( &msg, 0, sizeof( msg ) );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof( control );
+
+    if ( recvmsg( sock, &msg, MSG_CMSG_CLOEXEC ) != 1 ) {
+        return false;
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR( &msg );
+    if ( !cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+         || cmsg->cmsg_len < CMSG_LEN( sizeof( int ) ) ) {
+        return false;
+    }
+    size_t count = ( cmsg->cmsg_len - CMSG_LEN( 0 ) ) / sizeof( int );
+    fds.resize( count );
+    memcpy( fds.data(), CMSG_DATA( cmsg ), sizeof( int ) * count );
+    return true;
+}
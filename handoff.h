@@ -0,0 +1,31 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <vector>
+
+/*
+    不停机重启：通过UNIX域套接字把监听socket从旧进程交给新进程
+    1. 旧进程在 upgrade_socket 路径上监听（handoff_listen），并把它注册到epoll中
+    2. 新进程启动时先连接这个路径（handoff_connect），旧进程接受连接后用SCM_RIGHTS发来所有监听socket（send_fds / recv_fds），
+       新进程按本地地址把它们对应到自己配置的监听地址上，多出来的关闭，缺少的自己创建
+    3. 新进程准备好之后，在同一路径上建立自己的监听，然后回复一个字节 HANDOFF_READY
+    4. 旧进程收到 HANDOFF_READY 后停止接受新连接并优雅退出；新进程异常退出（没有回复）时旧进程继续服务
+    整个过程中监听socket一直是打开的，新连接只会在内核的监听队列里排队，不会被拒绝。
+*/
+
+const char HANDOFF_READY = 'R';
+
+// 在path上创建UNIX域监听socket（会先删除残留的socket文件）。失败返回-1
+int handoff_listen( const char* path );
+
+// 连接path上的旧进程，没有旧进程时返回-1
+int handoff_connect( const char* path );
+
+// 一次最多交接的文件描述符个数
+const int HANDOFF_MAX_FDS = 16;
+
+// 通过UNIX域socket sock发送/接收一组文件描述符（最多HANDOFF_MAX_FDS个）
+bool send_fds( int sock, const std::vector< int >& fds );
+bool recv_fds( int sock, std::vector< int >& fds );
+
+#endif
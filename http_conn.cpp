@@ -1,4 +1,21 @@
 #include "http_conn.h"
+#include "affinity.h"
+#include <sys/resource.h>
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22       // Linux 5.14，旧的内核上madvise返回EINVAL，不影响发送
+#endif
+
+// 当前线程累计的缺页次数
+static void thread_faults( long& minflt, long& majflt ) {
+    struct rusage usage;
+    if ( getrusage( RUSAGE_THREAD, &usage ) == -1 ) {
+        minflt = majflt = 0;
+        return;
+    }
+    minflt = usage.ru_minflt;
+    majflt = usage.ru_majflt;
+}
 
 // 定义HTTP响应的一些状态信息
 const char* ok_200_title = "OK";
@@ -10,9 +27,11 @@ const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+const char* error_503_title = "Service Unavailable";
+const char* error_503_form = "The server is overloaded, please try again later.\n";
+const char* error_429_title = "Too Many Requests";
+const char* error_429_form = "You have sent too many requests, please slow down.\n";
 
-// 网站的根目录
-const char* doc_root = "/home/zdb/webserver/resources";
 
 //设置文件描述符非阻塞
 int setnonblocking( int fd ) {
@@ -67,23 +86,291 @@ void modfd(int epollfd, int fd, int ev) {
 
 
 // 所有的客户数
-int http_conn::m_user_count = 0;
+std::atomic< int > http_conn::m_user_count( 0 );
+std::atomic< bool > http_conn::m_draining( false );
 // 所有socket上的事件都被注册到同一个epoll内核事件中，所以设置成静态的
 int http_conn::m_epollfd = -1;
+http_conn::IO_MODEL http_conn::m_io_model = http_conn::IO_PROACTOR;
+// 读写缓冲区的大小
+int http_conn::m_read_buf_size = 2048;
+int http_conn::m_write_buf_size = 1024;
+int http_conn::m_retry_after = 1;
+int http_conn::m_populate_size = 256 * 1024;
+char** http_conn::m_node_buffers = NULL;
+int http_conn::m_buffer_nodes = 0;
+size_t http_conn::m_buffer_slot = 0;
+int http_conn::m_buffer_fds = 0;
+
+void* http_conn::operator new[]( size_t size ) {
+    void* p = NULL;
+    if ( posix_memalign( &p, 64, size ) != 0 ) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void http_conn::operator delete[]( void* p ) {
+    free( p );
+}
+
+bool http_conn::init_buffers( int max_fd, int node_count ) {
+    // 每个连接的读缓冲区、写缓冲区和路径连在一起，按缓存行对齐，相邻连接不共享缓存行
+    m_buffer_slot = ( m_read_buf_size + m_write_buf_size + FILENAME_LEN + 63 ) & ~( size_t )63;
+    m_buffer_fds = max_fd;
+    m_buffer_nodes = node_count;
+    m_node_buffers = new char*[ node_count ]();
+    for ( int i = 0; i < node_count; ++i ) {
+        // 只有一个节点时不需要指定内存策略
+        m_node_buffers[i] = alloc_on_node( m_buffer_slot * max_fd, node_count > 1 ? i : -1 );
+        if ( !m_node_buffers[i] ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void http_conn::free_buffers() {
+    for ( int i = 0; i < m_buffer_nodes; ++i ) {
+        free_on_node( m_node_buffers[i], m_buffer_slot * m_buffer_fds );
+    }
+    delete [] m_node_buffers;
+    m_node_buffers = NULL;
+    m_buffer_nodes = 0;
+}
 
 // 关闭连接
 void http_conn::close_conn() {
     if(m_sockfd != -1) {
-        removefd(m_epollfd, m_sockfd);
+        if( m_ssl ) {
+            tls_server::get_instance()->close( m_ssl );
+            m_ssl = NULL;
+            m_handshaking = false;
+            m_ktls = false;
+        }
+        // 先标记为已关闭再关闭socket：close之后主线程可能马上accept到同一个fd并调用init，
+        // 之后不能再访问这个对象。对象的所有写入和从epoll中移除都在CONN_CLOSED的release之前完成，
+        // 主线程acquire之后才能重新使用它
+        int fd = m_sockfd;
         m_sockfd = -1;
+        ip_limiter::get_instance()->release( m_limit_slot );
+        m_limit_slot = -1;
         m_user_count--; // 关闭一个连接，将客户总数量-1
+        epoll_ctl( m_epollfd, EPOLL_CTL_DEL, fd, 0 );
+        m_state.store( CONN_CLOSED, std::memory_order_release );
+        close( fd );
+    }
+}
+
+bool http_conn::start_tls() {
+    m_ssl = tls_server::get_instance()->accept( m_sockfd );
+    m_handshaking = m_ssl != NULL;
+    return m_ssl != NULL;
+}
+
+// 握手需要的读写都是非阻塞的，缺数据时等下一个EPOLLIN，发送缓冲区满时等EPOLLOUT
+bool http_conn::handshake() {
+    tls_server* tls = tls_server::get_instance();
+    switch ( tls->handshake( m_ssl ) ) {
+        case tls_server::TLS_OK:
+            m_handshaking = false;
+            m_ktls = tls->ktls_send( m_ssl );
+            rearm( EPOLLIN );
+            return true;
+        case tls_server::TLS_WANT_READ:
+            rearm( EPOLLIN );
+            return true;
+        case tls_server::TLS_WANT_WRITE:
+            rearm( EPOLLOUT );
+            return true;
+        default:
+            return false;
+    }
+}
+
+// 请求队列满了、请求排队太久或者客户端超过限速时调用，此时连接不在epoll中等待事件，只有调用者在操作它
+void http_conn::shed( HTTP_CODE code ) {
+    if ( m_io_op == IO_OPEN ) {
+        // I/O线程已经打开了文件，请求早就读完了，直接回复
+        m_io_op = IO_NONE;
+    } else if ( m_io_model == IO_REACTOR && m_state.load( std::memory_order_relaxed ) == CONN_QUEUED ) {
+        if ( m_io_event == EPOLLOUT ) {
+            // 应答已经在发送了，不能再换成503，继续发完
+            if ( !write() ) {
+                close_conn();
+            }
+            return;
+        }
+        // 请求还没有读。带着未读的数据关闭socket时内核会发送RST，客户端可能收不到503
+        if ( !read() ) {
+            close_conn();
+            return;
+        }
+    }
+    m_linger = false;
+    m_write_idx = 0;
+    if ( !process_write( code ) || !write() ) {
+        close_conn();
+    }
+}
+
+void http_conn::reject( int fd, int status ) {
+    const char* title = status == 429 ? error_429_title : error_503_title;
+    const char* form = status == 429 ? error_429_form : error_503_form;
+    char response[ 256 ];
+    int len = snprintf( response, sizeof( response ),
+                        "HTTP/1.1 %d %s\r\nRetry-After: %d\r\nContent-Length: %d\r\nContent-Type:text/html\r\nConnection: close\r\n\r\n%s",
+                        status, title, m_retry_after, ( int )strlen( form ), form );
+    // 新连接的发送缓冲区是空的，一次就能发完；发不出去也不等待
+    send( fd, response, len, MSG_DONTWAIT | MSG_NOSIGNAL );
+    close( fd );
+}
+
+bool http_conn::idle() const {
+    return m_sockfd != -1 && m_read_idx == 0 && bytes_to_send == 0;
+}
+
+bool http_conn::claim() {
+    // EPOLLONESHOT保证重新注册之前不会有事件，所以只可能是等待事件或者正在重新注册。
+    // 同一轮epoll_wait中连接被关闭（fd还可能被新连接复用）时，之后的事件是过时的
+    int state = m_state.load( std::memory_order_acquire );
+    while ( state == CONN_POLLING || state == CONN_ARMING ) {
+        if ( m_state.compare_exchange_weak( state, CONN_MAIN, std::memory_order_acquire ) ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void http_conn::to_worker( int event ) {
+    m_io_event = event;
+    m_state.store( CONN_QUEUED, std::memory_order_release );
+}
+
+bool http_conn::offload( int op ) {
+    io_offload* io = io_offload::get_instance();
+    if ( !io->enabled() ) {
+        return false;
+    }
+    // I/O队列的锁保证了这之前的写入对I/O线程可见
+    int state = m_state.load( std::memory_order_relaxed );
+    m_io_op = op;
+    m_state.store( CONN_IO, std::memory_order_relaxed );
+    if ( io->submit( &m_io_task, op == IO_OPEN ? io_offload::OP_OPEN : io_offload::OP_PREFETCH ) ) {
+        return true;
+    }
+    m_io_op = IO_NONE;
+    m_state.store( state, std::memory_order_relaxed );
+    return false;
+}
+
+void http_conn::run_io() {
+    if ( m_io_op == IO_OPEN ) {
+        // 打开之后知道了文件大小，主线程按它重新选择通道
+        m_io_result = open_file();
+        if ( m_io_result == FILE_REQUEST && request_classifier::get_instance()->enabled() ) {
+            m_lane = request_classifier::get_instance()->classify( m_real_file, m_cache_entry->file_stat.st_size, m_bulk_client );
+        }
+        return;
+    }
+    // 读入接下来要发送的一段：先让内核开始预读整段，再逐页访问，等页面都读进来
+    bool tracing = metrics::get_instance()->tracing();
+    long minflt = 0, majflt = 0;
+    if ( tracing ) {
+        thread_faults( minflt, majflt );
+    }
+    char* start = ( char* )m_iv[1].iov_base;
+    size_t len = m_iv[1].iov_len < PREFETCH_WINDOW ? m_iv[1].iov_len : PREFETCH_WINDOW;
+    long page = sysconf( _SC_PAGESIZE );
+    char* aligned = ( char* )( ( uintptr_t )start & ~( uintptr_t )( page - 1 ) );
+    madvise( aligned, start + len - aligned, MADV_WILLNEED );
+    volatile char sink = 0;
+    for ( char* p = start; p < start + len; p += page ) {
+        sink += *p;
+    }
+    ( void )sink;
+    // 发送这一段的同时，磁盘接着异步读下一段
+    size_t rest = m_iv[1].iov_len - len;
+    if ( rest > 0 ) {
+        char* next = ( char* )( ( uintptr_t )( start + len ) & ~( uintptr_t )( page - 1 ) );
+        madvise( next, start + len - next + ( rest < PREFETCH_WINDOW ? rest : PREFETCH_WINDOW ), MADV_WILLNEED );
+    }
+    if ( tracing ) {
+        count_faults( minflt, majflt );
+    }
+}
+
+void http_conn::count_faults( long minflt, long majflt ) {
+    long now_minflt, now_majflt;
+    thread_faults( now_minflt, now_majflt );
+    m_minflt += now_minflt - minflt;
+    m_majflt += now_majflt - majflt;
+}
+
+bool http_conn::from_io() {
+    // 完成队列的锁保证了I/O线程的写入对这里可见
+    m_state.store( CONN_MAIN, std::memory_order_relaxed );
+    if ( m_io_op == IO_PREFETCH ) {
+        m_io_op = IO_NONE;
+        return true;
     }
+    return false;
+}
+
+bool http_conn::resident( const char* addr, size_t len ) {
+    static const long page = sysconf( _SC_PAGESIZE );
+    uintptr_t start = ( uintptr_t )addr & ~( uintptr_t )( page - 1 );
+    uintptr_t end = ( uintptr_t )addr + ( len < PREFETCH_WINDOW ? len : PREFETCH_WINDOW );
+    unsigned char vec[ PREFETCH_WINDOW / 4096 + 1 ];
+    size_t pages = ( end - start + page - 1 ) / page;
+    if ( pages > sizeof( vec ) || mincore( ( void* )start, end - start, vec ) == -1 ) {
+        return true;            // 查不到时照常发送
+    }
+    for ( size_t i = 0; i < pages; ++i ) {
+        if ( !( vec[i] & 1 ) ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 只有等待事件的连接归epoll所有，主线程可以取得所有权；其他连接在应答发完之后由持有者关闭
+bool http_conn::close_idle() {
+    int state = CONN_POLLING;
+    if ( !m_state.compare_exchange_strong( state, CONN_MAIN, std::memory_order_acquire ) ) {
+        return false;
+    }
+    if ( idle() ) {
+        close_conn();
+        return true;
+    }
+    // 正在读请求或者等待EPOLLOUT，连接仍然注册在epoll中，还给epoll
+    m_state.store( CONN_POLLING, std::memory_order_release );
+    return false;
+}
+
+void http_conn::rearm( int ev ) {
+    // 注册之后事件可能马上发生、主线程取得所有权，所以先标记、注册时用局部变量
+    int fd = m_sockfd;
+    m_state.store( CONN_ARMING, std::memory_order_release );
+    modfd( m_epollfd, fd, ev );
+    int state = CONN_ARMING;
+    m_state.compare_exchange_strong( state, CONN_POLLING, std::memory_order_release, std::memory_order_relaxed );
 }
 
 // 初始化连接,外部调用初始化套接字地址
-void http_conn::init(int sockfd, const sockaddr_in& addr){
+void http_conn::init(int sockfd, const sockaddr_storage& addr, int node, int limit_slot){
+    // 读写缓冲区取自node节点上为这个文件描述符预留的内存
+    if( node < 0 || node >= m_buffer_nodes ) {
+        node = 0;
+    }
+    m_node = node;
+    m_read_buf = m_node_buffers[ node ] + m_buffer_slot * sockfd;
+    m_write_buf = m_read_buf + m_read_buf_size;
+    m_real_file = m_write_buf + m_write_buf_size;
     m_sockfd = sockfd;
-    m_address = addr;
+    m_limit_slot = limit_slot;
+    m_lane = request_classifier::LANE_INTERACTIVE;
+    m_bulk_client = request_classifier::get_instance()->bulk_client( addr );
     
     // 端口复用
     int reuse = 1;
@@ -97,10 +384,12 @@ void http_conn::init(int sockfd, const sockaddr_in& addr){
     */
     setsockopt( m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
 
-    //添加到epoll对象中
-    addfd( m_epollfd, sockfd, true );   //对sockfd启用EPOLLONESHOT
     m_user_count++;  //总用户数+1
     init();
+
+    //添加到epoll对象中，之后由epoll持有
+    m_state.store( CONN_POLLING, std::memory_order_release );
+    addfd( m_epollfd, sockfd, true );   //对sockfd启用EPOLLONESHOT
 }
 
 void http_conn::init() {
@@ -119,23 +408,50 @@ void http_conn::init() {
     m_checked_idx = 0;
     m_read_idx = 0;
     m_write_idx = 0;
-
-    //清空缓存
-    bzero(m_read_buf, READ_BUFFER_SIZE);
-    bzero(m_write_buf, READ_BUFFER_SIZE);
-    bzero(m_real_file, FILENAME_LEN);
+    m_status = 0;
+    m_eagain = 0;
+    m_cache_entry.reset();
+    m_io_op = IO_NONE;
+    // 不开启分阶段计时时只用到STAMP_READ_START，每个请求开始读时都会重新记录
+    if ( metrics::get_instance()->tracing() ) {
+        memset( m_stamp, 0, sizeof( m_stamp ) );
+        m_minflt = 0;
+        m_majflt = 0;
+    }
+    // 读写缓冲区和路径不用清空：解析只访问已经读入的部分（每一行由parse_line补上'\0'），
+    // 应答按m_write_idx发送，路径由canonicalize_url写入并以'\0'结尾
 }
 
 // 循环读取客户数据，直到无数据可读或者对方关闭连接
 bool http_conn::read() {
     //缓冲区已满
-    if( m_read_idx >= READ_BUFFER_SIZE ) {
+    if( m_read_idx >= m_read_buf_size ) {
         return false;
     }
 
     int bytes_read = 0;  //读到的字节
+    if( m_read_idx == 0 ) {
+        // 一个新请求的开始
+        m_stamp[ STAMP_READ_START ] = tsc::now();
+    }
     while(true) {
-        // 从m_read_buf + m_read_idx索引出开始保存数据，大小是READ_BUFFER_SIZE - m_read_idx
+        if( m_ssl ) {
+            // TLS连接：读出解密后的数据，读满缓冲区时留给下一次
+            if( m_read_idx >= m_read_buf_size ) {
+                break;
+            }
+            size_t n = 0;
+            tls_server::RESULT ret = tls_server::get_instance()->read( m_ssl, m_read_buf + m_read_idx, m_read_buf_size - m_read_idx, n );
+            if( ret == tls_server::TLS_OK ) {
+                m_read_idx += n;
+                continue;
+            }
+            if( ret == tls_server::TLS_WANT_READ || ret == tls_server::TLS_WANT_WRITE ) {
+                break;
+            }
+            return false;
+        }
+        // 从m_read_buf + m_read_idx索引出开始保存数据，大小是m_read_buf_size - m_read_idx
         /*
         ssize_t recv(int sockfd, void* buf, size_t len, int flags);
         失败返回-1并设置errno
@@ -143,7 +459,7 @@ bool http_conn::read() {
         - buf和len指定读缓冲区的位置和大小
         - flags为数据收发提供额外的控制
         */
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0 );
+        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, m_read_buf_size - m_read_idx, 0 );
         if (bytes_read == -1) {
             if( errno == EAGAIN || errno == EWOULDBLOCK ) {
                 // 没有数据
@@ -155,6 +471,9 @@ bool http_conn::read() {
         }
         m_read_idx += bytes_read;
     }
+    if ( metrics::get_instance()->tracing() ) {
+        m_stamp[ STAMP_READ_END ] = tsc::now();
+    }
     return true;
 }
 
@@ -330,44 +649,162 @@ http_conn::HTTP_CODE http_conn::process_read() {
     }
     return NO_REQUEST;
 }
+static int hex_value( char c ) {
+    if ( c >= '0' && c <= '9' ) return c - '0';
+    if ( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+    if ( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+    return -1;
+}
+
+/*
+    把URL的路径部分解码、规范化为相对于网站根目录的路径，结果写入path（不以'/'开头，根目录本身为空串）
+    - 去掉查询串和片段（'?'、'#'之后的部分）
+    - %xx解码，解码出的'\0'和'/'视为非法
+    - 合并连续的'/'，去掉"."，".."回退一级，越过根目录视为非法
+    非法或结果超过size-1个字节时返回false
+*/
+static bool canonicalize_url( const char* url, char* path, int size ) {
+    int len = 0;                        // path中已确定部分的长度
+    const char* p = url;
+    while ( *p && *p != '?' && *p != '#' ) {
+        while ( *p == '/' ) {
+            ++p;
+        }
+        // 把一个路径段解码后追加到path，非首段先补一个'/'
+        int start = ( len == 0 ) ? 0 : len + 1;
+        int end = start;
+        while ( *p && *p != '/' && *p != '?' && *p != '#' ) {
+            char c = *p++;
+            if ( c == '%' ) {
+                int hi = hex_value( p[0] );
+                int lo = ( hi < 0 ) ? -1 : hex_value( p[1] );
+                if ( lo < 0 ) {
+                    return false;
+                }
+                c = ( char )( hi * 16 + lo );
+                p += 2;
+                if ( c == '\0' || c == '/' ) {
+                    return false;
+                }
+            }
+            if ( end >= size - 1 ) {
+                return false;
+            }
+            path[ end++ ] = c;
+        }
+
+        int n = end - start;
+        if ( n == 0 || ( n == 1 && path[ start ] == '.' ) ) {
+            continue;                   // 空段或"."
+        }
+        if ( n == 2 && path[ start ] == '.' && path[ start + 1 ] == '.' ) {
+            if ( len == 0 ) {
+                return false;           // 越过了网站根目录
+            }
+            do {
+                --len;                  // 回退到上一个'/'，即去掉最后一段
+            } while ( len > 0 && path[ len ] != '/' );
+            continue;
+        }
+        if ( start > 0 ) {
+            path[ len ] = '/';
+        }
+        len = end;
+    }
+    path[ len ] = '\0';
+    return true;
+}
+
+// 请求行是 "GET /path HTTP/1.1"，和parse_request_line一样接受 "http://host/path" 形式的URL
+bool http_conn::peek_path( char* path ) {
+    const char* line = m_read_buf;
+    const char* end = m_read_buf + m_read_idx;
+    const char* url = line;
+    while ( url < end && *url != ' ' && *url != '\t' && *url != '\r' && *url != '\n' ) {
+        ++url;
+    }
+    if ( url >= end || ( *url != ' ' && *url != '\t' ) ) {
+        return false;
+    }
+    ++url;
+    const char* url_end = url;
+    while ( url_end < end && *url_end != ' ' && *url_end != '\t' && *url_end != '\r' && *url_end != '\n' ) {
+        ++url_end;
+    }
+    if ( url_end - url > 7 && strncasecmp( url, "http://", 7 ) == 0 ) {
+        url = ( const char* )memchr( url + 7, '/', url_end - url - 7 );
+        if ( !url ) {
+            return false;
+        }
+    }
+    char buf[ FILENAME_LEN ];
+    if ( url_end - url >= FILENAME_LEN || url >= url_end || *url != '/' ) {
+        return false;
+    }
+    memcpy( buf, url, url_end - url );
+    buf[ url_end - url ] = '\0';
+    return canonicalize_url( buf, path, FILENAME_LEN );
+}
+
+// IO_PROACTOR模型下新的请求已经读入，按请求的路径分类；IO_REACTOR模型下请求还没有读，
+// 沿用这个连接上一个请求的通道（do_request在知道了文件大小之后更新它）。
+// 解析过的请求（如I/O线程打开文件之后再交给工作线程）请求行已经被parse_line改写，不能再取路径，
+// 沿用已经算好的通道
+int http_conn::lane() {
+    request_classifier* classifier = request_classifier::get_instance();
+    if ( !classifier->enabled() ) {
+        return request_classifier::LANE_INTERACTIVE;
+    }
+    if ( m_io_model == IO_PROACTOR && m_check_state == CHECK_STATE_REQUESTLINE && m_checked_idx == 0 ) {
+        char path[ FILENAME_LEN ];
+        if ( !peek_path( path ) ) {
+            path[0] = '\0';
+        }
+        m_lane = classifier->classify( path, -1, m_bulk_client );
+    }
+    return m_lane;
+}
+
 /*当得到一个完整、正确的HTTP请求时，我们就分析目标文件的属性，
   如果目标文件存在、对所有用户可读，且不是目录，则使用mmap将其
   映射到内存地址m_file_address处，并告诉调用者获取文件成功
 */
 http_conn::HTTP_CODE http_conn::do_request()
 {
-    // "/home/nowcoder/webserver/resources"
-    /*
-    char* strcpy(char* dest, const char* src);
-    把src所指向的字符串复制到dest
-    */
-    strcpy( m_real_file, doc_root );
-    int len = strlen( doc_root );
-    /*
-    char* strncpy(char* dest, const char* src, size_t num);
-    把src所指向的num个字符复制到dest
-    */
-    strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1 );
-    /*
-    int stat(const char* path, struct stat* buf);
-    作用：获取文件信息。成功返回0,失败返回-1
-    */
-    if ( stat( m_real_file, &m_file_stat ) == -1 ) { //获取m_real_file文件的相关的状态信息
-        return NO_RESOURCE;
+    if ( metrics::get_instance()->tracing() ) {
+        m_stamp[ STAMP_OPEN ] = tsc::now();
+    }
+    // 把URL解码并规范化为相对于网站根目录的路径，如 "/images/../index.html" -> "index.html"
+    // 不再拼接成绝对路径，文件都相对网站根目录的目录文件描述符打开，省去从"/"开始的路径遍历
+    if ( !canonicalize_url( m_url, m_real_file, FILENAME_LEN ) ) {
+        return BAD_REQUEST;
     }
 
-    // 判断访问权限
-    if ( ! ( m_file_stat.st_mode & S_IROTH ) ) {
-        return FORBIDDEN_REQUEST;
+    // 先查缓存，命中时不需要遍历路径、打开文件；小文件还可以直接发送缓存好的完整应答
+    m_cache_entry = file_cache::get_instance()->get( m_real_file );
+    if ( !m_cache_entry ) {
+        // 打开文件可能要等磁盘，有I/O线程时交给它，由process提交
+        if ( io_offload::get_instance()->enabled() ) {
+            return FILE_PENDING;
+        }
+        HTTP_CODE ret = open_file();
+        if ( ret != FILE_REQUEST ) {
+            return ret;
+        }
     }
+    return map_file();
+}
 
-    // 判断是否是目录
-    if ( S_ISDIR( m_file_stat.st_mode ) ) {
-        return BAD_REQUEST;
+http_conn::HTTP_CODE http_conn::map_file()
+{
+    m_file_size = m_cache_entry->file_stat.st_size;
+    if ( m_io_model == IO_REACTOR && request_classifier::get_instance()->enabled() ) {
+        m_lane = request_classifier::get_instance()->classify( m_real_file, m_file_size, m_bulk_client );
+    }
+    if ( m_cache_entry->has_response() ) {
+        return FILE_REQUEST;
     }
 
-    // 以只读方式打开文件
-    int fd = open( m_real_file, O_RDONLY );
     /*
     创建内存映射
     void* mmap(void* start, isze_t length, int prot, int flags, int fd, off_t offset);
@@ -385,20 +822,127 @@ http_conn::HTTP_CODE http_conn::do_request()
      - fd参数是被映射文件对应的文件描述符。它一般通过open系统调用获得
      - offset参数设置从文件的何处开始映射  
     */
-    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
-    close( fd );
+    if ( m_cache_entry->mapping ) {
+        // 热点文件已经整个映射并锁定在内存中，直接发送
+        m_file_address = m_cache_entry->mapping;
+        return FILE_REQUEST;
+    }
+    // 较小的文件预先建立页表，发送时不再逐页缺页。有I/O线程时不在这里等磁盘：
+    // 映射之后页面都已经在内存中才建立页表，否则发送之前由I/O线程读入
+    size_t size = m_file_size;
+    bool populate = size <= ( size_t )m_populate_size;
+    bool offload = io_offload::get_instance()->enabled();
+    int flags = MAP_PRIVATE | ( populate && !offload ? MAP_POPULATE : 0 );
+    m_file_address = ( char* )mmap( 0, size, PROT_READ, flags, m_cache_entry->fd, 0 );
+    if ( m_file_address == MAP_FAILED ) {
+        m_file_address = 0;
+        return size == 0 ? FILE_REQUEST : INTERNAL_ERROR;
+    }
+    if ( populate ) {
+        if ( offload && size <= PREFETCH_WINDOW && resident( m_file_address, size ) ) {
+            madvise( m_file_address, size, MADV_POPULATE_READ );
+        }
+    } else {
+        // 大文件按顺序读：加大缺页时的预读，并且让内核马上开始异步读入开头的一段
+        madvise( m_file_address, size, MADV_SEQUENTIAL );
+        madvise( m_file_address, size < PREFETCH_WINDOW ? size : PREFETCH_WINDOW, MADV_WILLNEED );
+    }
+    return FILE_REQUEST;
+}
+
+// 缓存未命中：相对网站根目录打开文件并检查其属性，小文件同时生成完整应答，然后放入缓存
+http_conn::HTTP_CODE http_conn::open_file()
+{
+    file_cache* cache = file_cache::get_instance();
+    unsigned long gen = cache->generation();
+
+    int fd = cache->open_file( m_real_file );
+    if ( fd == -1 ) {
+        // 没有权限，或者路径解析时（经由符号链接）越出了网站根目录
+        if ( errno == EACCES || errno == EXDEV || errno == ELOOP ) {
+            return FORBIDDEN_REQUEST;
+        }
+        return NO_RESOURCE;
+    }
+    std::shared_ptr< file_cache_entry > entry( new file_cache_entry );
+    entry->fd = fd;
+
+    /*
+    int fstat(int fd, struct stat* buf);
+    作用：获取已打开文件的信息。成功返回0,失败返回-1
+    */
+    if ( fstat( fd, &entry->file_stat ) == -1 ) {
+        return NO_RESOURCE;
+    }
+
+    // 判断访问权限
+    if ( ! ( entry->file_stat.st_mode & S_IROTH ) ) {
+        return FORBIDDEN_REQUEST;
+    }
+
+    // 判断是否是目录
+    if ( S_ISDIR( entry->file_stat.st_mode ) ) {
+        return BAD_REQUEST;
+    }
+
+    // 设备、管道等特殊文件不允许访问
+    if ( !S_ISREG( entry->file_stat.st_mode ) ) {
+        return FORBIDDEN_REQUEST;
+    }
+
+    // 小文件：生成完整应答，下次请求直接命中
+    if ( cache->small_file( entry->file_stat.st_size ) ) {
+        if ( !make_response( entry.get() ) ) {
+            return INTERNAL_ERROR;
+        }
+    } else if ( cache->hot( m_real_file ) ) {
+        cache->pin( entry.get() );
+    }
+    cache->put( m_real_file, entry, gen );
+    m_cache_entry = entry;
     return FILE_REQUEST;
 }
 
+// 用与process_write相同的方式生成长连接和短连接两份完整应答
+bool http_conn::make_response( file_cache_entry* entry ) {
+    int size = entry->file_stat.st_size;
+    std::string body( size, '\0' );
+    for ( int done = 0; done < size; ) {
+        ssize_t n = pread( entry->fd, &body[ done ], size - done, done );
+        if ( n <= 0 ) {
+            return false;
+        }
+        done += n;
+    }
+
+    bool linger = m_linger;
+    bool ret = true;
+    for ( int i = 0; i < 2 && ret; ++i ) {
+        m_linger = ( i == 0 );
+        m_write_idx = 0;
+        ret = add_status_line( 200, ok_200_title ) && add_headers( size );
+        std::string& response = m_linger ? entry->keep_alive : entry->close;
+        response.reserve( m_write_idx + size );
+        response.assign( m_write_buf, m_write_idx );
+        response.append( body );
+    }
+    m_linger = linger;
+    m_write_idx = 0;
+    return ret;
+}
 
 
-// 对内存映射区执行munmap操作，释放内存空间
+// 对内存映射区执行munmap操作，释放内存空间，同时释放对缓存应答的引用
 void http_conn::unmap() {
     if( m_file_address ) {
-        //int munmap(void* start, isze_t length);
-        munmap( m_file_address, m_file_stat.st_size );
+        // 热点文件的映射属于缓存项，不解除
+        if ( m_file_address != m_cache_entry->mapping ) {
+            //int munmap(void* start, isze_t length);
+            munmap( m_file_address, m_file_size );
+        }
         m_file_address = 0;
     }
+    m_cache_entry.reset();
 }
 
 // 写HTTP响应
@@ -406,13 +950,33 @@ bool http_conn::write() {
     int temp = 0;
     
     if ( bytes_to_send == 0 ) {
-        // 将要发送的字节为0，这一次响应结束。
-        modfd( m_epollfd, m_sockfd, EPOLLIN ); 
+        // 将要发送的字节为0，这一次响应结束。先重置再重新注册，注册之后连接可能立刻被主线程读取
         init();
+        rearm( EPOLLIN );
         return true;
     }
 
+    bool tracing = metrics::get_instance()->tracing();
+    if ( m_stamp[ STAMP_WRITE ] == 0 && tracing ) {
+        m_stamp[ STAMP_WRITE ] = tsc::now();
+    }
+
+    // 有I/O线程时，发送mmap的文件之前先检查要发送的部分是否在内存中，不在时交给I/O线程读入，不在这里等待缺页
+    // 常驻内存的热点文件不用检查
+    bool prefetch = m_file_address && m_iv_count == 2 && m_file_address != m_cache_entry->mapping
+                    && io_offload::get_instance()->enabled();
+
     while(1) {
+        size_t file_left = 0;           // 超出检查范围、这一次不发送的文件内容
+        if ( prefetch && m_iv[1].iov_len > 0 ) {
+            if ( !resident( ( char* )m_iv[1].iov_base, m_iv[1].iov_len ) && offload( IO_PREFETCH ) ) {
+                return true;
+            }
+            if ( m_iv[1].iov_len > PREFETCH_WINDOW ) {
+                file_left = m_iv[1].iov_len - PREFETCH_WINDOW;
+                m_iv[1].iov_len = PREFETCH_WINDOW;
+            }
+        }
         /*
         writev函数将多块分散的内存数据一并写入文件描述符中，即集中写。失败返回-1并设置errno
         ssize_t writev(int fd, const struct iovec* vector, int count);
@@ -420,12 +984,22 @@ bool http_conn::write() {
         - vector参数类型iovec结构体描述一块内存区
         - count参数是vector数组的长度
         */
-        temp = writev(m_sockfd, m_iv, m_iv_count);  // 集中写
+        long minflt = 0, majflt = 0;
+        if ( tracing ) {
+            thread_faults( minflt, majflt );
+        }
+        temp = send_iov();  // 集中写
+        m_iv[1].iov_len += file_left;
+        if ( tracing ) {
+            count_faults( minflt, majflt );
+        }
         if ( temp <= -1 ) {
             // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
             // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
+            // 剩下的部分在下一个EPOLLOUT事件中发送
             if( errno == EAGAIN ) {
-                modfd( m_epollfd, m_sockfd, EPOLLOUT );
+                ++m_eagain;
+                rearm( EPOLLOUT );
                 return true;
             }
             unmap();
@@ -435,21 +1009,26 @@ bool http_conn::write() {
         bytes_have_send += temp;  //已经发送的
         bytes_to_send -= temp;    //还需要发送的
 
-        if (bytes_have_send >= m_iv[0].iov_len) {
-            m_iv[0].iov_len = 0;
-            m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_idx);
-            m_iv[1].iov_len = bytes_to_send;
-        } else {
-            m_iv[0].iov_base = m_write_buf + bytes_have_send;
-            m_iv[0].iov_len = m_iv[0].iov_len - temp;
+        // 按本次写出的字节数依次推进各个内存块，下次writev从未发送的位置继续
+        for ( int i = 0; i < m_iv_count && temp > 0; ++i ) {
+            int n = ( (size_t)temp < m_iv[i].iov_len ) ? temp : m_iv[i].iov_len;
+            m_iv[i].iov_base = ( char* )m_iv[i].iov_base + n;
+            m_iv[i].iov_len -= n;
+            temp -= n;
         }
 
         if (bytes_to_send <= 0) { // 没有数据要发送了
+            metrics* stats = metrics::get_instance();
+            stats->request_done( m_status, tsc::to_usec( tsc::now() - m_stamp[ STAMP_READ_START ] ), bytes_have_send );
+            if ( stats->tracing() ) {
+                trace_request();
+            }
             unmap();
-            modfd(m_epollfd, m_sockfd, EPOLLIN);
 
             if (m_linger) {  //如果长连接
+                // rearm之后主线程可能马上处理下一个请求，这是最后一次访问这个连接
                 init();
+                rearm( EPOLLIN );
                 return true;
             } else {
                 return false;
@@ -458,15 +1037,41 @@ bool http_conn::write() {
     }
 }
 
+ssize_t http_conn::send_iov() {
+    if ( !m_ssl || m_ktls ) {
+        // 明文连接，或者开启了kTLS：内核负责加密，直接写socket
+        return writev( m_sockfd, m_iv, m_iv_count );
+    }
+    // 用户态加密：每次写出一块，SSL_write部分写出时返回已写出的字节数
+    for ( int i = 0; i < m_iv_count; ++i ) {
+        if ( m_iv[i].iov_len == 0 ) {
+            continue;
+        }
+        size_t n = 0;
+        switch ( tls_server::get_instance()->write( m_ssl, ( const char* )m_iv[i].iov_base, m_iv[i].iov_len, n ) ) {
+            case tls_server::TLS_OK:
+                return n;
+            case tls_server::TLS_WANT_READ:
+            case tls_server::TLS_WANT_WRITE:
+                errno = EAGAIN;
+                return -1;
+            default:
+                errno = EIO;
+                return -1;
+        }
+    }
+    return 0;
+}
+
 // 往写缓冲中写入待发送的数据
 bool http_conn::add_response( const char* format, ... ) {
-    if( m_write_idx >= WRITE_BUFFER_SIZE ) {
+    if( m_write_idx >= m_write_buf_size ) {
         return false;
     }
     va_list arg_list;
     va_start( arg_list, format );
-    int len = vsnprintf( m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list );
-    if( len >= ( WRITE_BUFFER_SIZE - 1 - m_write_idx ) ) {
+    int len = vsnprintf( m_write_buf + m_write_idx, m_write_buf_size - 1 - m_write_idx, format, arg_list );
+    if( len >= ( m_write_buf_size - 1 - m_write_idx ) ) {
         return false;
     }
     m_write_idx += len;
@@ -479,10 +1084,8 @@ bool http_conn::add_status_line( int status, const char* title ) {
 }
 // 2. 响应报文响应头部
 bool http_conn::add_headers(int content_len) {
-    add_content_length(content_len);
-    add_content_type();
-    add_linger();
-    add_blank_line();
+    return add_content_length(content_len) && add_content_type()
+        && add_linger() && add_blank_line();
 }
 
 bool http_conn::add_content_length(int content_len) {  //数据长度
@@ -508,6 +1111,7 @@ bool http_conn::add_content( const char* content ) {
 bool http_conn::process_write(HTTP_CODE ret) {
     switch (ret) {
         case INTERNAL_ERROR:                          // 500 Internal Server Error 服务器内部错误
+            m_status = 500;
             add_status_line( 500, error_500_title );
             add_headers( strlen( error_500_form ) );
             if ( ! add_content( error_500_form ) ) {
@@ -515,6 +1119,7 @@ bool http_conn::process_write(HTTP_CODE ret) {
             }
             break;
         case BAD_REQUEST:                              // 400 Bad Request 客户端请求的报文有错误
+            m_status = 400;
             add_status_line( 400, error_400_title );
             add_headers( strlen( error_400_form ) );
             if ( ! add_content( error_400_form ) ) {
@@ -522,6 +1127,7 @@ bool http_conn::process_write(HTTP_CODE ret) {
             }
             break;
         case NO_RESOURCE:                             // 404 Not Found 请求的资源在服务器上没找到
+            m_status = 404;
             add_status_line( 404, error_404_title );
             add_headers( strlen( error_404_form ) );
             if ( ! add_content( error_404_form ) ) {
@@ -529,22 +1135,51 @@ bool http_conn::process_write(HTTP_CODE ret) {
             }
             break;
         case FORBIDDEN_REQUEST:                       // 403 Forbidden 服务器禁止访问资源
+            m_status = 403;
             add_status_line( 403, error_403_title );
             add_headers(strlen( error_403_form));
             if ( ! add_content( error_403_form ) ) {
                 return false;
             }
             break;
+        case SERVICE_UNAVAILABLE:                     // 503 Service Unavailable 服务器过载
+            m_status = 503;
+            add_status_line( 503, error_503_title );
+            add_response( "Retry-After: %d\r\n", m_retry_after );
+            add_headers( strlen( error_503_form ) );
+            if ( ! add_content( error_503_form ) ) {
+                return false;
+            }
+            break;
+        case TOO_MANY_REQUESTS:                       // 429 Too Many Requests 客户端超过了限速
+            m_status = 429;
+            add_status_line( 429, error_429_title );
+            add_response( "Retry-After: %d\r\n", m_retry_after );
+            add_headers( strlen( error_429_form ) );
+            if ( ! add_content( error_429_form ) ) {
+                return false;
+            }
+            break;
         case FILE_REQUEST:                            // 200 OK
+            m_status = 200;
+            if ( m_cache_entry->has_response() ) {
+                // 命中小文件缓存：响应头和文件内容已经在一块只读内存中，一次发送即可
+                const std::string& response = m_cache_entry->response( m_linger );
+                m_iv[ 0 ].iov_base = ( char* )response.data();
+                m_iv[ 0 ].iov_len = response.size();
+                m_iv_count = 1;
+                bytes_to_send = response.size();
+                return true;
+            }
             add_status_line(200, ok_200_title );
-            add_headers(m_file_stat.st_size);
+            add_headers(m_file_size);
             m_iv[ 0 ].iov_base = m_write_buf;
             m_iv[ 0 ].iov_len = m_write_idx;
             m_iv[ 1 ].iov_base = m_file_address;
-            m_iv[ 1 ].iov_len = m_file_stat.st_size;
+            m_iv[ 1 ].iov_len = m_file_size;
             m_iv_count = 2;
 
-            bytes_to_send = m_write_idx + m_file_stat.st_size;
+            bytes_to_send = m_write_idx + m_file_size;
 
             return true;
         default:
@@ -560,17 +1195,99 @@ bool http_conn::process_write(HTTP_CODE ret) {
 
 // 由线程池中的工作线程调用，这是处理HTTP请求的入口函数
 void http_conn::process() {
-    // 解析HTTP请求
-    HTTP_CODE read_ret = process_read();
+    // 队列的锁保证了主线程交出连接之前的写入对这里可见
+    m_state.store( CONN_WORKER, std::memory_order_relaxed );
+    bool tracing = metrics::get_instance()->tracing();
+    HTTP_CODE read_ret;
+    if ( m_io_op == IO_OPEN ) {
+        // I/O线程打开了文件，继续处理这个请求
+        m_io_op = IO_NONE;
+        read_ret = m_io_result == FILE_REQUEST ? map_file() : m_io_result;
+    } else {
+        if ( m_io_model == IO_REACTOR ) {
+            // 工作线程自己收发：继续发送没发完的应答，或者读请求并检查限速
+            if ( m_io_event == EPOLLOUT ) {
+                if ( !write() ) {
+                    close_conn();
+                }
+                return;
+            }
+            if ( !read() ) {
+                close_conn();
+                return;
+            }
+            if ( !ip_limiter::get_instance()->allow_request( m_limit_slot ) ) {
+                shed( TOO_MANY_REQUESTS );
+                return;
+            }
+        }
+
+        // 解析HTTP请求
+        if ( tracing ) {
+            m_stamp[ STAMP_PROCESS ] = tsc::now();
+            m_stamp[ STAMP_OPEN ] = 0;
+        }
+        read_ret = process_read();
+        if ( read_ret == FILE_PENDING ) {
+            // 文件不在缓存中，交给I/O线程打开，完成后主线程把连接再交给工作线程；I/O队列满时自己打开
+            if ( offload( IO_OPEN ) ) {
+                return;
+            }
+            read_ret = open_file();
+            if ( read_ret == FILE_REQUEST ) {
+                read_ret = map_file();
+            }
+        }
+    }
+    if ( tracing ) {
+        // 请求有错时没有调用do_request，OPEN阶段记为0
+        m_stamp[ STAMP_OPENED ] = tsc::now();
+        if ( m_stamp[ STAMP_OPEN ] == 0 ) {
+            m_stamp[ STAMP_OPEN ] = m_stamp[ STAMP_OPENED ];
+        }
+    }
     if ( read_ret == NO_REQUEST ) {
-        modfd( m_epollfd, m_sockfd, EPOLLIN );
+        rearm( EPOLLIN );
         return;
     }
     
+    // 服务器正在退出，发完这个应答就关闭连接
+    if ( m_draining ) {
+        m_linger = false;
+    }
+
     // 生成响应
     bool write_ret = process_write( read_ret );
-    if ( !write_ret ) {
+    if ( tracing ) {
+        m_stamp[ STAMP_BUILT ] = tsc::now();
+    }
+    // 套接字几乎总是可写的，直接在工作线程里发送，不再经过一次EPOLLOUT事件和主线程；
+    // 发送缓冲区满时write把连接注册EPOLLOUT交回主线程
+    if ( !write_ret || !write() ) {
         close_conn();
     }
-    modfd( m_epollfd, m_sockfd, EPOLLOUT );
-}
\ No newline at end of file
+}
+
+void http_conn::trace_request() {
+    if ( m_stamp[ STAMP_BUILT ] == 0 ) {
+        // 被拒绝的请求没有经过处理的各个阶段
+        return;
+    }
+    uint64_t now = tsc::now();
+    metrics::request_trace trace;
+    // 相邻两个时间点之差就是一个阶段的耗时
+    trace.m_stage[ metrics::STAGE_READ ] = tsc::to_usec( m_stamp[ STAMP_READ_END ] - m_stamp[ STAMP_READ_START ] );
+    trace.m_stage[ metrics::STAGE_QUEUE ] = tsc::to_usec( m_stamp[ STAMP_PROCESS ] - m_stamp[ STAMP_READ_END ] );
+    trace.m_stage[ metrics::STAGE_PARSE ] = tsc::to_usec( m_stamp[ STAMP_OPEN ] - m_stamp[ STAMP_PROCESS ] );
+    trace.m_stage[ metrics::STAGE_OPEN ] = tsc::to_usec( m_stamp[ STAMP_OPENED ] - m_stamp[ STAMP_OPEN ] );
+    trace.m_stage[ metrics::STAGE_BUILD ] = tsc::to_usec( m_stamp[ STAMP_BUILT ] - m_stamp[ STAMP_OPENED ] );
+    trace.m_stage[ metrics::STAGE_DISPATCH ] = tsc::to_usec( m_stamp[ STAMP_WRITE ] - m_stamp[ STAMP_BUILT ] );
+    trace.m_stage[ metrics::STAGE_WRITE ] = tsc::to_usec( now - m_stamp[ STAMP_WRITE ] );
+    trace.m_total = tsc::to_usec( now - m_stamp[ STAMP_READ_START ] );
+    trace.m_status = m_status;
+    trace.m_eagain = m_eagain;
+    trace.m_minflt = m_minflt;
+    trace.m_majflt = m_majflt;
+    snprintf( trace.m_url, sizeof( trace.m_url ), "%s", m_url ? m_url : "-" );
+    metrics::get_instance()->trace_done( trace );
+}
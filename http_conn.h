@@ -20,21 +20,63 @@
 #include <errno.h>
 #include "locker.h"
 #include <sys/uio.h>
+#include <memory>
+#include <atomic>
+#include "file_cache.h"
+#include "metrics.h"
+#include "tsc.h"
+#include "overload.h"
+#include "tls.h"
+#include "classifier.h"
+#include "io_offload.h"
 /*
     任务类
 */
 class http_conn {
 public:
-    http_conn(){}
+    http_conn() : m_state(CONN_CLOSED), m_sockfd(-1), m_io_event(EPOLLIN), m_io_op(IO_NONE), m_node(0), m_lane(0),
+                  m_limit_slot(-1), m_handshaking(false), m_ktls(false), m_bulk_client(false), m_ssl(NULL), m_read_buf(NULL),
+                  m_real_file(NULL), m_write_buf(NULL), m_file_address(NULL), m_io_result(NO_REQUEST) { m_io_task.m_conn = this; }
     ~http_conn(){}
 
+    // 连接数组（main中的users）按缓存行对齐分配，每个连接的调度状态独占一个缓存行
+    static void* operator new[]( size_t size );
+    static void operator delete[]( void* p );
+
     static int m_epollfd;       // 所有socket上的事件都被注册到同一个epoll内核事件中，所以设置成静态的
-    static int m_user_count;    // 统计用户的数量
+    static std::atomic< int > m_user_count;     // 统计用户的数量，工作线程也会关闭连接，所以是原子的
+    static std::atomic< bool > m_draining;      // 服务器正在优雅退出，之后的应答都不再保持连接
+    static int m_read_buf_size;     // 读缓冲区的大小，启动时由配置决定
+    static int m_write_buf_size;    // 写缓冲区的大小，启动时由配置决定
+    static int m_retry_after;       // 503应答中Retry-After的秒数
+    static int m_populate_size;     // 不超过这么大的文件映射时预先建立页表（MAP_POPULATE），更大的文件按顺序预读
+
+    /*
+        I/O模型，启动时由配置决定
+        IO_PROACTOR :   主线程读请求，工作线程解析、生成并直接发送应答，发不完时主线程继续发送
+        IO_REACTOR  :   主线程只等待事件，读请求和发送应答都在工作线程中完成
+    */
+    enum IO_MODEL { IO_PROACTOR = 0, IO_REACTOR };
+    static IO_MODEL m_io_model;
+
+    /*
+        连接的所有权，任何时刻只有持有者访问连接对象（所有权转移时的内存可见性由m_state的acquire/release保证）
+        CONN_CLOSED     :   没有连接
+        CONN_POLLING    :   注册在epoll中等待事件，事件发生时主线程取得所有权
+        CONN_MAIN       :   主线程持有
+        CONN_QUEUED     :   在请求队列中等待工作线程
+        CONN_WORKER     :   工作线程持有
+        CONN_ARMING     :   持有者正在把连接重新注册到epoll，注册之后事件可能马上发生，主线程可以直接取得所有权
+        CONN_IO         :   在I/O线程中打开文件或者读入文件页面（见io_offload），完成后回到主线程
+    */
+    enum CONN_STATE { CONN_CLOSED = 0, CONN_POLLING, CONN_MAIN, CONN_QUEUED, CONN_WORKER, CONN_ARMING, CONN_IO, CONN_STATES };
 
 
     static const int FILENAME_LEN = 200;        // 文件名的最大长度
-    static const int READ_BUFFER_SIZE = 2048;   // 读缓冲区的大小
-    static const int WRITE_BUFFER_SIZE = 1024;  // 写缓冲区的大小
+
+    // 为每个NUMA节点预留max_fd个连接的读写缓冲区，物理页优先从该节点分配
+    static bool init_buffers( int max_fd, int node_count );
+    static void free_buffers();
     
     // HTTP请求方法，这里只支持GET
     enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT};
@@ -56,25 +98,51 @@ public:
         FORBIDDEN_REQUEST   :   表示客户对资源没有足够的访问权限     403 Forbidden 
         FILE_REQUEST        :   文件请求,获取文件成功              200 OK
         INTERNAL_ERROR      :   表示服务器内部错误                 500 Internal Server Erro
+        SERVICE_UNAVAILABLE :   服务器过载，请求没有处理           503 Service Unavailable
+        TOO_MANY_REQUESTS   :   客户端超过了限速，请求没有处理     429 Too Many Requests
         CLOSED_CONNECTION   :   表示客户端已经关闭连接了
+        FILE_PENDING        :   文件不在缓存中，要交给I/O线程打开
     */
     enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, 
-    FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, SERVICE_UNAVAILABLE, TOO_MANY_REQUESTS, CLOSED_CONNECTION, FILE_PENDING };
     
     // 从状态机的三种可能状态，即行的读取状态，分别表示
     // 1.读取到一个完整的行 2.行出错 3.行数据尚且不完整
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
 
 
-    void init(int sockfd, const sockaddr_in& addr); // 初始化新接受的连接
-    void close_conn();                              // 关闭连接
-    void process();                                 // 处理客户端请求
+    // 初始化新接受的连接，node是处理它的NUMA节点，limit_slot是ip_limiter::acquire分给它的表项
+    void init(int sockfd, const sockaddr_storage& addr, int node = 0, int limit_slot = -1);
+    int node() const { return m_node; }
+    // 主线程分派请求之前调用，返回请求进入的线程池通道（见request_classifier）
+    int lane();
+    CONN_STATE state() const { return ( CONN_STATE )m_state.load( std::memory_order_relaxed ); }
+    // 主线程accept到这个fd之后、调用init之前检查：之前的持有者在close_conn中已经完成了对这个对象的所有写入
+    bool closed() const { return m_state.load( std::memory_order_acquire ) == CONN_CLOSED; }
+    bool claim();                                   // 主线程在连接上有事件时取得所有权，返回false表示事件已经过时
+    void to_worker( int event );                    // 主线程把连接交给工作线程，event是要工作线程处理的EPOLLIN或EPOLLOUT
+    bool close_idle();                              // 主线程在优雅退出时关闭等待下一个请求的长连接
+    void close_conn();                              // 关闭连接，只能由持有者调用
+    void process();                                 // 处理客户端请求，IO_REACTOR模型下先读请求
+    void run_io();                                  // 由I/O线程调用，完成连接提交的文件操作
+    bool from_io();                                 // 主线程取回I/O线程完成的连接，返回true表示接下来继续发送应答
     bool read();                                    // 非阻塞的读
-    bool write();                                   // 非阻塞的写
+    bool write();                                   // 非阻塞的写，工作线程生成应答后直接调用，写不完时在EPOLLOUT事件中继续
+    int limit_slot() const { return m_limit_slot; }
+    bool start_tls();                               // TLS监听地址上接受的连接在init之后调用，之后先握手
+    bool handshaking() const { return m_handshaking; }
+    bool handshake();                               // 由主线程在握手期间的读写事件中调用，失败返回false
+    // 过载（503）或者客户端超过限速（429）时不处理请求，回复code对应的应答后关闭连接
+    void shed( HTTP_CODE code = SERVICE_UNAVAILABLE );
+    static void reject( int fd, int status = 503 ); // 给刚accept、不能再接受的连接发送503或429并关闭它
 
 
 private:
+    friend struct http_conn_bench;                  // 微基准测试（bench/bench_http.cpp）直接驱动解析状态机
+
     void init();                                    // 初始化连接
+    bool idle() const;                              // 长连接正在等待下一个请求，没有处理中的请求和未发完的应答
+    void rearm( int ev );                           // 重新注册到epoll，交出所有权，之后不能再访问连接
     HTTP_CODE process_read();                       // 解析HTTP请求
     bool process_write( HTTP_CODE ret );            // 填充HTTP应答
 
@@ -96,36 +164,80 @@ private:
     bool add_content_length( int content_length );
     bool add_linger();
     bool add_blank_line();
+    HTTP_CODE open_file();                          // 缓存未命中时打开目标文件
+    HTTP_CODE map_file();                           // 打开文件之后取得文件状态，大文件映射到内存
+    bool offload( int op );                         // 把文件操作交给I/O线程，成功后不能再访问连接
+    bool resident( const char* start, size_t len ); // 映射的文件中这一段（不超过PREFETCH_WINDOW）是否都已经在内存中
+    void count_faults( long minflt, long majflt );  // 开启分阶段计时时，把当前线程从(minflt, majflt)以来的缺页计入请求
+    bool make_response( file_cache_entry* entry );  // 生成小文件的完整应答
+    void trace_request();                           // 应答发完时把各阶段耗时交给metrics
+    ssize_t send_iov();                             // 发送m_iv中的数据，返回值和errno同writev
+    bool peek_path( char* path );                   // 不改动读缓冲区，从请求行中取出规范化后的路径
 
+    // 交给I/O线程的文件操作
+    enum IO_OP { IO_NONE = 0, IO_OPEN, IO_PREFETCH };
+    static const size_t PREFETCH_WINDOW = 1024 * 1024;      // 发送mmap的文件时每次检查、读入的最大长度
 
-    int m_sockfd;                           // 该HTTP连接的socket和对方的socket地址
-    sockaddr_in m_address;                  // 通信的是socket地址
-    
-    char m_read_buf[ READ_BUFFER_SIZE ];    // 读缓冲区
+    // 开启分阶段计时时在请求生命周期中记录的时间点（tsc::now()）
+    enum STAMP { STAMP_READ_START = 0, STAMP_READ_END, STAMP_PROCESS, STAMP_OPEN, STAMP_OPENED, STAMP_BUILT, STAMP_WRITE, STAMPS };
+
+
+    static char** m_node_buffers;           // 每个NUMA节点上所有连接的读写缓冲区和路径
+    static int m_buffer_nodes;              // m_node_buffers的个数
+    static size_t m_buffer_slot;            // 每个连接的读写缓冲区和路径的总大小
+    static int m_buffer_fds;                // 每个节点预留了多少个连接的缓冲区
+
+    /*
+        成员按访问的时机分组，每组从一个新的缓存行开始，连接数组按缓存行对齐（见operator new[]）。
+        读写缓冲区和请求的文件路径不在对象中，取自所在NUMA节点上为这个连接预留的内存（见init_buffers）
+    */
+
+    // 调度：主线程每个事件都要访问
+    alignas( 64 ) std::atomic< int > m_state;   // CONN_STATE，连接当前的持有者
+    int m_sockfd;                           // 该HTTP连接的socket
+    int m_io_event;                         // IO_REACTOR模型下工作线程要处理的事件，EPOLLIN或EPOLLOUT
+    int m_io_op;                            // IO_OP，提交给I/O线程、还没有处理完的操作
+    int m_node;                             // 处理该连接的NUMA节点
+    int m_lane;                             // 当前（IO_REACTOR模型下是上一个）请求所在的线程池通道
+    int m_limit_slot;                       // 客户端IP在ip_limiter中的表项，-1表示不受限制
+    bool m_handshaking;                     // 正在进行TLS握手
+    bool m_ktls;                            // 发送方向由内核加密，应答直接写socket
+    bool m_bulk_client;                     // 客户端在bulk_clients中
+    SSL* m_ssl;                             // TLS连接的SSL对象，明文连接为NULL
+    char* m_read_buf;                       // 读缓冲区，大小为m_read_buf_size
     int m_read_idx;                         // 标识读缓冲区中已经读入的客户端数据的最后一个字节的下一个位置
 
-    int m_checked_idx;                      // 当前正在分析的字符在读缓冲区中的位置
+    // 解析请求：工作线程（IO_PROACTOR模型下主线程也会读取请求行）
+    alignas( 64 ) int m_checked_idx;        // 当前正在分析的字符在读缓冲区中的位置
     int m_start_line;                       // 当前正在解析的行的起始位置
-
     CHECK_STATE m_check_state;              // 主状态机当前所处的状态
     METHOD m_method;                        // 请求方法
-
-    char m_real_file[ FILENAME_LEN ];       // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root是网站根目录
     char* m_url;                            // 客户请求的目标文件的文件名
     char* m_version;                        // HTTP协议版本号，我们仅支持HTTP1.1
     char* m_host;                           // 主机名
     int m_content_length;                   // HTTP请求的消息总长度
     bool m_linger;                          // HTTP请求是否要求保持连接
+    char* m_real_file;                      // 目标文件相对于网站根目录的路径，由m_url解码、规范化得到，大小为FILENAME_LEN
+    off_t m_file_size;                      // 目标文件的大小
 
-    char m_write_buf[ WRITE_BUFFER_SIZE ];  // 写缓冲区
-    int m_write_idx;                        // 写缓冲区中待发送的字节数
+    // 发送应答：工作线程，发送缓冲区满之后是主线程
+    alignas( 64 ) char* m_write_buf;        // 写缓冲区，大小为m_write_buf_size
+    struct iovec m_iv[2];                   // 我们将采用writev来执行写操作，其中m_iv_count表示被写内存块的数量
     char* m_file_address;                   // 客户请求的目标文件被mmap到内存中的起始位置
-    struct stat m_file_stat;                // 目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
-    struct iovec m_iv[2];                   // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
+    int m_write_idx;                        // 写缓冲区中待发送的字节数
     int m_iv_count;
-
     int bytes_to_send;                      // 将要发送的数据的字节数
     int bytes_have_send;                    // 已经发送的字节数
+
+    // 每个请求访问一两次
+    alignas( 64 ) std::shared_ptr< const file_cache_entry > m_cache_entry;   // 目标文件的缓存项（已打开的文件，小文件还有完整应答）
+    int m_status;                           // 应答的状态码，应答发完时计入统计
+    int m_eagain;                           // 写应答时遇到EAGAIN的次数
+    HTTP_CODE m_io_result;                  // I/O线程打开文件的结果
+    io_task m_io_task;                      // 提交给I/O线程的任务
+    uint64_t m_stamp[ STAMPS ];             // 各时间点，STAMP_READ_START总是记录，其余只在开启分阶段计时时记录
+    long m_minflt;                          // 开启分阶段计时时，发送应答、读入文件页面时的缺页次数
+    long m_majflt;
 };
 
 #endif
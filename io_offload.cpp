@@ -0,0 +1,67 @@
+#include "io_offload.h"
+#include "http_conn.h"
+
+void io_task::process() {
+    m_conn->run_io();
+    io_offload::get_instance()->complete( m_conn );
+}
+
+io_offload::io_offload() : m_pool( NULL ), m_notifier( NULL ), m_inlined( 0 ) {
+    for ( int i = 0; i < OPS; ++i ) {
+        m_submitted[i] = 0;
+    }
+}
+
+io_offload::~io_offload() {
+    delete m_pool;
+    delete m_notifier;
+}
+
+bool io_offload::init( int threads, int max_pending ) {
+    if ( threads <= 0 ) {
+        return true;
+    }
+    try {
+        m_notifier = new fd_notifier;
+        m_pool = new threadpool< io_task >( threads, max_pending );
+    } catch( ... ) {
+        delete m_notifier;
+        m_notifier = NULL;
+        return false;
+    }
+    m_done.reserve( max_pending );
+    return true;
+}
+
+void io_offload::stop() {
+    if ( m_pool ) {
+        m_pool->stop();
+    }
+}
+
+bool io_offload::submit( io_task* task, int op ) {
+    if ( !m_pool->append( task ) ) {
+        m_inlined.fetch_add( 1, std::memory_order_relaxed );
+        return false;
+    }
+    m_submitted[ op ].fetch_add( 1, std::memory_order_relaxed );
+    return true;
+}
+
+void io_offload::complete( http_conn* conn ) {
+    m_done_lock.lock();
+    m_done.push_back( conn );
+    m_done_lock.unlock();
+    m_notifier->notify();
+}
+
+void io_offload::take_completed( std::vector< http_conn* >& conns ) {
+    // 先清空eventfd再取队列，之后完成的连接会再唤醒一次。
+    // 复制出来而不是交换：m_done保留init时预留的容量，complete在锁内不会重新分配
+    m_notifier->consume();
+    conns.clear();
+    m_done_lock.lock();
+    conns.insert( conns.end(), m_done.begin(), m_done.end() );
+    m_done.clear();
+    m_done_lock.unlock();
+}
@@ -0,0 +1,64 @@
+#ifndef IO_OFFLOAD_H
+#define IO_OFFLOAD_H
+
+#include <vector>
+#include <atomic>
+#include "locker.h"
+#include "notifier.h"
+#include "threadpool.h"
+
+class http_conn;
+
+// 在I/O线程中执行一个连接提交的文件操作，每个连接一个，作为threadpool的任务
+struct io_task {
+    http_conn* m_conn;
+    void process();
+    void shed() { process(); }          // I/O队列不按排队时间丢弃，不会被调用
+};
+
+/*
+    阻塞文件操作的I/O线程
+    文件缓存未命中时的打开文件、fstat和读入小文件，以及发送mmap的文件时读入还不在内存中的页面，都可能要等磁盘。
+    这些操作交给一组单独的I/O线程，工作线程和主线程都不在磁盘上阻塞：
+    - 持有连接的线程调用submit之后连接进入CONN_IO状态，I/O线程调用它的run_io完成操作
+    - 完成的连接放进完成队列并通过fd_notifier唤醒主线程，主线程取出后按原来的状态机继续（交给工作线程或者继续发送）
+    - 等待的操作最多max_pending个，满了submit返回false，调用者自己同步完成
+    没有调用init（io_threads为0）时不启用，所有操作和以前一样在调用者的线程中完成
+*/
+class io_offload {
+public:
+    enum OP { OP_OPEN = 0, OP_PREFETCH, OPS };
+
+    static io_offload* get_instance() {
+        static io_offload instance;
+        return &instance;
+    }
+
+    bool init( int threads, int max_pending );
+    void stop();                                    // 等I/O线程退出，没有完成的连接不再回到主线程
+    bool enabled() const { return m_pool != NULL; }
+
+    bool submit( io_task* task, int op );           // 提交之后不能再访问连接，队列满时返回false
+    void complete( http_conn* conn );               // I/O线程完成操作之后调用
+    int notify_fd() const { return m_notifier ? m_notifier->fd() : -1; }
+    void take_completed( std::vector< http_conn* >& conns );    // 主线程在notify_fd可读时取出完成的连接，conns应预留max_pending的容量
+
+    size_t queue_size() { return m_pool ? m_pool->queue_size( 0 ) : 0; }
+    unsigned long submitted( int op ) const { return m_submitted[ op ].load( std::memory_order_relaxed ); }
+    unsigned long inlined() const { return m_inlined.load( std::memory_order_relaxed ); }
+
+private:
+    io_offload();
+    ~io_offload();
+    io_offload( const io_offload& );
+    io_offload& operator=( const io_offload& );
+
+    threadpool< io_task >* m_pool;
+    fd_notifier* m_notifier;
+    locker m_done_lock;
+    std::vector< http_conn* > m_done;               // 完成了、还没有被主线程取走的连接
+    std::atomic< unsigned long > m_submitted[ OPS ];    // 交给I/O线程的操作
+    std::atomic< unsigned long > m_inlined;         // 队列满时由调用者自己完成的操作
+};
+
+#endif
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "listener.h"
+
+// 解析一个地址，text中不含逗号
+static bool parse_one( const std::string& text, listen_addr& addr ) {
+    memset( &addr.m_addr, 0, sizeof( addr.m_addr ) );
+    addr.m_dual_stack = false;
+    addr.m_tls = false;
+    addr.m_text = text;
+
+    std::string spec = text;
+    size_t space = spec.find_first_of( " \t" );
+    if ( space != std::string::npos ) {
+        size_t option = spec.find_first_not_of( " \t", space );
+        if ( spec.compare( option, std::string::npos, "ssl" ) != 0 ) {
+            return false;
+        }
+        addr.m_tls = true;
+        spec.erase( space );
+    }
+
+    std::string host;
+    std::string port = spec;
+    if ( !spec.empty() && spec[0] == '[' ) {
+        size_t end = spec.find( "]:" );
+        if ( end == std::string::npos ) {
+            return false;
+        }
+        host = spec.substr( 1, end - 1 );
+        port = spec.substr( end + 2 );
+    } else {
+        size_t colon = spec.rfind( ':' );
+        if ( colon != std::string::npos ) {
+            host = spec.substr( 0, colon );
+            port = spec.substr( colon + 1 );
+        }
+    }
+    char* end = NULL;
+    long n = strtol( port.c_str(), &end, 10 );
+    if ( port.empty() || *end != '\0' || n <= 0 || n > 65535 ) {
+        return false;
+    }
+
+    struct sockaddr_in6* v6 = ( struct sockaddr_in6* )&addr.m_addr;
+    struct sockaddr_in* v4 = ( struct sockaddr_in* )&addr.m_addr;
+    if ( host.empty() || host == "*" ) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_addr = in6addr_any;
+        v6->sin6_port = htons( n );
+        addr.m_len = sizeof( *v6 );
+        addr.m_dual_stack = true;
+    } else if ( inet_pton( AF_INET6, host.c_str(), &v6->sin6_addr ) == 1 ) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons( n );
+        addr.m_len = sizeof( *v6 );
+    } else if ( inet_pton( AF_INET, host.c_str(), &v4->sin_addr ) == 1 ) {
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons( n );
+        addr.m_len = sizeof( *v4 );
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool parse_listen_list( const char* text, std::vector< listen_addr >& addrs ) {
+    std::string list = text;
+    size_t start = 0;
+    while ( start <= list.size() ) {
+        size_t comma = list.find( ',', start );
+        if ( comma == std::string::npos ) {
+            comma = list.size();
+        }
+        // 去掉两端的空白
+        size_t b = list.find_first_not_of( " \t", start );
+        size_t e = list.find_last_not_of( " \t", comma - 1 );
+        if ( b != std::string::npos && b < comma && e != std::string::npos && e >= b ) {
+            listen_addr addr;
+            if ( !parse_one( list.substr( b, e - b + 1 ), addr ) ) {
+                printf( "invalid listen address: %s\n", list.substr( b, e - b + 1 ).c_str() );
+                return false;
+            }
+            addrs.push_back( addr );
+        }
+        start = comma + 1;
+    }
+    if ( addrs.empty() ) {
+        printf( "no listen address\n" );
+        return false;
+    }
+    return true;
+}
+
+int open_listener( listen_addr& addr, int backlog, bool reuse_port ) {
+    int flags = SOCK_STREAM | SOCK_CLOEXEC | ( reuse_port ? SOCK_NONBLOCK : 0 );
+    int fd = socket( addr.m_addr.ss_family, flags, 0 );
+    if ( fd == -1 && addr.m_dual_stack && ( errno == EAFNOSUPPORT || errno == EPROTONOSUPPORT ) ) {
+        // 内核不支持IPv6，双栈地址只监听IPv4
+        struct sockaddr_in* v4 = ( struct sockaddr_in* )&addr.m_addr;
+        in_port_t port = ( ( struct sockaddr_in6* )&addr.m_addr )->sin6_port;
+        memset( &addr.m_addr, 0, sizeof( addr.m_addr ) );
+        v4->sin_family = AF_INET;
+        v4->sin_addr.s_addr = INADDR_ANY;
+        v4->sin_port = port;
+        addr.m_len = sizeof( *v4 );
+        addr.m_dual_stack = false;
+        fd = socket( AF_INET, flags, 0 );
+    }
+    if ( fd == -1 ) {
+        return -1;
+    }
+
+    // 端口复用
+    int reuse = 1;
+    setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
+    if ( reuse_port ) {
+        setsockopt( fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof( reuse ) );
+    }
+    if ( addr.m_addr.ss_family == AF_INET6 ) {
+        // 显式设置，不依赖 /proc/sys/net/ipv6/bindv6only 的默认值
+        int v6only = addr.m_dual_stack ? 0 : 1;
+        setsockopt( fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof( v6only ) );
+    }
+    if ( bind( fd, ( struct sockaddr* )&addr.m_addr, addr.m_len ) == -1 || listen( fd, backlog ) == -1 ) {
+        int save_errno = errno;
+        close( fd );
+        errno = save_errno;
+        return -1;
+    }
+    return fd;
+}
+
+bool listening_on( int fd, const listen_addr& addr ) {
+    struct sockaddr_storage local;
+    socklen_t len = sizeof( local );
+    if ( getsockname( fd, ( struct sockaddr* )&local, &len ) == -1 || local.ss_family != addr.m_addr.ss_family ) {
+        return false;
+    }
+    if ( local.ss_family == AF_INET ) {
+        const struct sockaddr_in* a = ( const struct sockaddr_in* )&local;
+        const struct sockaddr_in* b = ( const struct sockaddr_in* )&addr.m_addr;
+        return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+    }
+    const struct sockaddr_in6* a = ( const struct sockaddr_in6* )&local;
+    const struct sockaddr_in6* b = ( const struct sockaddr_in6* )&addr.m_addr;
+    return a->sin6_port == b->sin6_port && memcmp( &a->sin6_addr, &b->sin6_addr, sizeof( a->sin6_addr ) ) == 0;
+}
+
+const char* format_address( const struct sockaddr* addr, char* buf, size_t size ) {
+    char ip[ INET6_ADDRSTRLEN ] = "?";
+    int port = 0;
+    if ( addr->sa_family == AF_INET ) {
+        const struct sockaddr_in* v4 = ( const struct sockaddr_in* )addr;
+        inet_ntop( AF_INET, &v4->sin_addr, ip, sizeof( ip ) );
+        port = ntohs( v4->sin_port );
+        snprintf( buf, size, "%s:%d", ip, port );
+        return buf;
+    }
+    const struct sockaddr_in6* v6 = ( const struct sockaddr_in6* )addr;
+    port = ntohs( v6->sin6_port );
+    if ( IN6_IS_ADDR_V4MAPPED( &v6->sin6_addr ) ) {
+        // 双栈socket上的IPv4客户
+        inet_ntop( AF_INET, v6->sin6_addr.s6_addr + 12, ip, sizeof( ip ) );
+        snprintf( buf, size, "%s:%d", ip, port );
+    } else {
+        inet_ntop( AF_INET6, &v6->sin6_addr, ip, sizeof( ip ) );
+        snprintf( buf, size, "[%s]:%d", ip, port );
+    }
+    return buf;
+}
@@ -0,0 +1,40 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/*
+    监听地址
+    配置中的listen是逗号分隔的地址列表，每个地址一个监听socket：
+        8080            所有地址的8080端口，IPv4和IPv6双栈（系统不支持IPv6时只监听IPv4）
+        *:8080          同上
+        0.0.0.0:8080    只监听IPv4
+        [::]:8080       只监听IPv6
+        127.0.0.1:8080、[::1]:8080    指定的地址
+    地址后面加 " ssl"（如 "443 ssl"）表示这个地址上的连接使用TLS
+*/
+struct listen_addr {
+    struct sockaddr_storage m_addr;
+    socklen_t m_len;
+    bool m_dual_stack;          // IPv6 socket同时接受IPv4连接（关闭IPV6_V6ONLY）
+    bool m_tls;                 // 连接使用TLS
+    std::string m_text;         // 配置中的写法，用于日志
+};
+
+// 解析地址列表，出错时打印原因并返回false
+bool parse_listen_list( const char* text, std::vector< listen_addr >& addrs );
+
+// 创建、绑定并监听，失败返回-1。双栈地址在系统不支持IPv6时退回到IPv4
+// reuse_port为true时设置SO_REUSEPORT并且socket是非阻塞的，用于新旧进程同时监听的统计端口
+int open_listener( listen_addr& addr, int backlog, bool reuse_port = false );
+
+// fd是不是监听在addr上的socket，用于接管旧进程的监听socket时对应到配置中的地址
+bool listening_on( int fd, const listen_addr& addr );
+
+// 把地址写成 "1.2.3.4:80" 或 "[::1]:80" 的形式，IPv4映射的IPv6地址按IPv4显示
+const char* format_address( const struct sockaddr* addr, char* buf, size_t size );
+
+#endif
@@ -70,8 +70,9 @@ void Log::write_log(int level, const char *format, ...) {
     struct timeval now = {0, 0};
     gettimeofday(&now, NULL);
     time_t t = now.tv_sec;
-    struct tm *sys_tm = localtime(&t);
-    struct tm my_tm = *sys_tm;
+    // localtime每次都重新检查时区，TZ没有设置时会分配内存，localtime_r不会
+    struct tm my_tm;
+    localtime_r(&t, &my_tm);
     char s[16] = {0};
     switch (level) {
     case 0:
@@ -122,7 +123,7 @@ void Log::write_log(int level, const char *format, ...) {
     va_list valst;
     va_start(valst, format);
 
-    string log_str;
+    // 直接从m_buf写入文件或者复制进异步队列中已有的string，不再为每条日志构造一个string
     m_mutex.lock();
 
     //写入的具体时间内容格式
@@ -133,21 +134,14 @@ void Log::write_log(int level, const char *format, ...) {
     int m = vsnprintf(m_buf + n, m_log_buf_size - 1, format, valst);
     m_buf[n + m] = '\n';
     m_buf[n + m + 1] = '\0';
-    log_str = m_buf;
-
-    m_mutex.unlock();
 
-    if (m_is_async && !m_log_queue->full())
+    if (!m_is_async || !m_log_queue->push(m_buf))
     {
-        m_log_queue->push(log_str);
-    }
-    else
-    {
-        m_mutex.lock();
-        fputs(log_str.c_str(), m_fp);
-        m_mutex.unlock();
+        fputs(m_buf, m_fp);
     }
 
+    m_mutex.unlock();
+
     va_end(valst);
 }
 
@@ -19,7 +19,7 @@ public:
     }
 
     static void *flush_log_thread(void *args) {
-        Log::get_instance()->async_write_log();
+        return Log::get_instance()->async_write_log();
     }
 
     //可选择的参数有日志文件、日志缓冲区大小、最大行数以及最长日志条队列
@@ -30,6 +30,11 @@ public:
 
     void flush(void);
 
+    //异步日志队列中等待写入的条数，同步时为0
+    int queue_size() {
+        return m_is_async ? m_log_queue->size() : 0;
+    }
+
     static int m_close_log; //关闭日志
 
 
@@ -46,6 +51,7 @@ private:
             fputs(single_log.c_str(), m_fp);
             m_mutex.unlock();
         }
+        return NULL;
     }
 
     char dir_name[128];               //路径名
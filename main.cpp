@@ -12,14 +12,27 @@
 #include "threadpool.h"
 #include "http_conn.h"
 #include "log.h"
-
-#define MAX_FD 65536            // 最大的文件描述符个数
-#define MAX_EVENT_NUMBER 10000  // 监听的最大的事件数量
+#include "file_cache.h"
+#include "config.h"
+#include "affinity.h"
+#include "handoff.h"
+#include "metrics.h"
+#include "tsc.h"
+#include "overload.h"
+#include "listener.h"
+#include "tls.h"
+#include "notifier.h"
+#include "classifier.h"
+#include "io_offload.h"
 
 // 添加文件描述符到epoll中
 extern void addfd( int epollfd, int fd, bool one_shot );
 // 从epoll中删除文件描述符
 extern void removefd( int epollfd, int fd );
+// 设置文件描述符非阻塞
+extern int setnonblocking( int fd );
+
+static fd_notifier* sig_notifier = NULL;   // 信号处理函数通过它把信号交给主循环处理
 
 //添加信号捕捉
 void addsig(int sig, void( handler )(int)){
@@ -30,75 +43,363 @@ void addsig(int sig, void( handler )(int)){
     assert( sigaction( sig, &sa, NULL ) != -1 );
 }
 
+//信号处理函数只记下信号并唤醒主循环，由主循环统一处理
+void sig_handler( int sig ) {
+    int save_errno = errno;
+    sig_notifier->notify( 1ULL << sig );
+    errno = save_errno;
+}
 
-int main( int argc, char* argv[] ) {
-    //初始化日志
-    // Log::get_instance()->init("./ServerLog", 0, 2000, 800000, 800);
-    Log::get_instance()->init("./ServerLog", 0, 2000, 800000, 0);
 
-    //至少要传递一个端口号
-    if( argc <= 1 ) {
-        printf( "按照如下格式运行: %s port_number\n", basename(argv[0]));
-        LOG_ERROR("%s", "epoll failure");
+int main( int argc, char* argv[] ) {
+    //解析配置文件和命令行参数，至少要给出一个端口号
+    config conf;
+    if( !conf.parse_arg( argc, argv ) ) {
         return 1;
     }
 
-    //获取端口号
-    int port = atoi( argv[1] );
+    //初始化日志
+    Log::get_instance()->init( conf.log_file.c_str(), conf.close_log, conf.log_buf_size,
+                               conf.log_split_lines, conf.log_queue_size );
+
     //对SIGPIE信号进行处理
     addsig( SIGPIPE, SIG_IGN );
 
+    // 分阶段计时用TSC，在创建线程之前测出它的频率
+    tsc::calibrate();
+    metrics::get_instance()->set_tracing( conf.trace_stages != 0, conf.slow_request_us );
+
+    //绑定CPU：主线程先绑定，之后分配的内存按首次访问都落在它所在的节点上
+    std::vector< int > worker_cpus;
+    if( !parse_cpu_list( conf.worker_cpus.c_str(), worker_cpus ) ) {
+        printf( "invalid worker_cpus: %s\n", conf.worker_cpus.c_str() );
+        return 1;
+    }
+    int reactor_node = 0;
+    if( conf.reactor_cpu >= 0 ) {
+        if( !pin_current_thread( conf.reactor_cpu ) ) {
+            printf( "cannot pin main thread to cpu %d\n", conf.reactor_cpu );
+            return 1;
+        }
+        reactor_node = cpu_to_node( conf.reactor_cpu );
+    }
+
     //创建并初始化线程池，
+    int thread_min = conf.thread_min > 0 ? conf.thread_min : conf.thread_number;
+    int thread_max = conf.thread_max > 0 ? conf.thread_max : conf.thread_number;
+    if( thread_min > conf.thread_number || thread_max < conf.thread_number ) {
+        printf( "thread_min <= thread_number <= thread_max required\n" );
+        return 1;
+    }
     threadpool< http_conn >* pool = NULL;
     try {
-        pool = new threadpool<http_conn>;
+        pool = new threadpool<http_conn>( conf.thread_number, conf.max_requests, worker_cpus, thread_max );
     } catch( ... ) {
         LOG_ERROR("%s", "create threadpoll failure");
         return 1;
     }
+    if( thread_min < thread_max && !pool->set_adaptive( thread_min, conf.thread_grow_delay * 1000LL ) ) {
+        LOG_ERROR("%s", "start thread pool manager failure");
+        return 1;
+    }
+    //优先级通道和请求分类
+    request_classifier* classifier = request_classifier::get_instance();
+    if( !classifier->init( conf.lane_weights.c_str(), conf.bulk_prefixes.c_str(), conf.bulk_size, conf.bulk_clients.c_str() ) ) {
+        return 1;
+    }
+    if( !pool->set_lanes( classifier->weights() ) ) {
+        printf( "invalid lane_weights: %s (1 to %d weights)\n", conf.lane_weights.c_str(), threadpool< http_conn >::MAX_LANES );
+        return 1;
+    }
+    //过载保护
+    pool->set_queue_delay_limit( conf.queue_delay_target * 1000LL, conf.queue_delay_interval * 1000LL );
+    ip_limiter::get_instance()->set_limit( conf.max_conns_per_ip, conf.rate_per_ip, conf.rate_burst );
+    http_conn::m_retry_after = conf.retry_after;
+    //I/O模型
+    if( conf.io_model == "reactor" ) {
+        http_conn::m_io_model = http_conn::IO_REACTOR;
+    } else if( conf.io_model != "proactor" ) {
+        printf( "invalid io_model: %s (proactor or reactor)\n", conf.io_model.c_str() );
+        return 1;
+    }
+    bool reactor = http_conn::m_io_model == http_conn::IO_REACTOR;
+    //阻塞文件操作的I/O线程
+    io_offload* io = io_offload::get_instance();
+    if( !io->init( conf.io_threads, conf.io_queue_size ) ) {
+        LOG_ERROR("%s", "create I/O threads failure");
+        return 1;
+    }
 
-    //创建一个数组 用于保存所有打客户端信息
-    http_conn* users = new http_conn[ MAX_FD ];
+    //打开网站根目录并初始化文件缓存，inotify不可用时不启用缓存
+    if( !file_cache::get_instance()->init( conf.doc_root.c_str(), conf.cache_file_size,
+                                           conf.cache_total_size, conf.cache_max_files ) ) {
+        printf( "cannot open doc root %s\n", conf.doc_root.c_str() );
+        LOG_ERROR("cannot open doc root %s", conf.doc_root.c_str());
+        return 1;
+    }
+    if( conf.cache_max_files > 0 && file_cache::get_instance()->get_notify_fd() == -1 ) {
+        LOG_WARN("%s", "inotify unavailable, file cache disabled");
+    }
+    file_cache::get_instance()->set_hot_files( conf.hot_files.c_str() );
+    http_conn::m_populate_size = conf.populate_size;
 
-    //1. 创建监听的套接字
-    int listenfd = socket( PF_INET, SOCK_STREAM, 0 );
-    assert(listenfd >= 0);
+    //创建一个数组 用于保存所有打客户端信息
+    http_conn::m_read_buf_size = conf.read_buffer_size;
+    http_conn::m_write_buf_size = conf.write_buffer_size;
+    http_conn* users = new http_conn[ conf.max_fd ];
+    //工作线程分布在多个NUMA节点上时，每个节点一份连接缓冲区
+    bool multi_node = pool->queue_number() > 1;
+    if( !http_conn::init_buffers( conf.max_fd, multi_node ? numa_node_count() : 1 ) ) {
+        LOG_ERROR("%s", "alloc connection buffers failure");
+        return 1;
+    }
 
+    //监听地址：没有设置listen时监听所有地址的port端口
+    std::vector< listen_addr > addrs;
+    std::string listen_list = conf.listen.empty() ? std::to_string( conf.port ) : conf.listen;
+    if( !parse_listen_list( listen_list.c_str(), addrs ) ) {
+        return 1;
+    }
+    if( addrs.size() > ( size_t )HANDOFF_MAX_FDS ) {
+        printf( "too many listen addresses (at most %d)\n", HANDOFF_MAX_FDS );
+        return 1;
+    }
+    std::vector< int > listenfds( addrs.size(), -1 );
 
-    // 端口复用
-    int reuse = 1;
-    //int setsockopt(int sockfd, int level, int option_name, const void* option_value, socklen_t option_len);
-    setsockopt( listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
+    //有TLS监听地址时加载证书
+    bool need_tls = false;
+    for( size_t i = 0; i < addrs.size(); ++i ) {
+        need_tls = need_tls || addrs[i].m_tls;
+    }
+    if( need_tls && !tls_server::get_instance()->init( conf.tls_cert.c_str(), conf.tls_key.c_str(), conf.tls_ticket_key.c_str() ) ) {
+        printf( "cannot initialize TLS\n" );
+        return 1;
+    }
 
-    //2. 绑定
-    int ret = 0;
-    struct sockaddr_in address;
-    bzero(&address, sizeof(address));       //将内存块（字符串）的前n个字节清零
-    address.sin_family = AF_INET;           //协议族
-    address.sin_addr.s_addr = INADDR_ANY;   //IP地址  INADDR_ANY指本机的所有IP地址，0.0.0.0
-    address.sin_port = htons( port );       //转换成网络端口
-    ret = bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) );
-    assert(ret != -1);
+    //不停机重启：如果旧进程还在运行，直接接过它的监听socket，按地址对应到自己的监听地址上
+    int upgradefd = -1;
+    if( !conf.upgrade_socket.empty() ) {
+        upgradefd = handoff_connect( conf.upgrade_socket.c_str() );
+        if( upgradefd != -1 ) {
+            std::vector< int > inherited;
+            if( !recv_fds( upgradefd, inherited ) ) {
+                printf( "cannot receive listening sockets from %s\n", conf.upgrade_socket.c_str() );
+                return 1;
+            }
+            for( size_t i = 0; i < inherited.size(); ++i ) {
+                size_t j = 0;
+                while( j < addrs.size() && ( listenfds[j] != -1 || !listening_on( inherited[i], addrs[j] ) ) ) {
+                    ++j;
+                }
+                if( j < addrs.size() ) {
+                    listenfds[j] = inherited[i];
+                    LOG_INFO("took over listening socket %s from old process", addrs[j].m_text.c_str());
+                } else {
+                    //新配置中不再监听这个地址
+                    close( inherited[i] );
+                }
+            }
+        }
+    }
 
-    //3. 监听  int listen(int sockfd, int backlog);
-    //backlog: 内核监听队列打最大长度
-    ret = listen( listenfd, 5 );
-    assert(ret != -1);
+    for( size_t i = 0; i < addrs.size(); ++i ) {
+        if( listenfds[i] != -1 ) {
+            continue;
+        }
+        //创建监听的套接字，绑定并监听
+        listenfds[i] = open_listener( addrs[i], conf.listen_backlog );
+        if( listenfds[i] == -1 ) {
+            printf( "cannot listen on %s: %s\n", addrs[i].m_text.c_str(), strerror( errno ) );
+            return 1;
+        }
+    }
 
     // 创建epoll对象，和事件数组，添加监听的文件描述符
-    epoll_event events[ MAX_EVENT_NUMBER ];
+    epoll_event* events = new epoll_event[ conf.max_event_number ];
+    // 一轮epoll_wait中准备好交给工作线程的连接，这一轮的事件处理完之后一起添加到请求队列
+    std::vector< http_conn* > batch;
+    std::vector< int > batch_nodes;
+    std::vector< int > batch_lanes;
+    std::vector< http_conn* > batch_rejected( conf.max_event_number );
+    batch.reserve( conf.max_event_number );
+    batch_nodes.reserve( conf.max_event_number );
+    batch_lanes.reserve( conf.max_event_number );
     //int epoll_create(int size);
     //size参数现在并不起作用，只是给内核一个提示，告诉它事件表需要多大。
     //该函数返回的文件描述符将用作其他所有epoll系统调用的第一个参数，以指定要访问的内核事件表。
     int epollfd = epoll_create( 5 );
 
-    // 将监听的文件描述符添加到epoll对象中
-    addfd( epollfd, listenfd, false );   //对listenfd启用对sockfd启用EPOLLONESHOT
+    // 将监听的文件描述符添加到epoll对象中，每个监听地址单独接受连接
+    for( size_t i = 0; i < listenfds.size(); ++i ) {
+        addfd( epollfd, listenfds[i], false );
+    }
     http_conn::m_epollfd = epollfd;
 
-    while(true) {
+    // 小文件缓存的inotify事件也由主线程处理
+    int cachefd = file_cache::get_instance()->get_notify_fd();
+    if( cachefd != -1 ) {
+        addfd( epollfd, cachefd, false );
+    }
+
+    // I/O线程完成的连接由主线程取回
+    int iofd = io->notify_fd();
+    std::vector< http_conn* > io_done;
+    if( iofd != -1 ) {
+        io_done.reserve( conf.io_queue_size );
+        addfd( epollfd, iofd, false );
+    }
+
+    // SIGTERM、SIGINT：优雅退出
+    try {
+        sig_notifier = new fd_notifier;
+    } catch( ... ) {
+        LOG_ERROR("%s", "create eventfd failure");
+        return 1;
+    }
+    int sigfd = sig_notifier->fd();
+    addfd( epollfd, sigfd, false );
+    addsig( SIGTERM, sig_handler );
+    addsig( SIGINT, sig_handler );
+
+    // 等待之后的新进程来接管监听socket。从旧进程接管时，先建好自己的监听，再通知旧进程可以退出了
+    int handoff_listenfd = -1;      // 等待新进程连接的UNIX socket
+    int successorfd = -1;           // 正在交接的新进程
+    if( !conf.upgrade_socket.empty() ) {
+        handoff_listenfd = handoff_listen( conf.upgrade_socket.c_str() );
+        if( handoff_listenfd == -1 ) {
+            LOG_WARN("cannot listen on upgrade socket %s", conf.upgrade_socket.c_str());
+        } else {
+            addfd( epollfd, handoff_listenfd, false );
+        }
+    }
+    // 统计端点，由主线程处理
+    metrics* stats = metrics::get_instance();
+    if( conf.metrics_port > 0 ) {
+        if( !stats->start( epollfd, conf.metrics_port ) ) {
+            printf( "cannot listen on metrics port %d\n", conf.metrics_port );
+            return 1;
+        }
+        stats->add_gauge( "webserver_connections_active", "Open client connections.", "",
+                          [](){ return ( double )http_conn::m_user_count; } );
+        static const char* state_names[ http_conn::CONN_STATES ] = { "closed", "polling", "main", "queued", "worker", "arming", "io" };
+        // 每次读取之前扫描一遍所有连接，统计出各个状态的连接数，各状态的值直接读结果
+        static int state_counts[ http_conn::CONN_STATES ];
+        int max_fd = conf.max_fd;
+        stats->add_collector( [users, max_fd](){
+            memset( state_counts, 0, sizeof( state_counts ) );
+            for( int fd = 0; fd < max_fd; ++fd ) {
+                ++state_counts[ users[fd].state() ];
+            }
+        } );
+        for( int s = http_conn::CONN_POLLING; s < http_conn::CONN_STATES; ++s ) {
+            stats->add_gauge( "webserver_connections_state", "Open client connections by current owner.",
+                              std::string( "state=\"" ) + state_names[s] + "\"",
+                              [s](){ return ( double )state_counts[s]; } );
+        }
+        stats->add_gauge( "webserver_draining", "1 while the server is draining before exit.", "",
+                          [](){ return http_conn::m_draining ? 1.0 : 0.0; } );
+        for( int i = 0; i < pool->queue_number(); ++i ) {
+            stats->add_gauge( "webserver_workqueue_depth", "Requests waiting in the thread pool queue.",
+                              "node=\"" + std::to_string( pool->queue_node( i ) ) + "\"",
+                              [pool, i](){ return ( double )pool->queue_size( i ); } );
+        }
+        for( int i = 0; i < pool->queue_number() && pool->lane_number() > 1; ++i ) {
+            for( int lane = 0; lane < pool->lane_number(); ++lane ) {
+                std::string labels = "lane=\"" + std::string( lane == request_classifier::LANE_INTERACTIVE ? "interactive" :
+                                                              lane == request_classifier::LANE_BULK ? "bulk" : std::to_string( lane ) )
+                                     + "\",node=\"" + std::to_string( pool->queue_node( i ) ) + "\"";
+                stats->add_gauge( "webserver_workqueue_lane_depth", "Requests waiting in one priority lane of the queue.", labels,
+                                  [pool, i, lane](){ return ( double )pool->lane_size( i, lane ); } );
+                stats->add_counter( "webserver_workqueue_lane_dequeued_total", "Requests taken from one priority lane.", labels,
+                                    [pool, i, lane](){ return ( double )pool->lane_dequeued( i, lane ); } );
+            }
+        }
+        for( int i = 0; i < pool->queue_number(); ++i ) {
+            stats->add_counter( "webserver_workqueue_processed_total", "Requests processed by the worker threads.",
+                                "node=\"" + std::to_string( pool->queue_node( i ) ) + "\"",
+                                [pool, i](){ return ( double )pool->processed( i ); } );
+        }
+        for( int i = 0; i < pool->queue_number(); ++i ) {
+            stats->add_counter( "webserver_workqueue_dequeues_total", "Times a worker took a batch of requests from the queue.",
+                                "node=\"" + std::to_string( pool->queue_node( i ) ) + "\"",
+                                [pool, i](){ return ( double )pool->dequeues( i ); } );
+        }
+        for( int i = 0; i < pool->queue_number(); ++i ) {
+            stats->add_gauge( "webserver_workers", "Worker threads serving the queue.",
+                              "node=\"" + std::to_string( pool->queue_node( i ) ) + "\"",
+                              [pool, i](){ return ( double )pool->threads( i ); } );
+        }
+        for( int i = 0; pool->adaptive() && i < pool->queue_number(); ++i ) {
+            std::string node = "node=\"" + std::to_string( pool->queue_node( i ) ) + "\"";
+            stats->add_counter( "webserver_workers_started_total", "Worker threads added by the adaptive pool.",
+                                "reason=\"queue_delay\"," + node,
+                                [pool, i](){ return ( double )pool->grown( i, threadpool< http_conn >::GROW_DELAY ); } );
+            stats->add_counter( "webserver_workers_started_total", "Worker threads added by the adaptive pool.",
+                                "reason=\"blocked\"," + node,
+                                [pool, i](){ return ( double )pool->grown( i, threadpool< http_conn >::GROW_BLOCKED ); } );
+            stats->add_counter( "webserver_workers_stopped_total", "Idle worker threads retired by the adaptive pool.", node,
+                                [pool, i](){ return ( double )pool->shrunk( i ); } );
+            stats->add_gauge( "webserver_workqueue_delay_seconds", "Average queueing delay seen at the last pool check.", node,
+                              [pool, i](){ return pool->queue_delay( i ) / 1e6; } );
+            stats->add_gauge( "webserver_workers_blocked_ratio", "Share of worker busy time spent off-CPU at the last pool check.", node,
+                              [pool, i](){ return pool->blocked_permille( i ) / 1000.0; } );
+        }
+        for( int i = 0; i < pool->queue_number(); ++i ) {
+            std::string node = "node=\"" + std::to_string( pool->queue_node( i ) ) + "\"";
+            stats->add_counter( "webserver_shed_total", "Requests answered with 503 without being processed.",
+                                "reason=\"queue_full\"," + node, [pool, i](){ return ( double )pool->rejected( i ); } );
+            stats->add_counter( "webserver_shed_total", "Requests answered with 503 without being processed.",
+                                "reason=\"queue_delay\"," + node, [pool, i](){ return ( double )pool->shed( i ); } );
+        }
+        stats->add_counter( "webserver_connections_limited_total", "Connections rejected by max_conns_per_ip or rate_per_ip.", "",
+                            [](){ return ( double )ip_limiter::get_instance()->rejected(); } );
+        stats->add_counter( "webserver_requests_throttled_total", "Requests answered with 429 because of rate_per_ip.", "",
+                            [](){ return ( double )ip_limiter::get_instance()->throttled(); } );
+        if( tls_server::get_instance()->enabled() ) {
+            stats->add_counter( "webserver_tls_handshakes_total", "Completed TLS handshakes.", "",
+                                [](){ return ( double )tls_server::get_instance()->handshakes(); } );
+            stats->add_counter( "webserver_tls_resumed_total", "TLS handshakes that resumed a session.", "",
+                                [](){ return ( double )tls_server::get_instance()->resumed(); } );
+            stats->add_counter( "webserver_tls_ktls_total", "TLS connections whose send side was offloaded to kernel TLS.", "",
+                                [](){ return ( double )tls_server::get_instance()->ktls(); } );
+            stats->add_counter( "webserver_tls_failed_total", "Failed TLS handshakes.", "",
+                                [](){ return ( double )tls_server::get_instance()->failed(); } );
+        }
+        if( io->enabled() ) {
+            stats->add_gauge( "webserver_io_queue_depth", "Blocking file operations waiting for an I/O thread.", "",
+                              [io](){ return ( double )io->queue_size(); } );
+            stats->add_counter( "webserver_io_offloaded_total", "Blocking file operations handed to the I/O threads.", "op=\"open\"",
+                                [io](){ return ( double )io->submitted( io_offload::OP_OPEN ); } );
+            stats->add_counter( "webserver_io_offloaded_total", "Blocking file operations handed to the I/O threads.", "op=\"prefetch\"",
+                                [io](){ return ( double )io->submitted( io_offload::OP_PREFETCH ); } );
+            stats->add_counter( "webserver_io_inline_total", "Blocking file operations done by the caller because the I/O queue was full.", "",
+                                [io](){ return ( double )io->inlined(); } );
+        }
+        stats->add_gauge( "webserver_log_queue_depth", "Log lines waiting for the async log thread.", "",
+                          [](){ return ( double )Log::get_instance()->queue_size(); } );
+        stats->add_gauge( "webserver_cache_files", "Files held open by the file cache.", "",
+                          [](){ size_t files, bytes; file_cache::get_instance()->stats( files, bytes ); return ( double )files; } );
+        stats->add_gauge( "webserver_cache_bytes", "Bytes of complete responses held by the file cache.", "",
+                          [](){ size_t files, bytes; file_cache::get_instance()->stats( files, bytes ); return ( double )bytes; } );
+        stats->add_gauge( "webserver_cache_locked_bytes", "Bytes of hot_files mapped and locked in memory.", "",
+                          [](){ return ( double )file_cache::get_instance()->pinned_bytes(); } );
+    }
+
+    if( upgradefd != -1 ) {
+        ::send( upgradefd, &HANDOFF_READY, 1, MSG_NOSIGNAL );
+        close( upgradefd );
+    }
+
+    bool stop_server = false;       // 退出主循环
+    bool drain_requested = false;   // 收到了退出信号，或者新进程已经接管
+    bool handed_off = false;        // 监听socket已经交给了新进程
+    bool draining = false;          // 正在优雅退出：不再接受新连接，等待已有连接上的应答发送完毕
+    time_t drain_deadline = 0;
+
+    while( !stop_server ) {
         //int epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout);
-        int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, -1 );
+        //优雅退出期间定时醒来，检查连接是否都已关闭
+        int number = epoll_wait( epollfd, events, conf.max_event_number, draining ? 100 : -1 );
         
         if ( ( number < 0 ) && ( errno != EINTR ) ) {
             printf( "epoll failure\n" );
@@ -108,38 +409,139 @@ int main( int argc, char* argv[] ) {
         //循环遍历事件数组
         for ( int i = 0; i < number; i++ ) {
             int sockfd = events[i].data.fd;
+            int listener = -1;
+            for( size_t j = 0; j < listenfds.size() && listener == -1; ++j ) {
+                if( sockfd == listenfds[j] ) {
+                    listener = j;
+                }
+            }
             
-            if( sockfd == listenfd ) {
+            if( listener != -1 ) {
                 //有客户端连接进来
-                struct sockaddr_in client_address;
+                struct sockaddr_storage client_address;
                 socklen_t client_addrlength = sizeof( client_address );
                 //4.接受  int accept(int sockfd, struct sockaddr* addr, socklen_t* addrlen);
-                int connfd = accept( listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
+                int connfd = accept( sockfd, ( struct sockaddr* )&client_address, &client_addrlength );
                 if ( connfd < 0 ) {
                     printf( "errno is: %d\n", errno );
                     continue;
                 } 
+                //TLS连接还没有握手，拒绝时不能发送明文的应答，直接关闭
+                bool tls = addrs[ listener ].m_tls;
 
-                if( http_conn::m_user_count >= MAX_FD ) {
-                    //目前连接数满了
+                if( http_conn::m_user_count >= conf.max_fd || connfd >= conf.max_fd || !users[connfd].closed() ) {
+                    //目前连接数满了（close_conn先标记CONN_CLOSED再关闭socket，复用的fd上的旧连接一定已经关闭，
+                    //closed()的acquire保证看到旧持有者的所有写入之后才init）
                     //给客户端写一个信息：服务器内部正忙。
-                    printf("the server is busy! The number of client connections reached the upper limit.");
-                    close(connfd);
+                    tls ? ( void )close( connfd ) : http_conn::reject( connfd );
+                    stats->connection_rejected();
                     continue;
                 }
+                int limit_slot = -1;
+                if( !ip_limiter::get_instance()->acquire( client_address, limit_slot ) ) {
+                    //这个IP的连接太多或者请求太快
+                    tls ? ( void )close( connfd ) : http_conn::reject( connfd, 429 );
+                    stats->connection_rejected();
+                    continue;
+                }
+                stats->connection_accepted();
 
-                char ip[16] = {0};
-                inet_ntop(AF_INET, &client_address.sin_addr ,ip, sizeof(ip));
-                LOG_INFO("client(%s) is connected", ip);
+                if( !Log::m_close_log ) {
+                    char ip[ INET6_ADDRSTRLEN + 8 ];
+                    LOG_INFO("client(%s) is connected", format_address( ( struct sockaddr* )&client_address, ip, sizeof( ip ) ));
+                }
 
-                users[connfd].init( connfd, client_address);
+                //连接交给网卡收包所在CPU的NUMA节点处理，数据包、缓冲区和处理它的线程都在同一个节点上
+                int node = reactor_node;
+                int cpu = -1;
+                socklen_t cpu_len = sizeof( cpu );
+                if( multi_node && getsockopt( connfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &cpu_len ) == 0 && cpu >= 0 ) {
+                    node = cpu_to_node( cpu );
+                }
 
+                users[connfd].init( connfd, client_address, node, limit_slot );
+                if( tls && !users[connfd].start_tls() ) {
+                    users[connfd].close_conn();
+                }
+
+            } else if( sockfd == cachefd ) {
+                //缓存的文件有变动，使对应的缓存项失效
+                file_cache::get_instance()->handle_notify();
+            } else if( sockfd == iofd ) {
+                //I/O线程完成了文件操作：打开了文件的请求交给工作线程继续处理，读入了页面的应答继续发送
+                io->take_completed( io_done );
+                for( size_t j = 0; j < io_done.size(); ++j ) {
+                    http_conn* conn = io_done[j];
+                    bool writing = conn->from_io();
+                    if( writing && !reactor ) {
+                        if( !conn->write() ) {
+                            conn->close_conn();
+                        }
+                        continue;
+                    }
+                    conn->to_worker( writing ? EPOLLOUT : EPOLLIN );
+                    batch.push_back( conn );
+                    batch_nodes.push_back( conn->node() );
+                    batch_lanes.push_back( conn->lane() );
+                }
+            } else if( sockfd == sigfd ) {
+                //处理信号，退出期间再次收到信号则立即退出
+                uint64_t signals = sig_notifier->consume();
+                if( signals & ( ( 1ULL << SIGTERM ) | ( 1ULL << SIGINT ) ) ) {
+                    if( draining ) {
+                        stop_server = true;
+                    }
+                    drain_requested = true;
+                }
+            } else if( sockfd == handoff_listenfd ) {
+                //新进程来接管：把监听socket发给它，等它准备好之后再退出
+                int fd = accept( handoff_listenfd, NULL, NULL );
+                if( fd < 0 ) {
+                    continue;
+                }
+                if( successorfd != -1 || draining || !send_fds( fd, listenfds ) ) {
+                    close( fd );
+                    continue;
+                }
+                successorfd = fd;
+                addfd( epollfd, successorfd, false );
+                LOG_INFO("%d listening sockets sent to new process", ( int )listenfds.size());
+            } else if( sockfd == successorfd ) {
+                //新进程已经准备好，开始优雅退出；新进程没有回复就断开时，继续提供服务
+                char ack = 0;
+                if( recv( successorfd, &ack, 1, 0 ) == 1 && ack == HANDOFF_READY ) {
+                    handed_off = true;
+                    drain_requested = true;
+                }
+                removefd( epollfd, successorfd );
+                successorfd = -1;
+            } else if( stats->handle_event( sockfd, events[i].events ) ) {
+                //统计端点上的连接
+            } else if( !users[sockfd].claim() ) {
+                //连接在这一轮事件中已经被关闭，过时的事件
+            } else if( users[sockfd].handshaking() ) {  //TLS握手，读写事件都用来推进握手
+                //客户端发完最后的握手消息就关闭时也先完成握手，握手统计才准确
+                if( !users[sockfd].handshake() || ( events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) ) {
+                    users[sockfd].close_conn();
+                }
             } else if( events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) {
                 //对象异常断开或者错误的事件发生
                 users[sockfd].close_conn();
+            } else if( reactor ) {                      //读写都交给工作线程
+                users[sockfd].to_worker( ( events[i].events & EPOLLIN ) ? EPOLLIN : EPOLLOUT );
+                batch.push_back( users + sockfd );
+                batch_nodes.push_back( users[sockfd].node() );
+                batch_lanes.push_back( users[sockfd].lane() );
             } else if(events[i].events & EPOLLIN) {      //读事件发生
                 if(users[sockfd].read()) {               //一次性把所有数据都读完
-                    pool->append(users + sockfd);
+                    if( !ip_limiter::get_instance()->allow_request( users[sockfd].limit_slot() ) ) {
+                        users[sockfd].shed( http_conn::TOO_MANY_REQUESTS );     //超过限速，回复429
+                    } else {
+                        users[sockfd].to_worker( EPOLLIN );
+                        batch.push_back( users + sockfd );
+                        batch_nodes.push_back( users[sockfd].node() );
+                        batch_lanes.push_back( users[sockfd].lane() );
+                    }
                 } else {
                     users[sockfd].close_conn();         //读失败
                 }
@@ -149,11 +551,72 @@ int main( int argc, char* argv[] ) {
                 }
             }
         }
+        if( !batch.empty() ) {
+            //I/O线程完成的连接也在这一批中，可能超过一轮epoll_wait的事件数
+            if( batch_rejected.size() < batch.size() ) {
+                batch_rejected.resize( batch.size() );
+            }
+            int rejected = pool->append_batch( batch.data(), batch_nodes.data(), batch_lanes.data(), batch.size(),
+                                               batch_rejected.data() );
+            for( int j = 0; j < rejected; ++j ) {
+                batch_rejected[j]->shed();              //请求队列满了，直接回复503
+            }
+            batch.clear();
+            batch_nodes.clear();
+            batch_lanes.clear();
+        }
+
+        if( drain_requested && !draining ) {
+            //停止接受新连接；监听socket交给了新进程时，新连接会由新进程接受
+            draining = true;
+            http_conn::m_draining = true;
+            drain_deadline = time( NULL ) + conf.drain_timeout;
+            for( size_t j = 0; j < listenfds.size(); ++j ) {
+                removefd( epollfd, listenfds[j] );
+            }
+            listenfds.clear();
+            if( handoff_listenfd != -1 ) {
+                removefd( epollfd, handoff_listenfd );
+                handoff_listenfd = -1;
+                if( !handed_off ) {
+                    unlink( conf.upgrade_socket.c_str() );
+                }
+            }
+            LOG_INFO("draining %d connections", ( int )http_conn::m_user_count);
+        }
+        if( draining ) {
+            //关闭空闲的长连接，其余连接在应答发完之后关闭
+            for( int fd = 0; fd < conf.max_fd; ++fd ) {
+                users[fd].close_idle();
+            }
+            if( http_conn::m_user_count <= 0 || time( NULL ) >= drain_deadline ) {
+                stop_server = true;
+            }
+        }
     }
-    
+
+    //先等工作线程把手上的请求处理完，再释放连接对象
+    pool->stop();
+    io->stop();
+    LOG_INFO("server stopped, %d connections left", ( int )http_conn::m_user_count);
+    Log::get_instance()->flush();
+
+    stats->stop();
     close( epollfd );
-    close( listenfd );
-    delete [] users;  //new出来的
+    for( size_t i = 0; i < listenfds.size(); ++i ) {
+        close( listenfds[i] );
+    }
+    if( handoff_listenfd != -1 ) {
+        close( handoff_listenfd );
+        unlink( conf.upgrade_socket.c_str() );
+    }
+    //之后的信号按默认方式处理，再释放通知对象
+    addsig( SIGTERM, SIG_DFL );
+    addsig( SIGINT, SIG_DFL );
+    delete sig_notifier;
     delete pool;
+    delete [] events;
+    delete [] users;  //new出来的
+    http_conn::free_buffers();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,518 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include "metrics.h"
+#include "log.h"
+#include "listener.h"
+
+// 请求耗时直方图各个桶的上界（微秒）
+static const int64_t latency_bounds[ metrics::LATENCY_BUCKETS ] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+// 各阶段耗时直方图的上界（微秒），阶段耗时通常远小于整个请求，从1微秒开始
+static const int64_t stage_bounds[ metrics::STAGE_BUCKETS ] = {
+    1, 2, 5, 10, 25, 50, 100, 250, 500,
+    1000, 2500, 5000, 10000, 25000, 100000, 250000, 1000000, 10000000
+};
+
+static const char* status_codes[ metrics::STATUS_SLOTS ] = { "200", "400", "403", "404", "429", "500", "503", "other" };
+static const char* stage_names[ metrics::STAGES ] = { "read", "queue", "parse", "open", "build", "dispatch", "write" };
+
+// 统计端点最多同时服务的连接数，超出的直接关闭
+static const size_t MAX_CLIENTS = 16;
+// 统计端点请求的最大长度
+static const size_t MAX_REQUEST = 4096;
+
+int64_t metrics::now_usec() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( int64_t )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+metrics::metrics() : m_next_shard( 0 ), m_tracing( false ), m_slow_usec( 0 ), m_slow_count( 0 ), m_slow_logged( 0 ),
+                     m_epollfd( -1 ), m_listenfd( -1 ) {
+    for ( int i = 0; i < SHARDS; ++i ) {
+        counter_shard& s = m_shards[i];
+        for ( int j = 0; j < STATUS_SLOTS; ++j ) {
+            s.m_requests[j] = 0;
+        }
+        for ( int j = 0; j <= LATENCY_BUCKETS; ++j ) {
+            s.m_latency[j] = 0;
+        }
+        s.m_latency_sum = 0;
+        s.m_bytes = 0;
+        s.m_accepted = 0;
+        s.m_rejected = 0;
+        for ( int j = 0; j < STAGES; ++j ) {
+            for ( int k = 0; k <= STAGE_BUCKETS; ++k ) {
+                s.m_stage[j][k] = 0;
+            }
+            s.m_stage_sum[j] = 0;
+        }
+        s.m_minflt = 0;
+        s.m_majflt = 0;
+    }
+    m_start_time = time( NULL );
+    m_start_usec = now_usec();
+}
+
+metrics::~metrics() {
+    stop();
+}
+
+metrics::counter_shard& metrics::shard() {
+    // 每个线程第一次写统计时分到一个分片，之后一直使用它
+    static thread_local int index = -1;
+    if ( index == -1 ) {
+        index = m_next_shard.fetch_add( 1, std::memory_order_relaxed ) % SHARDS;
+    }
+    return m_shards[ index ];
+}
+
+void metrics::request_done( int status, int64_t usec, long bytes ) {
+    int slot = STATUS_OTHER;
+    switch ( status ) {
+        case 200: slot = STATUS_200; break;
+        case 400: slot = STATUS_400; break;
+        case 403: slot = STATUS_403; break;
+        case 404: slot = STATUS_404; break;
+        case 429: slot = STATUS_429; break;
+        case 500: slot = STATUS_500; break;
+        case 503: slot = STATUS_503; break;
+    }
+    if ( usec < 0 ) {
+        usec = 0;
+    }
+    int bucket = 0;
+    while ( bucket < LATENCY_BUCKETS && usec > latency_bounds[ bucket ] ) {
+        ++bucket;
+    }
+    counter_shard& s = shard();
+    s.m_requests[ slot ].fetch_add( 1, std::memory_order_relaxed );
+    s.m_latency[ bucket ].fetch_add( 1, std::memory_order_relaxed );
+    s.m_latency_sum.fetch_add( usec, std::memory_order_relaxed );
+    s.m_bytes.fetch_add( bytes, std::memory_order_relaxed );
+}
+
+void metrics::set_tracing( bool on, int64_t slow_usec ) {
+    m_slow_usec = slow_usec > 0 ? slow_usec : 0;
+    m_tracing = on || m_slow_usec > 0;
+}
+
+void metrics::trace_done( const request_trace& trace ) {
+    counter_shard& s = shard();
+    for ( int i = 0; i < STAGES; ++i ) {
+        int64_t usec = trace.m_stage[i] < 0 ? 0 : trace.m_stage[i];
+        int bucket = 0;
+        while ( bucket < STAGE_BUCKETS && usec > stage_bounds[ bucket ] ) {
+            ++bucket;
+        }
+        s.m_stage[i][ bucket ].fetch_add( 1, std::memory_order_relaxed );
+        s.m_stage_sum[i].fetch_add( usec, std::memory_order_relaxed );
+    }
+    s.m_minflt.fetch_add( trace.m_minflt, std::memory_order_relaxed );
+    s.m_majflt.fetch_add( trace.m_majflt, std::memory_order_relaxed );
+    if ( m_slow_usec == 0 || trace.m_total < m_slow_usec ) {
+        return;
+    }
+
+    time_t now = time( NULL );
+    m_slow_mutex.lock();
+    int index = m_slow_count % SLOW_SAMPLES;
+    m_slow[ index ] = trace;
+    m_slow_time[ index ] = now;
+    ++m_slow_count;
+    m_slow_mutex.unlock();
+
+    // 慢请求多的时候每秒只写一条日志，完整的样本在 /slow 中
+    int64_t last = m_slow_logged.load( std::memory_order_relaxed );
+    if ( now != last && m_slow_logged.compare_exchange_strong( last, now, std::memory_order_relaxed ) ) {
+        LOG_WARN( "slow request %s status=%d total=%lldus read=%lld queue=%lld parse=%lld open=%lld build=%lld dispatch=%lld write=%lld eagain=%d minflt=%ld majflt=%ld",
+                  trace.m_url, trace.m_status, ( long long )trace.m_total,
+                  ( long long )trace.m_stage[ STAGE_READ ], ( long long )trace.m_stage[ STAGE_QUEUE ],
+                  ( long long )trace.m_stage[ STAGE_PARSE ], ( long long )trace.m_stage[ STAGE_OPEN ],
+                  ( long long )trace.m_stage[ STAGE_BUILD ], ( long long )trace.m_stage[ STAGE_DISPATCH ],
+                  ( long long )trace.m_stage[ STAGE_WRITE ], trace.m_eagain, trace.m_minflt, trace.m_majflt );
+    }
+}
+
+void metrics::add_gauge( const char* name, const char* help, const std::string& labels, const std::function< double() >& value ) {
+    add_value( "gauge", name, help, labels, value );
+}
+
+void metrics::add_counter( const char* name, const char* help, const std::string& labels, const std::function< double() >& value ) {
+    add_value( "counter", name, help, labels, value );
+}
+
+void metrics::add_collector( const std::function< void() >& collect ) {
+    m_collectors.push_back( collect );
+}
+
+void metrics::run_collectors() {
+    for ( size_t i = 0; i < m_collectors.size(); ++i ) {
+        m_collectors[i]();
+    }
+}
+
+void metrics::add_value( const char* type, const char* name, const char* help, const std::string& labels,
+                         const std::function< double() >& value ) {
+    gauge g;
+    g.m_type = type;
+    g.m_name = name;
+    g.m_help = help;
+    g.m_labels = labels;
+    g.m_value = value;
+    m_gauges.push_back( g );
+}
+
+void metrics::collect( snapshot& snap ) {
+    memset( &snap, 0, sizeof( snap ) );
+    for ( int i = 0; i < SHARDS; ++i ) {
+        counter_shard& s = m_shards[i];
+        for ( int j = 0; j < STATUS_SLOTS; ++j ) {
+            snap.m_requests[j] += s.m_requests[j].load( std::memory_order_relaxed );
+        }
+        for ( int j = 0; j <= LATENCY_BUCKETS; ++j ) {
+            snap.m_latency[j] += s.m_latency[j].load( std::memory_order_relaxed );
+        }
+        snap.m_latency_sum += s.m_latency_sum.load( std::memory_order_relaxed );
+        snap.m_bytes += s.m_bytes.load( std::memory_order_relaxed );
+        snap.m_accepted += s.m_accepted.load( std::memory_order_relaxed );
+        snap.m_rejected += s.m_rejected.load( std::memory_order_relaxed );
+        for ( int j = 0; j < STAGES; ++j ) {
+            for ( int k = 0; k <= STAGE_BUCKETS; ++k ) {
+                snap.m_stage[j][k] += s.m_stage[j][k].load( std::memory_order_relaxed );
+            }
+            snap.m_stage_sum[j] += s.m_stage_sum[j].load( std::memory_order_relaxed );
+        }
+        snap.m_minflt += s.m_minflt.load( std::memory_order_relaxed );
+        snap.m_majflt += s.m_majflt.load( std::memory_order_relaxed );
+    }
+}
+
+static void append_format( std::string& out, const char* format, ... ) __attribute__(( format( printf, 2, 3 ) ));
+static void append_format( std::string& out, const char* format, ... ) {
+    char buf[ 512 ];
+    va_list args;
+    va_start( args, format );
+    int n = vsnprintf( buf, sizeof( buf ), format, args );
+    va_end( args );
+    if ( n > 0 ) {
+        out.append( buf, ( size_t )n < sizeof( buf ) ? n : sizeof( buf ) - 1 );
+    }
+}
+
+void metrics::render_prometheus( std::string& out ) {
+    snapshot snap;
+    collect( snap );
+
+    out += "# HELP webserver_requests_total Responses sent, by status code.\n";
+    out += "# TYPE webserver_requests_total counter\n";
+    for ( int i = 0; i < STATUS_SLOTS; ++i ) {
+        append_format( out, "webserver_requests_total{code=\"%s\"} %llu\n", status_codes[i], ( unsigned long long )snap.m_requests[i] );
+    }
+
+    // Prometheus的直方图桶是累计的
+    out += "# HELP webserver_request_duration_seconds Time from reading a request to finishing its response.\n";
+    out += "# TYPE webserver_request_duration_seconds histogram\n";
+    uint64_t cumulative = 0;
+    for ( int i = 0; i < LATENCY_BUCKETS; ++i ) {
+        cumulative += snap.m_latency[i];
+        append_format( out, "webserver_request_duration_seconds_bucket{le=\"%g\"} %llu\n",
+                       latency_bounds[i] / 1e6, ( unsigned long long )cumulative );
+    }
+    cumulative += snap.m_latency[ LATENCY_BUCKETS ];
+    append_format( out, "webserver_request_duration_seconds_bucket{le=\"+Inf\"} %llu\n", ( unsigned long long )cumulative );
+    append_format( out, "webserver_request_duration_seconds_sum %.6f\n", snap.m_latency_sum / 1e6 );
+    append_format( out, "webserver_request_duration_seconds_count %llu\n", ( unsigned long long )cumulative );
+
+    if ( m_tracing ) {
+        out += "# HELP webserver_request_stage_seconds Time spent in each stage of handling a request.\n";
+        out += "# TYPE webserver_request_stage_seconds histogram\n";
+        for ( int i = 0; i < STAGES; ++i ) {
+            cumulative = 0;
+            for ( int j = 0; j < STAGE_BUCKETS; ++j ) {
+                cumulative += snap.m_stage[i][j];
+                append_format( out, "webserver_request_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                               stage_names[i], stage_bounds[j] / 1e6, ( unsigned long long )cumulative );
+            }
+            cumulative += snap.m_stage[i][ STAGE_BUCKETS ];
+            append_format( out, "webserver_request_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+                           stage_names[i], ( unsigned long long )cumulative );
+            append_format( out, "webserver_request_stage_seconds_sum{stage=\"%s\"} %.6f\n", stage_names[i], snap.m_stage_sum[i] / 1e6 );
+            append_format( out, "webserver_request_stage_seconds_count{stage=\"%s\"} %llu\n", stage_names[i], ( unsigned long long )cumulative );
+        }
+        out += "# HELP webserver_request_page_faults_total Page faults taken while sending responses and reading in file pages.\n";
+        out += "# TYPE webserver_request_page_faults_total counter\n";
+        append_format( out, "webserver_request_page_faults_total{type=\"minor\"} %llu\n", ( unsigned long long )snap.m_minflt );
+        append_format( out, "webserver_request_page_faults_total{type=\"major\"} %llu\n", ( unsigned long long )snap.m_majflt );
+    }
+
+    out += "# HELP webserver_sent_bytes_total Response bytes sent.\n";
+    out += "# TYPE webserver_sent_bytes_total counter\n";
+    append_format( out, "webserver_sent_bytes_total %llu\n", ( unsigned long long )snap.m_bytes );
+    out += "# HELP webserver_connections_accepted_total Connections accepted.\n";
+    out += "# TYPE webserver_connections_accepted_total counter\n";
+    append_format( out, "webserver_connections_accepted_total %llu\n", ( unsigned long long )snap.m_accepted );
+    out += "# HELP webserver_connections_rejected_total Connections closed right after accept because the server was full.\n";
+    out += "# TYPE webserver_connections_rejected_total counter\n";
+    append_format( out, "webserver_connections_rejected_total %llu\n", ( unsigned long long )snap.m_rejected );
+
+    // 同名的值放在一起、只输出一次HELP/TYPE，注册时可能和其他名字交错（如按节点、通道循环注册的几组值）
+    run_collectors();
+    std::vector< bool > done( m_gauges.size(), false );
+    for ( size_t i = 0; i < m_gauges.size(); ++i ) {
+        if ( done[i] ) {
+            continue;
+        }
+        const std::string& name = m_gauges[i].m_name;
+        append_format( out, "# HELP %s %s\n# TYPE %s %s\n", name.c_str(), m_gauges[i].m_help.c_str(), name.c_str(), m_gauges[i].m_type );
+        for ( size_t j = i; j < m_gauges.size(); ++j ) {
+            const gauge& g = m_gauges[j];
+            if ( done[j] || g.m_name != name ) {
+                continue;
+            }
+            done[j] = true;
+            if ( g.m_labels.empty() ) {
+                append_format( out, "%s %.17g\n", g.m_name.c_str(), g.m_value() );
+            } else {
+                append_format( out, "%s{%s} %.17g\n", g.m_name.c_str(), g.m_labels.c_str(), g.m_value() );
+            }
+        }
+    }
+
+    out += "# HELP webserver_start_time_seconds Start time of the process since the Unix epoch.\n";
+    out += "# TYPE webserver_start_time_seconds gauge\n";
+    append_format( out, "webserver_start_time_seconds %lld\n", ( long long )m_start_time );
+}
+
+void metrics::render_status( std::string& out ) {
+    snapshot snap;
+    collect( snap );
+    uint64_t total = 0;
+    for ( int i = 0; i < STATUS_SLOTS; ++i ) {
+        total += snap.m_requests[i];
+    }
+    double uptime = ( now_usec() - m_start_usec ) / 1e6;
+    append_format( out, "uptime: %.0f s\n", uptime );
+    append_format( out, "requests: %llu (%.1f/s average)\n", ( unsigned long long )total, uptime > 0 ? total / uptime : 0.0 );
+    for ( int i = 0; i < STATUS_SLOTS; ++i ) {
+        if ( snap.m_requests[i] ) {
+            append_format( out, "  %s: %llu\n", status_codes[i], ( unsigned long long )snap.m_requests[i] );
+        }
+    }
+    append_format( out, "mean latency: %.1f us\n", total ? ( double )snap.m_latency_sum / total : 0.0 );
+    append_format( out, "connections accepted: %llu, rejected: %llu\n",
+                   ( unsigned long long )snap.m_accepted, ( unsigned long long )snap.m_rejected );
+    if ( m_tracing ) {
+        out += "mean stage time (us):";
+        for ( int i = 0; i < STAGES; ++i ) {
+            uint64_t count = 0;
+            for ( int j = 0; j <= STAGE_BUCKETS; ++j ) {
+                count += snap.m_stage[i][j];
+            }
+            append_format( out, " %s=%.1f", stage_names[i], count ? ( double )snap.m_stage_sum[i] / count : 0.0 );
+        }
+        out += "\n";
+    }
+    run_collectors();
+    for ( size_t i = 0; i < m_gauges.size(); ++i ) {
+        const gauge& g = m_gauges[i];
+        append_format( out, "%s%s%s%s: %.17g\n", g.m_name.c_str(), g.m_labels.empty() ? "" : "{",
+                       g.m_labels.c_str(), g.m_labels.empty() ? "" : "}", g.m_value() );
+    }
+}
+
+void metrics::render_slow( std::string& out ) {
+    if ( m_slow_usec == 0 ) {
+        out += "slow request sampling is off, set slow_request_us\n";
+        return;
+    }
+    append_format( out, "requests slower than %lld us, most recent first (all times in us)\n", ( long long )m_slow_usec );
+    out += "time                 status  total    read   queue   parse    open   build dispatch  write eagain  minflt majflt url\n";
+    m_slow_mutex.lock();
+    unsigned long count = m_slow_count;
+    unsigned long n = count < ( unsigned long )SLOW_SAMPLES ? count : SLOW_SAMPLES;
+    for ( unsigned long i = 1; i <= n; ++i ) {
+        int index = ( count - i ) % SLOW_SAMPLES;
+        const request_trace& t = m_slow[ index ];
+        time_t when = m_slow_time[ index ];
+        struct tm tm_when;
+        localtime_r( &when, &tm_when );
+        char stamp[ 32 ];
+        strftime( stamp, sizeof( stamp ), "%Y-%m-%d %H:%M:%S", &tm_when );
+        append_format( out, "%s  %3d %8lld %7lld %7lld %7lld %7lld %7lld %8lld %6lld %6d %7ld %6ld %s\n",
+                       stamp, t.m_status, ( long long )t.m_total,
+                       ( long long )t.m_stage[ STAGE_READ ], ( long long )t.m_stage[ STAGE_QUEUE ],
+                       ( long long )t.m_stage[ STAGE_PARSE ], ( long long )t.m_stage[ STAGE_OPEN ],
+                       ( long long )t.m_stage[ STAGE_BUILD ], ( long long )t.m_stage[ STAGE_DISPATCH ],
+                       ( long long )t.m_stage[ STAGE_WRITE ], t.m_eagain, t.m_minflt, t.m_majflt, t.m_url );
+    }
+    m_slow_mutex.unlock();
+    append_format( out, "%lu slow requests since start\n", count );
+}
+
+bool metrics::start( int epollfd, int port ) {
+    // 和服务端口一样监听所有地址（IPv4和IPv6双栈）
+    std::vector< listen_addr > addrs;
+    if ( !parse_listen_list( std::to_string( port ).c_str(), addrs ) ) {
+        return false;
+    }
+    // 不停机重启时新旧进程同时监听这个端口
+    int fd = open_listener( addrs[0], 16, true );
+    if ( fd == -1 ) {
+        return false;
+    }
+    epoll_event event;
+    event.data.fd = fd;
+    event.events = EPOLLIN;
+    epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &event );
+    m_epollfd = epollfd;
+    m_listenfd = fd;
+    return true;
+}
+
+void metrics::stop() {
+    while ( !m_clients.empty() ) {
+        close_client( m_clients.size() - 1 );
+    }
+    if ( m_listenfd != -1 ) {
+        epoll_ctl( m_epollfd, EPOLL_CTL_DEL, m_listenfd, NULL );
+        close( m_listenfd );
+        m_listenfd = -1;
+    }
+}
+
+void metrics::close_client( size_t i ) {
+    epoll_ctl( m_epollfd, EPOLL_CTL_DEL, m_clients[i].m_fd, NULL );
+    close( m_clients[i].m_fd );
+    m_clients[i] = m_clients.back();
+    m_clients.pop_back();
+}
+
+bool metrics::handle_event( int fd, uint32_t events ) {
+    if ( m_listenfd == -1 ) {
+        return false;
+    }
+    if ( fd == m_listenfd ) {
+        int connfd = accept4( m_listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+        if ( connfd < 0 ) {
+            return true;
+        }
+        if ( m_clients.size() >= MAX_CLIENTS ) {
+            close( connfd );
+            return true;
+        }
+        epoll_event event;
+        event.data.fd = connfd;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        epoll_ctl( m_epollfd, EPOLL_CTL_ADD, connfd, &event );
+        client c;
+        c.m_fd = connfd;
+        c.m_sent = 0;
+        m_clients.push_back( c );
+        return true;
+    }
+
+    size_t i = 0;
+    while ( i < m_clients.size() && m_clients[i].m_fd != fd ) {
+        ++i;
+    }
+    if ( i == m_clients.size() ) {
+        return false;
+    }
+    if ( events & ( EPOLLHUP | EPOLLERR ) ) {
+        close_client( i );
+        return true;
+    }
+
+    client& c = m_clients[i];
+    if ( !c.m_response.empty() ) {
+        // 应答没有一次发完，现在可写了
+        if ( flush( c ) ) {
+            close_client( i );
+        }
+        return true;
+    }
+    char buf[ 1024 ];
+    bool eof = false;
+    while ( true ) {
+        ssize_t n = recv( fd, buf, sizeof( buf ), 0 );
+        if ( n > 0 ) {
+            c.m_request.append( buf, n );
+            if ( c.m_request.size() > MAX_REQUEST ) {
+                close_client( i );
+                return true;
+            }
+            continue;
+        }
+        if ( n == 0 ) {
+            // 客户端发完请求之后可能关闭写端（如curl --http1.0、nc -q0），请求完整时照样应答
+            eof = true;
+            break;
+        }
+        if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+            break;
+        }
+        close_client( i );
+        return true;
+    }
+    if ( c.m_request.find( "\r\n\r\n" ) != std::string::npos ) {
+        respond( c );
+        if ( flush( c ) ) {
+            close_client( i );
+        }
+    } else if ( eof ) {
+        close_client( i );
+    }
+    return true;
+}
+
+void metrics::respond( client& c ) {
+    std::string body;
+    const char* status = "200 OK";
+    const char* type = "text/plain; version=0.0.4; charset=utf-8";
+    if ( c.m_request.compare( 0, 13, "GET /metrics " ) == 0 ) {
+        render_prometheus( body );
+    } else if ( c.m_request.compare( 0, 12, "GET /status " ) == 0 ) {
+        render_status( body );
+        type = "text/plain; charset=utf-8";
+    } else if ( c.m_request.compare( 0, 10, "GET /slow " ) == 0 ) {
+        render_slow( body );
+        type = "text/plain; charset=utf-8";
+    } else {
+        status = "404 Not Found";
+        type = "text/plain";
+        body = "try /metrics, /status or /slow\n";
+    }
+    append_format( c.m_response, "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                   status, type, body.size() );
+    c.m_response += body;
+}
+
+bool metrics::flush( client& c ) {
+    while ( c.m_sent < c.m_response.size() ) {
+        ssize_t n = send( c.m_fd, c.m_response.data() + c.m_sent, c.m_response.size() - c.m_sent, MSG_NOSIGNAL );
+        if ( n < 0 ) {
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                // 发送缓冲区满了，等可写时继续
+                epoll_event event;
+                event.data.fd = c.m_fd;
+                event.events = EPOLLOUT | EPOLLRDHUP;
+                epoll_ctl( m_epollfd, EPOLL_CTL_MOD, c.m_fd, &event );
+                return false;
+            }
+            break;
+        }
+        c.m_sent += n;
+    }
+    return true;
+}
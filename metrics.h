@@ -0,0 +1,169 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <functional>
+#include "locker.h"
+
+/*
+    运行统计，以及提供统计数据的内部HTTP端点
+    计数器分成多个分片，每个线程固定写其中一个分片（relaxed原子操作，不加锁），避免多个线程争用同一个缓存行；
+    读取时把所有分片加起来。队列长度等瞬时值通过add_gauge注册回调，在读取时才计算。
+
+    端点监听在单独的端口（metrics_port），由主线程在epoll循环中处理，不占用工作线程：
+        GET /metrics    Prometheus文本格式
+        GET /status     简短的可读文本
+        GET /slow       最近的慢请求及其各阶段耗时（需要开启trace_stages）
+*/
+
+class metrics {
+public:
+    static metrics* get_instance() {
+        static metrics instance;
+        return &instance;
+    }
+
+    // 应答的状态码分类
+    enum STATUS_SLOT { STATUS_200 = 0, STATUS_400, STATUS_403, STATUS_404, STATUS_429, STATUS_500, STATUS_503, STATUS_OTHER, STATUS_SLOTS };
+
+    // 请求耗时直方图的上界（微秒），最后还有一个+Inf桶
+    static const int LATENCY_BUCKETS = 16;
+
+    /*
+        一个请求的处理阶段
+        STAGE_READ      开始读请求 -> 请求的最后一段读完（分多次到达的请求包含等待客户端的时间）
+        STAGE_QUEUE     读完 -> 工作线程开始处理，即在请求队列中等待的时间
+        STAGE_PARSE     解析请求行和请求头
+        STAGE_OPEN      do_request：路径规范化、查缓存、打开文件、stat、mmap
+        STAGE_BUILD     生成应答
+        STAGE_DISPATCH  应答生成 -> 主线程开始写（等待EPOLLOUT事件的时间）
+        STAGE_WRITE     开始写 -> 应答发完，包含发送缓冲区满（EAGAIN）时等待的时间
+    */
+    enum STAGE { STAGE_READ = 0, STAGE_QUEUE, STAGE_PARSE, STAGE_OPEN, STAGE_BUILD, STAGE_DISPATCH, STAGE_WRITE, STAGES };
+    static const int STAGE_BUCKETS = 18;
+
+    // 一个请求的各阶段耗时
+    struct request_trace {
+        int64_t m_stage[ STAGES ];      // 微秒
+        int64_t m_total;
+        int m_status;
+        int m_eagain;                   // 写应答时遇到EAGAIN的次数
+        long m_minflt;                  // 发送应答、读入文件页面时的缺页次数（getrusage），不需要读磁盘的
+        long m_majflt;                  // 需要读磁盘的缺页次数
+        char m_url[ 64 ];
+    };
+
+    // 一个应答发送完毕：状态码、从读到请求到应答发完的耗时（微秒）、发送的字节数
+    void request_done( int status, int64_t usec, long bytes );
+    void connection_accepted() { shard().m_accepted.fetch_add( 1, std::memory_order_relaxed ); }
+    void connection_rejected() { shard().m_rejected.fetch_add( 1, std::memory_order_relaxed ); }
+
+    // 分阶段计时：默认关闭；slow_usec大于0时，总耗时超过它的请求记入慢请求样本并写日志
+    void set_tracing( bool on, int64_t slow_usec );
+    bool tracing() const { return m_tracing; }
+    void trace_done( const request_trace& trace );
+
+    // 注册一个在读取时才计算的值，labels形如 node="0"，可以为空。同名的值要连续注册
+    void add_gauge( const char* name, const char* help, const std::string& labels, const std::function< double() >& value );
+    void add_counter( const char* name, const char* help, const std::string& labels, const std::function< double() >& value );
+    // 注册一个每次读取之前调用一次的函数，一次算出一组值（如各状态的连接数），这组值的回调只读它的结果
+    void add_collector( const std::function< void() >& collect );
+
+    // 生成Prometheus文本格式和可读文本的统计
+    void render_prometheus( std::string& out );
+    void render_status( std::string& out );
+    void render_slow( std::string& out );
+
+    // 在port上监听统计端点，并注册到epollfd中。失败返回false
+    bool start( int epollfd, int port );
+    // 处理epoll事件，fd不属于统计端点时返回false
+    bool handle_event( int fd, uint32_t events );
+    void stop();
+
+    static int64_t now_usec();
+
+private:
+    metrics();
+    ~metrics();
+
+    static const int SHARDS = 16;
+
+    // 一个分片，独占缓存行
+    struct alignas( 64 ) counter_shard {
+        std::atomic< uint64_t > m_requests[ STATUS_SLOTS ];
+        std::atomic< uint64_t > m_latency[ LATENCY_BUCKETS + 1 ];
+        std::atomic< uint64_t > m_latency_sum;      // 微秒
+        std::atomic< uint64_t > m_bytes;
+        std::atomic< uint64_t > m_accepted;
+        std::atomic< uint64_t > m_rejected;
+        std::atomic< uint64_t > m_stage[ STAGES ][ STAGE_BUCKETS + 1 ];
+        std::atomic< uint64_t > m_stage_sum[ STAGES ];
+        std::atomic< uint64_t > m_minflt;
+        std::atomic< uint64_t > m_majflt;
+    };
+
+    struct gauge {
+        const char* m_type;             // "gauge" 或 "counter"
+        std::string m_name;
+        std::string m_help;
+        std::string m_labels;
+        std::function< double() > m_value;
+    };
+
+    // 统计端点上的一个连接，请求读完后生成应答并写出，然后关闭
+    struct client {
+        int m_fd;
+        std::string m_request;
+        std::string m_response;
+        size_t m_sent;
+    };
+
+    // 所有分片之和
+    struct snapshot {
+        uint64_t m_requests[ STATUS_SLOTS ];
+        uint64_t m_latency[ LATENCY_BUCKETS + 1 ];
+        uint64_t m_latency_sum;
+        uint64_t m_bytes;
+        uint64_t m_accepted;
+        uint64_t m_rejected;
+        uint64_t m_stage[ STAGES ][ STAGE_BUCKETS + 1 ];
+        uint64_t m_stage_sum[ STAGES ];
+        uint64_t m_minflt;
+        uint64_t m_majflt;
+    };
+
+    counter_shard& shard();
+    void collect( snapshot& snap );
+    void run_collectors();
+    void respond( client& c );
+    bool flush( client& c );                // 应答发完（或出错）返回true
+    void close_client( size_t i );
+    void add_value( const char* type, const char* name, const char* help, const std::string& labels,
+                    const std::function< double() >& value );
+
+    counter_shard m_shards[ SHARDS ];
+    std::atomic< int > m_next_shard;    // 分给下一个新线程的分片
+    int64_t m_start_time;               // 启动时刻（Unix时间，秒）
+    int64_t m_start_usec;
+
+    std::vector< gauge > m_gauges;      // 只在启动时注册，之后只有主线程读取
+    std::vector< std::function< void() > > m_collectors;    // 同上
+
+    bool m_tracing;
+    int64_t m_slow_usec;
+    static const int SLOW_SAMPLES = 32;
+    request_trace m_slow[ SLOW_SAMPLES ];   // 最近的慢请求，环形缓冲区
+    int64_t m_slow_time[ SLOW_SAMPLES ];    // 记录时的Unix时间
+    unsigned long m_slow_count;             // 记录过的慢请求总数
+    locker m_slow_mutex;
+    std::atomic< int64_t > m_slow_logged;   // 上一次写慢请求日志的时刻（秒），每秒最多写一条
+
+    int m_epollfd;
+    int m_listenfd;
+    std::vector< client > m_clients;
+};
+
+#endif
@@ -13,12 +13,13 @@
 #include <sys/epoll.h>
 #include <pthread.h>
 #include "lst_timer.h"
+#include "../notifier.h"
 
 #define FD_LIMIT 65535
 #define MAX_EVENT_NUMBER 1024
 #define TIMESLOT 5
 
-static int pipefd[2];
+static fd_notifier* sig_notifier;
 static sort_timer_lst timer_lst;
 static int epollfd = 0;
 
@@ -42,8 +43,7 @@ void addfd( int epollfd, int fd )
 void sig_handler( int sig )
 {
     int save_errno = errno;
-    int msg = sig;
-    send( pipefd[1], ( char* )&msg, 1, 0 );
+    sig_notifier->notify( 1ULL << sig );
     errno = save_errno;
 }
 
@@ -102,11 +102,9 @@ int main( int argc, char* argv[] ) {
     assert( epollfd != -1 );
     addfd( epollfd, listenfd );
 
-    // 创建管道
-    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, pipefd);
-    assert( ret != -1 );
-    setnonblocking( pipefd[1] );
-    addfd( epollfd, pipefd[0] );
+    // 信号通过eventfd交给主循环，和其他事件在同一个epoll_wait中等待
+    sig_notifier = new fd_notifier;
+    addfd( epollfd, sig_notifier->fd() );
 
     // 设置信号处理函数
     addsig( SIGALRM );
@@ -144,31 +142,16 @@ int main( int argc, char* argv[] ) {
                 timer->expire = cur + 3 * TIMESLOT;
                 users[connfd].timer = timer;
                 timer_lst.add_timer( timer );
-            } else if( ( sockfd == pipefd[0] ) && ( events[i].events & EPOLLIN ) ) {
-                // 处理信号
-                int sig;
-                char signals[1024];
-                ret = recv( pipefd[0], signals, sizeof( signals ), 0 );
-                if( ret == -1 ) {
-                    continue;
-                } else if( ret == 0 ) {
-                    continue;
-                } else  {
-                    for( int i = 0; i < ret; ++i ) {
-                        switch( signals[i] )  {
-                            case SIGALRM:
-                            {
-                                // 用timeout变量标记有定时任务需要处理，但不立即处理定时任务
-                                // 这是因为定时任务的优先级不是很高，我们优先处理其他更重要的任务。
-                                timeout = true;
-                                break;
-                            }
-                            case SIGTERM:
-                            {
-                                stop_server = true;
-                            }
-                        }
-                    }
+            } else if( ( sockfd == sig_notifier->fd() ) && ( events[i].events & EPOLLIN ) ) {
+                // 处理信号，多次到达的同一个信号合并为一次
+                uint64_t signals = sig_notifier->consume();
+                if( signals & ( 1ULL << SIGALRM ) ) {
+                    // 用timeout变量标记有定时任务需要处理，但不立即处理定时任务
+                    // 这是因为定时任务的优先级不是很高，我们优先处理其他更重要的任务。
+                    timeout = true;
+                }
+                if( signals & ( 1ULL << SIGTERM ) ) {
+                    stop_server = true;
                 }
             }
             else if(  events[i].events & EPOLLIN )
@@ -220,8 +203,7 @@ int main( int argc, char* argv[] ) {
     }
 
     close( listenfd );
-    close( pipefd[1] );
-    close( pipefd[0] );
+    delete sig_notifier;
     delete [] users;
     return 0;
 }
@@ -0,0 +1,135 @@
+#ifndef NOTIFIER_H
+#define NOTIFIER_H
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <exception>
+#include <atomic>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/*
+    线程间的唤醒通知，代替信号量、条件变量和信号管道
+    notifier    :   基于futex的计数通知，用法同信号量：post增加计数，wait消耗一个计数，计数为0时等待。
+                    只有确实有线程在等待时post才进入内核，post(n)一次系统调用唤醒至多n个等待者，每个计数只唤醒一个线程
+    fd_notifier :   基于eventfd，注册到epoll中和其他事件在同一个epoll_wait中等待。notify可以在信号处理函数中调用；
+                    被处理之前的多次notify只写一次eventfd（合并唤醒），各次传入的位在consume时一起取出
+*/
+class notifier {
+public:
+    notifier() : m_count( 0 ), m_waiters( 0 ) {}
+
+    // 增加n个计数，唤醒至多n个等待的线程
+    void post( int n = 1 ) {
+        if ( n <= 0 ) {
+            return;
+        }
+        // 和block中先登记等待者、再由内核检查计数的顺序配对（都是seq_cst），不会漏掉唤醒
+        m_count.fetch_add( n );
+        if ( m_waiters.load() > 0 ) {
+            futex( FUTEX_WAKE_PRIVATE, n, NULL );
+        }
+    }
+
+    // 等待并消耗一个计数
+    void wait() {
+        while ( !trywait() ) {
+            block( NULL );
+        }
+    }
+
+    // 最多等待ms毫秒，超时返回false
+    bool wait( int ms ) {
+        struct timespec deadline;
+        clock_gettime( CLOCK_MONOTONIC, &deadline );
+        int64_t end = deadline.tv_sec * 1000000000LL + deadline.tv_nsec + ms * 1000000LL;
+        while ( !trywait() ) {
+            struct timespec now;
+            clock_gettime( CLOCK_MONOTONIC, &now );
+            int64_t left = end - ( now.tv_sec * 1000000000LL + now.tv_nsec );
+            if ( left <= 0 ) {
+                return false;
+            }
+            struct timespec timeout = { ( time_t )( left / 1000000000LL ), ( long )( left % 1000000000LL ) };
+            block( &timeout );
+        }
+        return true;
+    }
+
+    // 计数大于0时减1，否则立即返回false
+    bool trywait() {
+        int count = m_count.load( std::memory_order_relaxed );
+        while ( count > 0 ) {
+            if ( m_count.compare_exchange_weak( count, count - 1, std::memory_order_acquire, std::memory_order_relaxed ) ) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    notifier( const notifier& );
+    notifier& operator=( const notifier& );
+
+    // 计数仍为0时睡眠，直到被post唤醒或者超时
+    void block( const struct timespec* timeout ) {
+        m_waiters.fetch_add( 1 );
+        futex( FUTEX_WAIT_PRIVATE, 0, timeout );
+        m_waiters.fetch_sub( 1 );
+    }
+
+    long futex( int op, int value, const struct timespec* timeout ) {
+        return syscall( SYS_futex, reinterpret_cast< int* >( &m_count ), op, value, timeout, NULL, 0 );
+    }
+
+    std::atomic< int > m_count;         // 剩余的计数，futex等待在它上面
+    std::atomic< int > m_waiters;       // 正在内核中等待的线程数
+};
+
+
+class fd_notifier {
+public:
+    fd_notifier() : m_bits( 0 ), m_pending( false ) {
+        m_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+        if ( m_fd == -1 ) {
+            throw std::exception();
+        }
+    }
+    ~fd_notifier() {
+        close( m_fd );
+    }
+
+    int fd() const { return m_fd; }     // 注册到epoll中，可读时调用consume
+
+    // 通知等待在fd上的线程，bits是附带的标志，如 1 << 信号值。异步信号安全
+    void notify( uint64_t bits = 1 ) {
+        m_bits.fetch_or( bits );
+        if ( !m_pending.exchange( true ) ) {
+            uint64_t one = 1;
+            ssize_t ret = ::write( m_fd, &one, sizeof( one ) );
+            ( void )ret;
+        }
+    }
+
+    // 清空eventfd并取出积累的标志。先清空eventfd再允许下一次写入，之后的notify不会丢失；
+    // 偶尔会多一次没有标志的唤醒，此时返回0
+    uint64_t consume() {
+        uint64_t value;
+        ssize_t ret = ::read( m_fd, &value, sizeof( value ) );
+        ( void )ret;
+        m_pending.store( false );
+        return m_bits.exchange( 0 );
+    }
+
+private:
+    fd_notifier( const fd_notifier& );
+    fd_notifier& operator=( const fd_notifier& );
+
+    int m_fd;
+    std::atomic< uint64_t > m_bits;     // 还没有取走的标志
+    std::atomic< bool > m_pending;      // 已经写了eventfd，还没有consume
+};
+
+#endif
@@ -0,0 +1,136 @@
+#include <time.h>
+#include <string.h>
+#include "overload.h"
+
+ip_limiter::ip_limiter() : m_limit( 0 ), m_rate( 0 ), m_burst( 0 ), m_age( 0 ), m_entries( NULL ),
+                           m_rejected( 0 ), m_throttled( 0 ) {
+}
+
+void ip_limiter::set_limit( int max_conns, int rate, int burst ) {
+    m_limit = max_conns > 0 ? max_conns : 0;
+    m_rate = rate > 0 ? rate : 0;
+    m_burst = ( burst > 0 ? burst : 1 ) * 1000u;
+    m_age = m_rate ? m_burst / m_rate + 1 : 0;
+    if ( ( m_limit || m_rate ) && !m_entries ) {
+        // 不限制时不分配哈希表
+        m_entries = new entry[ SLOTS ];
+        for ( int i = 0; i < SLOTS; ++i ) {
+            m_entries[i].m_key = 0;
+            m_entries[i].m_conns = 0;
+            m_entries[i].m_bucket = 0;
+        }
+    }
+}
+
+// IPv4地址（包括双栈socket上IPv4映射的IPv6地址）为 1<<32 | 地址，IPv6为最高位置1的/64前缀，两者不会相同，也都不为0
+uint64_t ip_limiter::client_key( const struct sockaddr_storage& addr ) {
+    if ( addr.ss_family == AF_INET ) {
+        return ( 1ULL << 32 ) | ( ( const struct sockaddr_in* )&addr )->sin_addr.s_addr;
+    }
+    const struct in6_addr& v6 = ( ( const struct sockaddr_in6* )&addr )->sin6_addr;
+    uint32_t ip;
+    if ( IN6_IS_ADDR_V4MAPPED( &v6 ) ) {
+        memcpy( &ip, v6.s6_addr + 12, sizeof( ip ) );
+        return ( 1ULL << 32 ) | ip;
+    }
+    uint64_t prefix;
+    memcpy( &prefix, v6.s6_addr, sizeof( prefix ) );
+    return prefix | ( 1ULL << 63 );
+}
+
+uint32_t ip_limiter::now_ms() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+    return ( uint32_t )( ts.tv_sec * 1000 + ts.tv_nsec / 1000000 );
+}
+
+uint32_t ip_limiter::refill( uint64_t bucket, uint32_t now ) const {
+    uint32_t last = bucket >> 32;
+    uint32_t tokens = ( uint32_t )bucket;
+    uint32_t elapsed = now - last;      // 无符号相减，时间戳回绕时也正确
+    if ( elapsed >= m_age ) {
+        return m_burst;
+    }
+    uint64_t refilled = tokens + ( uint64_t )elapsed * m_rate;
+    return refilled > m_burst ? m_burst : ( uint32_t )refilled;
+}
+
+bool ip_limiter::reusable( entry& e, uint32_t now ) const {
+    if ( e.m_conns.load( std::memory_order_acquire ) != 0 ) {
+        return false;
+    }
+    return m_rate == 0 || now - ( uint32_t )( e.m_bucket.load( std::memory_order_relaxed ) >> 32 ) >= m_age;
+}
+
+bool ip_limiter::acquire( const struct sockaddr_storage& addr, int& slot ) {
+    slot = -1;
+    if ( !m_entries ) {
+        return true;
+    }
+    uint64_t key = client_key( addr );
+    uint32_t now = now_ms();
+    // 乘法哈希取高16位，从这里开始线性探查
+    uint32_t start = ( key * 0x9E3779B97F4A7C15ULL ) >> 48;
+    int found = -1;
+    int empty = -1;
+    for ( int i = 0; i < PROBES && found == -1; ++i ) {
+        int index = ( start + i ) & ( SLOTS - 1 );
+        entry& e = m_entries[ index ];
+        uint64_t k = e.m_key.load( std::memory_order_relaxed );
+        if ( k == key ) {
+            found = index;
+        } else if ( empty == -1 && ( k == 0 || reusable( e, now ) ) ) {
+            empty = index;
+        }
+    }
+    if ( found == -1 ) {
+        if ( empty == -1 ) {
+            // 附近的表项都被正在连接的IP占着，不限制这个IP
+            return true;
+        }
+        found = empty;
+        entry& e = m_entries[ found ];
+        e.m_key.store( key, std::memory_order_relaxed );
+        e.m_conns.store( 0, std::memory_order_relaxed );
+        e.m_bucket.store( ( ( uint64_t )now << 32 ) | m_burst, std::memory_order_relaxed );
+    }
+
+    entry& e = m_entries[ found ];
+    // 只有主线程增加连接数，先判断再增加不会超过限制
+    if ( ( m_limit && e.m_conns.load( std::memory_order_relaxed ) >= m_limit )
+         || ( m_rate && refill( e.m_bucket.load( std::memory_order_relaxed ), now ) < 1000 ) ) {
+        m_rejected.fetch_add( 1, std::memory_order_relaxed );
+        return false;
+    }
+    e.m_conns.fetch_add( 1, std::memory_order_relaxed );
+    slot = found;
+    return true;
+}
+
+void ip_limiter::release( int slot ) {
+    if ( slot < 0 ) {
+        return;
+    }
+    // release语义：主线程看到计数为0时，关闭连接的线程对这个表项的操作都已经完成
+    m_entries[ slot ].m_conns.fetch_sub( 1, std::memory_order_release );
+}
+
+bool ip_limiter::allow_request( int slot ) {
+    if ( slot < 0 || m_rate == 0 ) {
+        return true;
+    }
+    std::atomic< uint64_t >& bucket = m_entries[ slot ].m_bucket;
+    uint32_t now = now_ms();
+    uint64_t old = bucket.load( std::memory_order_relaxed );
+    while ( true ) {
+        uint32_t tokens = refill( old, now );
+        if ( tokens < 1000 ) {
+            m_throttled.fetch_add( 1, std::memory_order_relaxed );
+            return false;
+        }
+        uint64_t updated = ( ( uint64_t )now << 32 ) | ( tokens - 1000 );
+        if ( bucket.compare_exchange_weak( old, updated, std::memory_order_relaxed ) ) {
+            return true;
+        }
+    }
+}
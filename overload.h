@@ -0,0 +1,137 @@
+#ifndef OVERLOAD_H
+#define OVERLOAD_H
+
+#include <stdint.h>
+#include <math.h>
+#include <atomic>
+#include <netinet/in.h>
+
+/*
+    过载保护
+    codel       按请求在队列中的等待时间决定是否丢弃（CoDel，RFC 8289）。等待时间在一个interval内
+                一直高于target，说明队列积压已经不是突发流量，开始丢弃，丢弃间隔按interval/sqrt(count)缩短，
+                直到等待时间重新低于target。被丢弃的请求不处理，直接回复503。
+    ip_limiter  限制每个客户端IP同时打开的连接数和请求速率
+*/
+class codel {
+public:
+    codel() : m_target( 0 ), m_interval( 0 ), m_first_above( 0 ), m_drop_next( 0 ),
+              m_count( 0 ), m_last_count( 0 ), m_dropping( false ) {}
+
+    // target为0表示不丢弃，单位都是微秒
+    void set( int64_t target, int64_t interval ) {
+        m_target = target;
+        m_interval = interval > 0 ? interval : 100000;
+    }
+    bool enabled() const { return m_target > 0; }
+
+    // 每取出一个请求调用一次，sojourn是它在队列中等待的时间，remaining是队列中剩下的请求数，返回true表示丢弃它
+    // 调用者需要保证同一个对象不被并发调用（由请求队列的锁保护）
+    bool drop( int64_t sojourn, int64_t now, size_t remaining ) {
+        bool ok_to_drop = above_target( sojourn, now, remaining );
+        if ( m_dropping ) {
+            if ( !ok_to_drop ) {
+                m_dropping = false;
+                return false;
+            }
+            if ( now >= m_drop_next ) {
+                ++m_count;
+                m_drop_next = control_law( m_drop_next );
+                return true;
+            }
+            return false;
+        }
+        if ( !ok_to_drop ) {
+            return false;
+        }
+        // 进入丢弃状态。如果刚离开丢弃状态不久，从上次的丢弃频率附近开始
+        m_dropping = true;
+        uint32_t delta = m_count - m_last_count;
+        m_count = ( delta > 1 && now - m_drop_next < 16 * m_interval ) ? delta : 1;
+        m_last_count = m_count;
+        m_drop_next = control_law( now );
+        return true;
+    }
+
+private:
+    bool above_target( int64_t sojourn, int64_t now, size_t remaining ) {
+        // 队列里几乎没有积压时不丢弃
+        if ( sojourn < m_target || remaining == 0 ) {
+            m_first_above = 0;
+            return false;
+        }
+        if ( m_first_above == 0 ) {
+            m_first_above = now + m_interval;
+            return false;
+        }
+        return now >= m_first_above;
+    }
+    int64_t control_law( int64_t t ) const { return t + ( int64_t )( m_interval / sqrt( ( double )m_count ) ); }
+
+    int64_t m_target;           // 可以接受的排队时间
+    int64_t m_interval;         // 排队时间持续高于target多久之后开始丢弃
+    int64_t m_first_above;      // 排队时间高于target后，到这个时刻还没降下来就开始丢弃
+    int64_t m_drop_next;        // 丢弃状态下，下一次丢弃的时刻
+    uint32_t m_count;           // 本轮丢弃状态下丢弃的个数
+    uint32_t m_last_count;
+    bool m_dropping;
+};
+
+
+/*
+    按客户端IP限制同时打开的连接数和请求速率（令牌桶）。IPv6按/64前缀计，一台主机通常就有一整个/64
+    开放寻址的哈希表，每个IP一项，记录连接数和令牌桶。表项只由接受连接的主线程插入和回收，
+    工作线程只在关闭连接时减少计数，所以不需要锁；令牌桶的状态和时间戳放在一个64位原子变量里，用CAS更新。
+    连接数为0、令牌桶已经重新攒满的表项和新表项没有区别，可以直接让给别的IP（老化）。
+*/
+class ip_limiter {
+public:
+    static ip_limiter* get_instance() {
+        static ip_limiter instance;
+        return &instance;
+    }
+
+    // 每个IP最多同时打开max_conns个连接，每秒最多rate个请求、最多连续burst个，0表示不限制。在接受连接之前设置
+    void set_limit( int max_conns, int rate, int burst );
+
+    /*
+        新连接占用一个名额：连接数已满或令牌已经用完时返回false。
+        成功时slot是该IP的表项，之后的请求和关闭连接都用它，不再查表；不限制或表满时slot为-1。只由主线程调用
+    */
+    bool acquire( const struct sockaddr_storage& addr, int& slot );
+    void release( int slot );
+    // 处理一个请求之前调用，消耗一个令牌，令牌用完时返回false
+    bool allow_request( int slot );
+
+    unsigned long rejected() const { return m_rejected.load( std::memory_order_relaxed ); }
+    unsigned long throttled() const { return m_throttled.load( std::memory_order_relaxed ); }
+
+private:
+    ip_limiter();
+    ip_limiter( const ip_limiter& );
+    ip_limiter& operator=( const ip_limiter& );
+
+    struct entry {
+        std::atomic< uint64_t > m_key;      // 客户端地址，见client_key，0表示空
+        std::atomic< int32_t > m_conns;     // 当前的连接数
+        std::atomic< uint64_t > m_bucket;   // 高32位：上次补充令牌的时刻（毫秒），低32位：令牌数（千分之一个）
+    };
+    static const int SLOTS = 65536;
+    static const int PROBES = 8;            // 最多查找的表项个数，都被占用时不限制这个IP
+
+    static uint64_t client_key( const struct sockaddr_storage& addr );
+    static uint32_t now_ms();
+    // 令牌桶在now时刻补充之后的令牌数（千分之一个）
+    uint32_t refill( uint64_t bucket, uint32_t now ) const;
+    bool reusable( entry& e, uint32_t now ) const;
+
+    int m_limit;                // 每个IP的最大连接数
+    uint32_t m_rate;            // 每毫秒补充的令牌数（千分之一个），即每秒的请求数
+    uint32_t m_burst;           // 令牌桶容量（千分之一个）
+    uint32_t m_age;             // 空闲多久（毫秒）之后令牌桶一定是满的
+    entry* m_entries;
+    std::atomic< unsigned long > m_rejected;
+    std::atomic< unsigned long > m_throttled;
+};
+
+#endif
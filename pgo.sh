@@ -0,0 +1,47 @@
+#!/bin/sh
+# 用profile-guided optimization构建webserver
+#   1. 构建插桩版本（WEBSERVER_PGO=GENERATE）
+#   2. 用loadgen压测插桩的服务器，并运行bench，收集profile
+#   3. 用收集到的profile重新构建（WEBSERVER_PGO=USE），结果在 _pgo_build/webserver
+#
+# 用法：./pgo.sh [训练秒数]
+# 环境变量：PGO_PORT 训练时服务器监听的端口（默认19006），CMAKE_ARGS 额外的cmake参数（如 -DWEBSERVER_LTO=ON）
+
+set -e
+
+SRC=$(cd "$(dirname "$0")" && pwd)
+GEN="$SRC/_pgo_gen"
+OUT="$SRC/_pgo_build"
+PROFILE="$SRC/_pgo_profile"
+SECONDS_PER_RUN=${1:-10}
+PORT=${PGO_PORT:-19006}
+URL="http://127.0.0.1:$PORT/index.html"
+
+rm -rf "$PROFILE"
+cmake -S "$SRC" -B "$GEN" -DCMAKE_BUILD_TYPE=Release -DWEBSERVER_PGO=GENERATE -DWEBSERVER_PGO_DIR="$PROFILE" $CMAKE_ARGS
+cmake --build "$GEN" -j"$(nproc)"
+
+# 插桩的服务器。日志打开，让日志的代码路径也被训练到
+RUN=$(mktemp -d)
+"$GEN/webserver" -d "$SRC/resources" -l "$RUN/ServerLog" -c 0 -q 1024 "$PORT" > "$RUN/out.txt" 2>&1 &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null; rm -rf "$RUN"' EXIT
+sleep 1
+
+# 长连接、流水线和短连接，覆盖解析、缓存命中、写应答和连接建立/关闭的路径
+"$GEN/loadgen" -c 64 -T 2 -t "$SECONDS_PER_RUN" -k "$URL"
+"$GEN/loadgen" -c 16 -t "$SECONDS_PER_RUN" -k -P 8 "$URL"
+"$GEN/loadgen" -c 32 -t "$SECONDS_PER_RUN" "$URL"
+"$GEN/loadgen" -c 8 -t 2 -k "http://127.0.0.1:$PORT/no_such_file.html" || true
+
+# SIGTERM让服务器优雅退出，退出时写出profile
+kill -TERM $SERVER
+wait $SERVER || true
+trap - EXIT
+rm -rf "$RUN"
+
+"$GEN/bench" --benchmark_min_time=0.2 > /dev/null
+
+cmake -S "$SRC" -B "$OUT" -DCMAKE_BUILD_TYPE=Release -DWEBSERVER_PGO=USE -DWEBSERVER_PGO_DIR="$PROFILE" $CMAKE_ARGS
+cmake --build "$OUT" -j"$(nproc)"
+echo "PGO build: $OUT/webserver"
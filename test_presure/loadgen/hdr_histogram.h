@@ -0,0 +1,142 @@
+#ifndef HDR_HISTOGRAM_H
+#define HDR_HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+/*
+    对数-线性分桶的直方图，HDR Histogram 的简化实现
+    记录 [0, highest] 范围内的整数值（这里用来记录微秒级的延迟），在整个范围内保持 significant_digits 位有效数字，
+    内存只和范围的对数成正比。多个线程各自记录，最后用merge合并。
+*/
+class hdr_histogram {
+public:
+    explicit hdr_histogram( int64_t highest = 3600LL * 1000 * 1000, int significant_digits = 3 )
+            : m_highest( highest ), m_total( 0 ), m_min( INT64_MAX ), m_max( 0 ), m_sum( 0 ) {
+        // 每个桶内的线性子桶个数：2 * 10^digits 向上取2的幂
+        int64_t largest = 2;
+        for ( int i = 0; i < significant_digits; ++i ) {
+            largest *= 10;
+        }
+        m_sub_bucket_count_magnitude = 0;
+        while ( ( 1LL << m_sub_bucket_count_magnitude ) < largest ) {
+            ++m_sub_bucket_count_magnitude;
+        }
+        m_sub_bucket_half_count_magnitude = m_sub_bucket_count_magnitude - 1;
+        m_sub_bucket_count = 1LL << m_sub_bucket_count_magnitude;
+        m_sub_bucket_half_count = m_sub_bucket_count / 2;
+        m_sub_bucket_mask = m_sub_bucket_count - 1;
+
+        // 覆盖到highest需要多少个桶，每个桶的范围是上一个的2倍
+        int64_t smallest_untrackable = m_sub_bucket_count;
+        int buckets = 1;
+        while ( smallest_untrackable <= highest ) {
+            if ( smallest_untrackable > INT64_MAX / 2 ) {
+                ++buckets;
+                break;
+            }
+            smallest_untrackable <<= 1;
+            ++buckets;
+        }
+        m_counts.assign( ( buckets + 1 ) * m_sub_bucket_half_count, 0 );
+    }
+
+    void record( int64_t value, int64_t count = 1 ) {
+        if ( value < 0 ) {
+            value = 0;
+        } else if ( value > m_highest ) {
+            value = m_highest;
+        }
+        m_counts[ index_of( value ) ] += count;
+        m_total += count;
+        m_sum += value * count;
+        if ( value < m_min ) {
+            m_min = value;
+        }
+        if ( value > m_max ) {
+            m_max = value;
+        }
+    }
+
+    void merge( const hdr_histogram& other ) {
+        for ( size_t i = 0; i < other.m_counts.size() && i < m_counts.size(); ++i ) {
+            m_counts[i] += other.m_counts[i];
+        }
+        m_total += other.m_total;
+        m_sum += other.m_sum;
+        if ( other.m_total > 0 ) {
+            m_min = other.m_min < m_min ? other.m_min : m_min;
+            m_max = other.m_max > m_max ? other.m_max : m_max;
+        }
+    }
+
+    int64_t count() const { return m_total; }
+    int64_t min() const { return m_total ? m_min : 0; }
+    int64_t max() const { return m_max; }
+    double mean() const { return m_total ? ( double )m_sum / m_total : 0.0; }
+
+    // 第percentile百分位的值（返回所在子桶范围的上界，与HDR Histogram一致）
+    int64_t value_at_percentile( double percentile ) const {
+        if ( m_total == 0 ) {
+            return 0;
+        }
+        if ( percentile >= 100.0 ) {
+            return m_max;
+        }
+        int64_t target = ( int64_t )( percentile / 100.0 * m_total + 0.5 );
+        if ( target < 1 ) {
+            target = 1;
+        }
+        int64_t running = 0;
+        for ( size_t i = 0; i < m_counts.size(); ++i ) {
+            running += m_counts[i];
+            if ( running >= target ) {
+                int64_t value = highest_equivalent( value_at_index( i ) );
+                return value < m_max ? value : m_max;
+            }
+        }
+        return m_max;
+    }
+
+private:
+    size_t index_of( int64_t value ) const {
+        int pow2ceiling = 64 - __builtin_clzll( ( uint64_t )( value | m_sub_bucket_mask ) );
+        int bucket_index = pow2ceiling - ( m_sub_bucket_half_count_magnitude + 1 );
+        int64_t sub_bucket_index = value >> bucket_index;
+        return ( ( size_t )( bucket_index + 1 ) << m_sub_bucket_half_count_magnitude )
+               + ( sub_bucket_index - m_sub_bucket_half_count );
+    }
+
+    int64_t value_at_index( size_t index ) const {
+        int bucket_index = ( int )( index >> m_sub_bucket_half_count_magnitude ) - 1;
+        int64_t sub_bucket_index = ( index & ( m_sub_bucket_half_count - 1 ) ) + m_sub_bucket_half_count;
+        if ( bucket_index < 0 ) {
+            sub_bucket_index -= m_sub_bucket_half_count;
+            bucket_index = 0;
+        }
+        return sub_bucket_index << bucket_index;
+    }
+
+    // value所在子桶能表示的最大值
+    int64_t highest_equivalent( int64_t value ) const {
+        int pow2ceiling = 64 - __builtin_clzll( ( uint64_t )( value | m_sub_bucket_mask ) );
+        int bucket_index = pow2ceiling - ( m_sub_bucket_half_count_magnitude + 1 );
+        int shift = ( ( value >> bucket_index ) >= m_sub_bucket_count ) ? bucket_index + 1 : bucket_index;
+        return value + ( 1LL << shift ) - 1;
+    }
+
+    int64_t m_highest;                      // 能记录的最大值，更大的值按它记录
+    int m_sub_bucket_count_magnitude;
+    int m_sub_bucket_half_count_magnitude;
+    int64_t m_sub_bucket_count;
+    int64_t m_sub_bucket_half_count;
+    int64_t m_sub_bucket_mask;
+    std::vector< int64_t > m_counts;        // 各子桶的计数
+    int64_t m_total;                        // 记录的总个数
+    int64_t m_min;
+    int64_t m_max;
+    int64_t m_sum;
+};
+
+#endif
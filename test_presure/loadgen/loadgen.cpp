@@ -0,0 +1,846 @@
+/*
+ * loadgen: 基于epoll的HTTP压力测试工具
+ *
+ * 与webbench每个客户端fork一个进程、每个请求新建一个TCP连接不同，loadgen用少量线程，
+ * 每个线程用epoll驱动成百上千个连接，支持长连接和流水线（pipelining），
+ * 并用HDR直方图记录每个请求的延迟，报告p50/p99/p99.9等尾延迟。
+ *
+ * 两种发送模式：
+ *   闭环（默认）：每个连接上的请求完成后才发送下一个，和webbench相同
+ *   开环（-R）：按固定速率发送请求，与服务器响应快慢无关
+ *
+ * 闭环模式下服务器卡顿时客户端也跟着停止发送，卡顿期间本该发出的请求根本没有被测量，
+ * 尾延迟会被严重低估（coordinated omission）。开环模式下每个请求都有计划发送时刻，
+ * 同时记录两种延迟：
+ *   corrected   从计划发送时刻到收完应答，即用户实际感受到的延迟
+ *   uncorrected 从实际发送时刻到收完应答，与闭环工具的口径相同
+ * 两者的差值就是请求在客户端排队等待（连接都被卡住的请求占着）的时间，差值大说明服务器出现过卡顿。
+ * 压测结束时还没有完成的请求按结束时刻计入corrected，避免结束前的卡顿被漏掉。
+ *
+ * 给出服务器的统计端口（-M）时，压测前后各读一次 /metrics，按各NUMA节点（CPU插槽）上的工作队列
+ * 处理的请求数之差报告每个插槽的吞吐量。
+ *
+ * 用法：
+ *   loadgen --help
+ *
+ * 返回值：
+ *    0 - 成功
+ *    1 - 压测失败（服务器不在线）
+ *    2 - 参数错误
+ *    3 - 内部错误
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include "hdr_histogram.h"
+
+#define PROGRAM_VERSION "1.0"
+
+#define METHOD_GET 0
+#define METHOD_HEAD 1
+#define METHOD_OPTIONS 2
+#define METHOD_TRACE 3
+
+/* 参数 */
+static int http10 = 2;              /* 0 - http/0.9, 1 - http/1.0, 2 - http/1.1 */
+static int method = METHOD_GET;
+static int clients = 1;             /* 总连接数 */
+static int threads = 1;             /* epoll线程数 */
+static int benchtime = 30;          /* 压测时长（秒） */
+static int force_reload = 0;        /* 发送 Pragma: no-cache */
+static int keepalive = 0;           /* 长连接，请求完成后复用连接 */
+static int pipeline = 1;            /* 每个连接上同时在途的请求数 */
+static double rate = 0;             /* 开环模式下每秒发送的请求总数，0为闭环 */
+static std::vector< int > cpus;     /* 各线程绑定的CPU */
+static int metrics_port = 0;        /* 服务器的统计端口，0为不读取 */
+
+/* 目标 */
+static std::string host;
+static int port = 80;
+static std::string path;
+static std::string request;
+static struct sockaddr_storage server_addr;
+static socklen_t server_addrlen;
+
+static const struct option long_options[] = {
+    { "reload",     no_argument,       &force_reload, 1 },
+    { "time",       required_argument, NULL, 't' },
+    { "help",       no_argument,       NULL, '?' },
+    { "http09",     no_argument,       NULL, '9' },
+    { "http10",     no_argument,       NULL, '1' },
+    { "http11",     no_argument,       NULL, '2' },
+    { "get",        no_argument,       &method, METHOD_GET },
+    { "head",       no_argument,       &method, METHOD_HEAD },
+    { "options",    no_argument,       &method, METHOD_OPTIONS },
+    { "trace",      no_argument,       &method, METHOD_TRACE },
+    { "version",    no_argument,       NULL, 'V' },
+    { "clients",    required_argument, NULL, 'c' },
+    { "threads",    required_argument, NULL, 'T' },
+    { "keepalive",  no_argument,       NULL, 'k' },
+    { "pipeline",   required_argument, NULL, 'P' },
+    { "rate",       required_argument, NULL, 'R' },
+    { "cpus",       required_argument, NULL, 'C' },
+    { "metrics",    required_argument, NULL, 'M' },
+    { NULL, 0, NULL, 0 }
+};
+
+static void usage( void ) {
+    fprintf( stderr,
+        "loadgen [option]... URL\n"
+        "  -r|--reload              Send reload request - Pragma: no-cache.\n"
+        "  -t|--time <sec>          Run benchmark for <sec> seconds. Default 30.\n"
+        "  -c|--clients <n>         Keep <n> connections open at once. Default one.\n"
+        "  -T|--threads <n>         Drive the connections from <n> epoll threads. Default one.\n"
+        "  -k|--keepalive           Reuse connections (Connection: keep-alive).\n"
+        "  -P|--pipeline <n>        Keep up to <n> requests in flight per connection (needs -k). Default 1.\n"
+        "  -R|--rate <n>            Open loop: send <n> requests/sec in total regardless of responses;\n"
+        "                           latency is also measured from the scheduled send time.\n"
+        "  -C|--cpus <list>         Pin thread i to the i-th cpu of <list>, e.g. 0,1,8,9.\n"
+        "  -M|--metrics <port>      Read the server's /metrics on <port> before and after the run\n"
+        "                           and report the throughput of each socket (NUMA node).\n"
+        "  -9|--http09              Use HTTP/0.9 style requests.\n"
+        "  -1|--http10              Use HTTP/1.0 protocol.\n"
+        "  -2|--http11              Use HTTP/1.1 protocol. Default.\n"
+        "  --get                    Use GET request method.\n"
+        "  --head                   Use HEAD request method.\n"
+        "  --options                Use OPTIONS request method.\n"
+        "  --trace                  Use TRACE request method.\n"
+        "  -?|-h|--help             This information.\n"
+        "  -V|--version             Display program version.\n"
+    );
+}
+
+static int64_t now_ns( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( int64_t )ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* 解析 http://host[:port]/path */
+static bool parse_url( const char* url ) {
+    if ( strncasecmp( url, "http://", 7 ) != 0 ) {
+        fprintf( stderr, "Only HTTP protocol is directly supported.\n" );
+        return false;
+    }
+    const char* p = url + 7;
+    const char* slash = strchr( p, '/' );
+    if ( !slash ) {
+        fprintf( stderr, "Invalid URL syntax - hostname don't ends with '/'.\n" );
+        return false;
+    }
+    std::string hostport( p, slash - p );
+    path = slash;
+    std::string::size_type colon = hostport.rfind( ':' );
+    if ( colon != std::string::npos && hostport.find( ']' ) == std::string::npos ) {
+        host = hostport.substr( 0, colon );
+        port = atoi( hostport.c_str() + colon + 1 );
+    } else if ( colon != std::string::npos && hostport[ colon - 1 ] == ']' ) {
+        host = hostport.substr( 1, colon - 2 );
+        port = atoi( hostport.c_str() + colon + 1 );
+    } else {
+        host = hostport;
+    }
+    if ( port <= 0 || port > 65535 ) {
+        fprintf( stderr, "Invalid port in URL.\n" );
+        return false;
+    }
+    return true;
+}
+
+static void build_request( void ) {
+    static const char* methods[] = { "GET", "HEAD", "OPTIONS", "TRACE" };
+    static const char* versions[] = { "", " HTTP/1.0", " HTTP/1.1" };
+    request = std::string( methods[ method ] ) + " " + path + versions[ http10 ] + "\r\n";
+    if ( http10 > 0 ) {
+        request += "User-Agent: loadgen " PROGRAM_VERSION "\r\n";
+        request += "Host: " + host + "\r\n";
+        if ( force_reload ) {
+            request += "Pragma: no-cache\r\n";
+        }
+        request += keepalive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+        request += "\r\n";
+    }
+}
+
+/* 一个已发出的请求 */
+struct sent_request {
+    int64_t intended;                   /* 计划发送时刻，闭环模式下等于actual */
+    int64_t actual;                     /* 实际发送时刻 */
+};
+
+/* 一个连接 */
+struct connection {
+    enum STATE { CLOSED, CONNECTING, ACTIVE };
+    int fd;
+    STATE state;
+    std::string out;                    /* 待发送的数据 */
+    size_t out_off;
+    std::deque< sent_request > sent;    /* 在途的请求，按发送顺序 */
+    int requests;                       /* 在这个连接上发出过的请求数 */
+    bool ready_listed;                  /* 是否在线程的空闲连接列表中 */
+
+    /* 应答解析状态 */
+    std::string head;                   /* 尚未解析完的响应头 */
+    bool in_body;
+    int64_t body_left;                  /* -1 表示读到连接关闭为止 */
+    bool server_close;                  /* 应答带 Connection: close */
+
+    connection() : fd( -1 ), state( CLOSED ), out_off( 0 ), requests( 0 ), ready_listed( false ),
+                   in_body( false ), body_left( 0 ), server_close( false ) {}
+};
+
+/* 每个线程的状态和统计 */
+struct worker {
+    int id;
+    pthread_t tid;
+    int epollfd;
+    int timerfd;
+    std::vector< connection > conns;
+    std::vector< connection* > ready;   /* 开环模式下还能再发送请求的连接 */
+    int64_t end_time;
+
+    /* 开环模式的发送计划 */
+    int64_t interval;                   /* 相邻两个请求的间隔（纳秒） */
+    int64_t next_due;                   /* 下一个请求的计划发送时刻 */
+    std::deque< int64_t > pending;      /* 已到计划时刻、还没有发出的请求 */
+
+    /* 统计 */
+    int64_t completed;
+    int64_t failed;
+    int64_t bytes;
+    int64_t non2xx;
+    int64_t unfinished;                 /* 压测结束时还没有完成的请求 */
+    hdr_histogram latency;              /* 从实际发送到收完应答，微秒 */
+    hdr_histogram corrected;            /* 开环模式：从计划发送时刻到收完应答，微秒 */
+
+    worker() : id( 0 ), epollfd( -1 ), timerfd( -1 ), end_time( 0 ), interval( 0 ), next_due( 0 ),
+               completed( 0 ), failed( 0 ), bytes( 0 ), non2xx( 0 ), unfinished( 0 ) {}
+};
+
+static void conn_open( worker* w, connection* c );
+static void conn_fill( worker* w, connection* c );
+static void dispatch_pending( worker* w );
+
+static void conn_close( worker* w, connection* c ) {
+    if ( c->fd != -1 ) {
+        epoll_ctl( w->epollfd, EPOLL_CTL_DEL, c->fd, NULL );
+        close( c->fd );
+    }
+    c->fd = -1;
+    c->state = connection::CLOSED;
+    c->out.clear();
+    c->out_off = 0;
+    c->sent.clear();
+    c->requests = 0;
+    c->head.clear();
+    c->in_body = false;
+    c->body_left = 0;
+    c->server_close = false;
+}
+
+/* 连接出错：在途的请求都算失败，然后重新连接 */
+static void conn_fail( worker* w, connection* c ) {
+    w->failed += c->sent.empty() ? 1 : c->sent.size();
+    conn_close( w, c );
+    conn_open( w, c );
+}
+
+static void conn_watch( worker* w, connection* c, bool want_write ) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | ( want_write ? ( uint32_t )EPOLLOUT : 0 );
+    ev.data.ptr = c;
+    epoll_ctl( w->epollfd, EPOLL_CTL_MOD, c->fd, &ev );
+}
+
+static void conn_open( worker* w, connection* c ) {
+    c->fd = socket( server_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if ( c->fd == -1 ) {
+        w->failed++;
+        return;
+    }
+    int one = 1;
+    setsockopt( c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+    if ( connect( c->fd, ( struct sockaddr* )&server_addr, server_addrlen ) == -1 && errno != EINPROGRESS ) {
+        close( c->fd );
+        c->fd = -1;
+        w->failed++;
+        return;
+    }
+    c->state = connection::CONNECTING;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = c;
+    epoll_ctl( w->epollfd, EPOLL_CTL_ADD, c->fd, &ev );
+}
+
+/* 发送缓冲区中的数据，发不完时等待EPOLLOUT */
+static void conn_flush( worker* w, connection* c ) {
+    while ( c->out_off < c->out.size() ) {
+        ssize_t n = send( c->fd, c->out.data() + c->out_off, c->out.size() - c->out_off, MSG_NOSIGNAL );
+        if ( n < 0 ) {
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                conn_watch( w, c, true );
+                return;
+            }
+            conn_fail( w, c );
+            return;
+        }
+        c->out_off += n;
+    }
+    c->out.clear();
+    c->out_off = 0;
+    conn_watch( w, c, false );
+}
+
+/* 连接上还能不能再发一个请求 */
+static bool conn_has_room( const connection* c ) {
+    if ( c->state != connection::ACTIVE ) {
+        return false;
+    }
+    if ( !keepalive ) {
+        return c->requests == 0;
+    }
+    return ( int )c->sent.size() < pipeline;
+}
+
+static void conn_send_request( connection* c, int64_t intended, int64_t now ) {
+    c->out += request;
+    sent_request r = { intended, now };
+    c->sent.push_back( r );
+    c->requests++;
+}
+
+/* 闭环：把连接上的在途请求补满；开环：把连接放入空闲列表，等待计划中的请求 */
+static void conn_fill( worker* w, connection* c ) {
+    if ( !conn_has_room( c ) ) {
+        return;
+    }
+    if ( rate > 0 ) {
+        if ( !c->ready_listed ) {
+            c->ready_listed = true;
+            w->ready.push_back( c );
+        }
+        if ( !w->pending.empty() ) {
+            dispatch_pending( w );
+        }
+        return;
+    }
+    int64_t now = now_ns();
+    while ( conn_has_room( c ) ) {
+        conn_send_request( c, now, now );
+    }
+    conn_flush( w, c );
+}
+
+/* 开环：把到期的请求分给有空的连接 */
+static void dispatch_pending( worker* w ) {
+    int64_t now = now_ns();
+    while ( !w->pending.empty() && !w->ready.empty() ) {
+        connection* c = w->ready.back();
+        if ( !conn_has_room( c ) ) {
+            c->ready_listed = false;
+            w->ready.pop_back();
+            continue;
+        }
+        bool was_empty = c->out.empty();
+        while ( !w->pending.empty() && conn_has_room( c ) ) {
+            conn_send_request( c, w->pending.front(), now );
+            w->pending.pop_front();
+        }
+        if ( !conn_has_room( c ) ) {
+            c->ready_listed = false;
+            w->ready.pop_back();
+        }
+        if ( was_empty ) {
+            conn_flush( w, c );
+        }
+    }
+}
+
+/* 一个应答收完 */
+static void response_done( worker* w, connection* c, int64_t now ) {
+    if ( !c->sent.empty() ) {
+        w->latency.record( ( now - c->sent.front().actual ) / 1000 );
+        if ( rate > 0 ) {
+            w->corrected.record( ( now - c->sent.front().intended ) / 1000 );
+        }
+        c->sent.pop_front();
+    }
+    w->completed++;
+    c->in_body = false;
+    c->body_left = 0;
+}
+
+/* 解析收到的数据，可能包含多个（流水线的）应答。返回false表示连接需要关闭 */
+static bool conn_parse( worker* w, connection* c, const char* data, size_t len, int64_t now ) {
+    while ( len > 0 ) {
+        if ( c->in_body ) {
+            if ( c->body_left < 0 ) {           /* 读到连接关闭为止 */
+                return true;
+            }
+            size_t n = ( ( int64_t )len < c->body_left ) ? len : ( size_t )c->body_left;
+            c->body_left -= n;
+            data += n;
+            len -= n;
+            if ( c->body_left == 0 ) {
+                response_done( w, c, now );
+                if ( c->server_close || !keepalive ) {
+                    return false;
+                }
+            }
+            continue;
+        }
+
+        /* 响应头 */
+        size_t old = c->head.size();
+        c->head.append( data, len );
+        std::string::size_type end = c->head.find( "\r\n\r\n", old > 3 ? old - 3 : 0 );
+        if ( end == std::string::npos ) {
+            return true;
+        }
+        size_t used = end + 4 - old;
+        data += used;
+        len -= used;
+
+        int status = 0;
+        if ( http10 == 0 ) {
+            status = 200;
+        } else if ( sscanf( c->head.c_str(), "HTTP/%*d.%*d %d", &status ) != 1 ) {
+            w->failed++;
+            return false;
+        }
+        if ( status < 200 || status >= 300 ) {
+            w->non2xx++;
+        }
+        c->body_left = -1;
+        c->server_close = ( http10 < 2 );
+        const char* h = c->head.c_str();
+        for ( const char* line = strstr( h, "\r\n" ); line && line[2] != '\r'; line = strstr( line + 2, "\r\n" ) ) {
+            if ( strncasecmp( line + 2, "Content-Length:", 15 ) == 0 ) {
+                c->body_left = atoll( line + 17 );
+            } else if ( strncasecmp( line + 2, "Connection:", 11 ) == 0 ) {
+                const char* v = line + 13;
+                v += strspn( v, " \t" );
+                c->server_close = ( strncasecmp( v, "close", 5 ) == 0 );
+            }
+        }
+        if ( method == METHOD_HEAD ) {
+            c->body_left = 0;
+        }
+        c->head.clear();
+        c->in_body = true;
+        if ( c->body_left == 0 ) {
+            response_done( w, c, now );
+            if ( c->server_close || !keepalive ) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void conn_readable( worker* w, connection* c ) {
+    char buf[ 65536 ];
+    while ( true ) {
+        ssize_t n = recv( c->fd, buf, sizeof( buf ), 0 );
+        if ( n > 0 ) {
+            w->bytes += n;
+            if ( !conn_parse( w, c, buf, n, now_ns() ) ) {
+                /* 这个连接不能再用了（短连接或服务器要求关闭），换一个新连接 */
+                w->failed += c->sent.size();
+                conn_close( w, c );
+                conn_open( w, c );
+                return;
+            }
+            continue;
+        }
+        if ( n == 0 ) {
+            /* 没有Content-Length的应答以连接关闭为结束 */
+            if ( c->in_body && c->body_left < 0 ) {
+                response_done( w, c, now_ns() );
+                conn_close( w, c );
+                conn_open( w, c );
+            } else {
+                conn_fail( w, c );
+            }
+            return;
+        }
+        if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+            break;
+        }
+        conn_fail( w, c );
+        return;
+    }
+    conn_fill( w, c );
+}
+
+static void conn_event( worker* w, connection* c, uint32_t events ) {
+    if ( c->state == connection::CONNECTING ) {
+        int err = 0;
+        socklen_t len = sizeof( err );
+        getsockopt( c->fd, SOL_SOCKET, SO_ERROR, &err, &len );
+        if ( err != 0 ) {
+            w->failed++;
+            conn_close( w, c );
+            conn_open( w, c );
+            return;
+        }
+        c->state = connection::ACTIVE;
+        conn_watch( w, c, false );
+        conn_fill( w, c );
+        return;
+    }
+    if ( events & EPOLLIN ) {
+        conn_readable( w, c );
+        if ( c->state != connection::ACTIVE ) {
+            return;
+        }
+    }
+    if ( events & ( EPOLLERR | EPOLLHUP ) ) {
+        conn_fail( w, c );
+        return;
+    }
+    if ( events & EPOLLOUT ) {
+        conn_flush( w, c );
+    }
+}
+
+/* 开环：定时器到期，把到了计划时刻的请求放入待发送队列，并设置下一次定时 */
+static void timer_expired( worker* w ) {
+    uint64_t ticks;
+    if ( read( w->timerfd, &ticks, sizeof( ticks ) ) < 0 && errno != EAGAIN ) {
+        return;
+    }
+    int64_t now = now_ns();
+    while ( w->next_due <= now ) {
+        w->pending.push_back( w->next_due );
+        w->next_due += w->interval;
+    }
+    struct itimerspec its;
+    memset( &its, 0, sizeof( its ) );
+    its.it_value.tv_sec = w->next_due / 1000000000LL;
+    its.it_value.tv_nsec = w->next_due % 1000000000LL;
+    timerfd_settime( w->timerfd, TFD_TIMER_ABSTIME, &its, NULL );
+    dispatch_pending( w );
+}
+
+static void* worker_run( void* arg ) {
+    worker* w = ( worker* )arg;
+
+    if ( !cpus.empty() ) {
+        cpu_set_t set;
+        CPU_ZERO( &set );
+        CPU_SET( cpus[ w->id % cpus.size() ], &set );
+        pthread_setaffinity_np( pthread_self(), sizeof( set ), &set );
+    }
+
+    w->epollfd = epoll_create1( EPOLL_CLOEXEC );
+    if ( rate > 0 ) {
+        w->timerfd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+        w->interval = ( int64_t )( 1e9 * threads / rate );
+        if ( w->interval < 1 ) {
+            w->interval = 1;
+        }
+        /* 各线程的发送时刻错开，合起来是均匀的速率 */
+        w->next_due = now_ns() + w->interval * w->id / threads;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl( w->epollfd, EPOLL_CTL_ADD, w->timerfd, &ev );
+        struct itimerspec its;
+        memset( &its, 0, sizeof( its ) );
+        its.it_value.tv_sec = w->next_due / 1000000000LL;
+        its.it_value.tv_nsec = w->next_due % 1000000000LL;
+        timerfd_settime( w->timerfd, TFD_TIMER_ABSTIME, &its, NULL );
+    }
+
+    for ( size_t i = 0; i < w->conns.size(); ++i ) {
+        conn_open( w, &w->conns[i] );
+    }
+
+    struct epoll_event events[ 1024 ];
+    while ( true ) {
+        int64_t now = now_ns();
+        if ( now >= w->end_time ) {
+            break;
+        }
+        int timeout = ( int )( ( w->end_time - now ) / 1000000 ) + 1;
+        int n = epoll_wait( w->epollfd, events, 1024, timeout );
+        for ( int i = 0; i < n; ++i ) {
+            if ( events[i].data.ptr == NULL ) {
+                timer_expired( w );
+            } else {
+                conn_event( w, ( connection* )events[i].data.ptr, events[i].events );
+            }
+        }
+    }
+
+    /* 没有完成的请求至少已经等到了现在 */
+    int64_t end = now_ns();
+    for ( size_t i = 0; i < w->conns.size(); ++i ) {
+        connection* c = &w->conns[i];
+        w->unfinished += c->sent.size();
+        if ( rate > 0 ) {
+            for ( size_t j = 0; j < c->sent.size(); ++j ) {
+                w->corrected.record( ( end - c->sent[j].intended ) / 1000 );
+            }
+        }
+        c->sent.clear();
+        conn_close( w, c );
+    }
+    w->unfinished += w->pending.size();
+    for ( size_t i = 0; i < w->pending.size(); ++i ) {
+        w->corrected.record( ( end - w->pending[i] ) / 1000 );
+    }
+    if ( w->timerfd != -1 ) {
+        close( w->timerfd );
+    }
+    close( w->epollfd );
+    return NULL;
+}
+
+static bool parse_cpus( const char* text ) {
+    const char* p = text;
+    while ( *p ) {
+        char* end;
+        long cpu = strtol( p, &end, 10 );
+        if ( end == p || cpu < 0 || cpu >= CPU_SETSIZE ) {
+            return false;
+        }
+        cpus.push_back( ( int )cpu );
+        p = ( *end == ',' ) ? end + 1 : end;
+        if ( *end && *end != ',' ) {
+            return false;
+        }
+    }
+    return !cpus.empty();
+}
+
+static const double percentiles[] = { 50, 90, 99, 99.9 };
+static const char* percentile_names[] = { "p50", "p90", "p99", "p99.9" };
+
+static void print_latency( const char* title, const hdr_histogram& h ) {
+    printf( "%s (usec): min %lld, mean %.1f, p50 %lld, p90 %lld, p99 %lld, p99.9 %lld, max %lld\n", title,
+            ( long long )h.min(), h.mean(), ( long long )h.value_at_percentile( 50 ),
+            ( long long )h.value_at_percentile( 90 ), ( long long )h.value_at_percentile( 99 ),
+            ( long long )h.value_at_percentile( 99.9 ), ( long long )h.max() );
+}
+
+/* 从服务器的统计端口读取各节点工作队列处理过的请求数，失败返回false */
+static bool read_processed( std::map< int, double >& processed ) {
+    static const char prefix[] = "webserver_workqueue_processed_total{node=\"";
+    struct sockaddr_storage addr = server_addr;
+    if ( addr.ss_family == AF_INET ) {
+        ( ( struct sockaddr_in* )&addr )->sin_port = htons( metrics_port );
+    } else {
+        ( ( struct sockaddr_in6* )&addr )->sin6_port = htons( metrics_port );
+    }
+    int fd = socket( addr.ss_family, SOCK_STREAM, 0 );
+    if ( fd < 0 ) {
+        return false;
+    }
+    std::string response;
+    const char req[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    if ( connect( fd, ( struct sockaddr* )&addr, server_addrlen ) == 0 && write( fd, req, sizeof( req ) - 1 ) == sizeof( req ) - 1 ) {
+        /* 统计端点发完应答就关闭连接 */
+        char buf[ 4096 ];
+        ssize_t n;
+        while ( ( n = read( fd, buf, sizeof( buf ) ) ) > 0 ) {
+            response.append( buf, n );
+        }
+    }
+    close( fd );
+    processed.clear();
+    for ( size_t pos = response.find( prefix ); pos != std::string::npos; pos = response.find( prefix, pos + 1 ) ) {
+        int node = 0;
+        double value = 0;
+        if ( sscanf( response.c_str() + pos + sizeof( prefix ) - 1, "%d\"} %lf", &node, &value ) == 2 ) {
+            processed[ node ] = value;
+        }
+    }
+    return !processed.empty();
+}
+
+int main( int argc, char* argv[] ) {
+    int opt = 0;
+    int options_index = 0;
+
+    if ( argc == 1 ) {
+        usage();
+        return 2;
+    }
+
+    while ( ( opt = getopt_long( argc, argv, "912Vrkt:c:T:P:R:C:M:?h", long_options, &options_index ) ) != EOF ) {
+        switch ( opt ) {
+            case 0: break;
+            case 'r': force_reload = 1; break;
+            case 'k': keepalive = 1; break;
+            case '9': http10 = 0; break;
+            case '1': http10 = 1; break;
+            case '2': http10 = 2; break;
+            case 'V': printf( PROGRAM_VERSION "\n" ); return 0;
+            case 't': benchtime = atoi( optarg ); break;
+            case 'c': clients = atoi( optarg ); break;
+            case 'T': threads = atoi( optarg ); break;
+            case 'P': pipeline = atoi( optarg ); break;
+            case 'R': rate = atof( optarg ); break;
+            case 'C':
+                if ( !parse_cpus( optarg ) ) {
+                    fprintf( stderr, "Error in option --cpus %s.\n", optarg );
+                    return 2;
+                }
+                break;
+            case 'M': metrics_port = atoi( optarg ); break;
+            case ':':
+            case 'h':
+            case '?': usage(); return 2;
+        }
+    }
+
+    if ( optind == argc ) {
+        fprintf( stderr, "loadgen: Missing URL!\n" );
+        usage();
+        return 2;
+    }
+    if ( clients <= 0 || threads <= 0 || benchtime <= 0 || pipeline <= 0 || rate < 0 ) {
+        fprintf( stderr, "loadgen: clients, threads, time and pipeline must be positive.\n" );
+        return 2;
+    }
+    if ( threads > clients ) {
+        threads = clients;
+    }
+    if ( pipeline > 1 && !keepalive ) {
+        fprintf( stderr, "loadgen: --pipeline needs --keepalive.\n" );
+        return 2;
+    }
+    if ( http10 == 0 && keepalive ) {
+        fprintf( stderr, "loadgen: HTTP/0.9 has no keep-alive.\n" );
+        return 2;
+    }
+    if ( !parse_url( argv[ optind ] ) ) {
+        return 2;
+    }
+    build_request();
+
+    struct addrinfo hints;
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* res = NULL;
+    char portstr[ 16 ];
+    snprintf( portstr, sizeof( portstr ), "%d", port );
+    if ( getaddrinfo( host.c_str(), portstr, &hints, &res ) != 0 || !res ) {
+        fprintf( stderr, "Cannot resolve %s.\n", host.c_str() );
+        return 1;
+    }
+    memcpy( &server_addr, res->ai_addr, res->ai_addrlen );
+    server_addrlen = res->ai_addrlen;
+    freeaddrinfo( res );
+
+    /* 先试连一次，服务器不在线就不用压了 */
+    int probe = socket( server_addr.ss_family, SOCK_STREAM, 0 );
+    if ( probe < 0 || connect( probe, ( struct sockaddr* )&server_addr, server_addrlen ) < 0 ) {
+        fprintf( stderr, "\nConnect to server failed. Aborting benchmark.\n" );
+        return 1;
+    }
+    close( probe );
+    signal( SIGPIPE, SIG_IGN );
+
+    printf( "loadgen - epoll HTTP load generator v" PROGRAM_VERSION "\n\n" );
+    printf( "Benchmarking: %s %s", request.substr( 0, request.find( ' ' ) ).c_str(), argv[ optind ] );
+    static const char* versions[] = { " (using HTTP/0.9)", " (using HTTP/1.0)", " (using HTTP/1.1)" };
+    printf( "%s%s\n", versions[ http10 ], keepalive ? ", keep-alive" : "" );
+    printf( "%d clients on %d threads, running %d sec", clients, threads, benchtime );
+    if ( pipeline > 1 ) {
+        printf( ", pipeline depth %d", pipeline );
+    }
+    if ( rate > 0 ) {
+        printf( ", open loop at %.0f req/s", rate );
+    }
+    if ( force_reload ) {
+        printf( ", forcing reload" );
+    }
+    printf( ".\n" );
+
+    std::map< int, double > processed_before, processed_after;
+    if ( metrics_port > 0 && !read_processed( processed_before ) ) {
+        fprintf( stderr, "Cannot read per-socket counters from metrics port %d.\n", metrics_port );
+        metrics_port = 0;
+    }
+
+    std::vector< worker > workers( threads );
+    int64_t start = now_ns();
+    for ( int i = 0; i < threads; ++i ) {
+        workers[i].id = i;
+        workers[i].end_time = start + benchtime * 1000000000LL;
+        workers[i].conns.resize( clients / threads + ( i < clients % threads ? 1 : 0 ) );
+        if ( pthread_create( &workers[i].tid, NULL, worker_run, &workers[i] ) != 0 ) {
+            fprintf( stderr, "pthread_create failed.\n" );
+            return 3;
+        }
+    }
+
+    hdr_histogram latency, corrected;
+    int64_t completed = 0, failed = 0, bytes = 0, non2xx = 0, unfinished = 0;
+    for ( int i = 0; i < threads; ++i ) {
+        pthread_join( workers[i].tid, NULL );
+        latency.merge( workers[i].latency );
+        corrected.merge( workers[i].corrected );
+        unfinished += workers[i].unfinished;
+        completed += workers[i].completed;
+        failed += workers[i].failed;
+        bytes += workers[i].bytes;
+        non2xx += workers[i].non2xx;
+    }
+    double secs = ( now_ns() - start ) / 1e9;
+    if ( metrics_port > 0 && !read_processed( processed_after ) ) {
+        metrics_port = 0;
+    }
+
+    printf( "\nSpeed=%lld pages/min, %lld bytes/sec.\n", ( long long )( completed * 60 / secs ), ( long long )( bytes / secs ) );
+    printf( "Requests: %lld susceed, %lld failed, %lld non-2xx.\n", ( long long )completed, ( long long )failed, ( long long )non2xx );
+    printf( "Throughput: %.1f req/s\n", completed / secs );
+    if ( rate > 0 ) {
+        printf( "Unfinished: %lld requests still queued or in flight at the end.\n", ( long long )unfinished );
+        print_latency( "Latency corrected", corrected );
+        print_latency( "Latency uncorrected", latency );
+        /* 差值越大，说明请求在客户端等待空闲连接的时间越长，即服务器有卡顿 */
+        printf( "Coordinated omission (corrected - uncorrected, usec):" );
+        for ( size_t i = 0; i < sizeof( percentiles ) / sizeof( percentiles[0] ); ++i ) {
+            printf( "%s %s %lld", i ? "," : "", percentile_names[i],
+                    ( long long )( corrected.value_at_percentile( percentiles[i] ) - latency.value_at_percentile( percentiles[i] ) ) );
+        }
+        printf( ", max %lld\n", ( long long )( corrected.max() - latency.max() ) );
+    } else {
+        print_latency( "Latency", latency );
+    }
+    if ( threads > 1 ) {
+        for ( int i = 0; i < threads; ++i ) {
+            printf( "  thread %d%s: %.1f req/s, p99 %lld usec\n", i,
+                    cpus.empty() ? "" : ( " (cpu " + std::to_string( cpus[ i % cpus.size() ] ) + ")" ).c_str(),
+                    workers[i].completed / secs, ( long long )workers[i].latency.value_at_percentile( 99 ) );
+        }
+    }
+    /* 服务器端按处理请求的工作队列所在的节点统计，包括其他客户端的请求 */
+    for ( std::map< int, double >::iterator it = processed_after.begin(); it != processed_after.end(); ++it ) {
+        printf( "  socket %d: %.1f req/s\n", it->first, ( it->second - processed_before[ it->first ] ) / secs );
+    }
+    return completed > 0 ? 0 : 1;
+}
@@ -1,69 +1,268 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
-#include <list>
+#include <vector>
+#include <atomic>
 #include <cstdio>
 #include <exception>
 #include <pthread.h>  //线程
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <algorithm>
 #include "locker.h"
+#include "notifier.h"
+#include "affinity.h"
+#include "overload.h"
+#include "tsc.h"
 
 // 线程池类，将它定义为模板类是为了代码复用，模板参数T是任务类
+// T需要提供process()处理任务，以及shed()在过载时不处理任务、直接拒绝
 template<typename T>
 class threadpool {
 public:
-    /*thread_number是线程池中线程的数量，max_requests是请求队列中最多允许的、等待处理的请求的数量*/
-    threadpool(int thread_number = 8, int max_requests = 10000);
+    /*thread_number是线程池启动时线程的数量，max_requests是每个请求队列中最多允许的、等待处理的请求的数量
+      cpus非空时，第i个线程绑定到cpus[i % cpus.size()]上，并且每个用到的NUMA节点有一个自己的请求队列，
+      只由该节点上的线程处理，避免请求队列和任务对象在节点之间来回迁移
+      max_threads是开启自适应线程数之后线程数的上限，0表示等于thread_number*/
+    threadpool(int thread_number = 8, int max_requests = 10000, const std::vector<int>& cpus = std::vector<int>(),
+               int max_threads = 0);
     ~threadpool();
-    bool append(T* request);  //通过append添加任务
+    //通过append添加任务，node是最好处理该任务的NUMA节点，lane是优先级通道。队列满时返回false
+    bool append(T* request, int node = 0, int lane = 0);
+    // 一次添加count个任务，每个请求队列只加一次锁。nodes、lanes为NULL时都按节点0、通道0。
+    // 队列满而没能添加的任务按原来的顺序放进rejected（至少能放下count个），返回它们的个数
+    int append_batch(T* const* requests, const int* nodes, const int* lanes, int count, T** rejected);
+    /*优先级通道：每个请求队列分成weights.size()个通道，各自先进先出，工作线程按权重轮流从非空的通道取任务
+      （平滑加权轮询），如权重 {8, 1} 时通道1的任务积压时也只占九分之一的处理机会。排队时间限制在每个通道上分别计算。
+      默认只有一个通道。在添加任务之前调用，权重都要大于0，最多MAX_LANES个*/
+    bool set_lanes(const std::vector<int>& weights);
+    int lane_number() const { return m_lane_number; }
+    // 请求排队时间持续高于target_usec时丢弃一部分请求（调用它们的shed），0表示不丢弃。在添加任务之前调用
+    void set_queue_delay_limit(int64_t target_usec, int64_t interval_usec);
+    /*自适应线程数：管理线程每tick_usec检查一次各请求队列，
+      - 平均排队时间（或者队首任务已经等待的时间）超过grow_delay_usec，或者线程都在忙、并且一半以上的时间阻塞在
+        CPU之外（stat、缺页等），增加线程，每次最多增加现有的四分之一，总数不超过max_threads
+      - 空闲的线程多于一个半、排队时间低于grow_delay_usec的一半，连续SHRINK_TICKS次之后每次减少空闲线程的四分之一，
+        不少于min_threads
+      min_threads不小于max_threads时不开启。在构造之后、添加任务之前调用一次*/
+    bool set_adaptive(int min_threads, int64_t grow_delay_usec, int64_t tick_usec = 100000);
+    void stop();                            //停止并等待所有线程退出，析构时也会调用
+    int queue_number() const { return m_queue_number; }     // 请求队列的个数，即用到的NUMA节点个数
+    int queue_node(int i) const { return m_queues[i].m_node; }
+    unsigned long processed(int i) const { return m_queues[i].m_processed; }  // 第i个队列处理过的任务数
+    size_t queue_size(int i);                                                 // 第i个队列中等待处理的任务数
+    size_t lane_size(int i, int lane);                                        // 第i个队列的一个通道中等待的任务数
+    unsigned long lane_dequeued(int i, int lane) const { return m_queues[i].m_lane_dequeued[lane]; }  // 从通道中取出的任务数
+    unsigned long shed(int i) const { return m_queues[i].m_shed; }            // 第i个队列因排队太久而丢弃的任务数
+    unsigned long rejected(int i) const { return m_queues[i].m_rejected; }    // 第i个队列满时没能添加的任务数
+    unsigned long dequeues(int i) const { return m_queues[i].m_dequeues; }    // 第i个队列上工作线程取任务的次数，每次取出一批
+
+    // 增加线程的原因：排队时间超过阈值；线程都在忙并且大部分时间阻塞
+    enum GROW_REASON { GROW_DELAY = 0, GROW_BLOCKED, GROW_REASONS };
+    bool adaptive() const { return m_manager_started; }
+    int threads(int i) const { return m_queues[i].m_threads; }                // 第i个队列当前的线程数
+    unsigned long grown(int i, int reason) const { return m_queues[i].m_grown[reason]; }  // 增加过的线程数
+    unsigned long shrunk(int i) const { return m_queues[i].m_shrunk; }        // 减少过的线程数
+    int64_t queue_delay(int i) const { return m_queues[i].m_delay; }          // 上一次检查时的排队时间（微秒）
+    int blocked_permille(int i) const { return m_queues[i].m_blocked; }       // 上一次检查时忙碌时间中阻塞的比例（千分之）
+
+    static const int MAX_BATCH = 16;        // 工作线程一次最多取出的任务数
+    static const int MAX_LANES = 4;         // 优先级通道的最大个数
+    static const int SHRINK_TICKS = 30;     // 连续空闲多少次检查之后减少线程
 
 
 private:
+    // 一个请求队列，由同一个NUMA节点上的线程处理
+    struct queued {
+        T* m_request;
+        int64_t m_enqueued;           // 入队时刻（微秒），用于CoDel和统计排队时间
+    };
+    // 一个通道的请求队列，循环数组实现。容量在添加任务之前分配好（一个请求队列中最多有m_max_requests + 1个任务，
+    // 见append），之后入队、出队都不再分配内存
+    struct lane_queue {
+        std::vector< queued > m_items;
+        size_t m_head;                // 队首的下标
+        size_t m_count;               // 通道中的任务数
+        lane_queue() : m_head(0), m_count(0) {}
+        bool empty() const { return m_count == 0; }
+        size_t size() const { return m_count; }
+        const queued& front() const { return m_items[ m_head ]; }
+        void push_back( const queued& item ) {
+            size_t tail = m_head + m_count;
+            m_items[ tail < m_items.size() ? tail : tail - m_items.size() ] = item;
+            ++m_count;
+        }
+        void pop_front() {
+            m_head = m_head + 1 < m_items.size() ? m_head + 1 : 0;
+            --m_count;
+        }
+    };
+    struct work_queue {
+        lane_queue m_lanes[ MAX_LANES ];            // 每个优先级通道的请求队列
+        size_t m_size;                // 所有通道中的任务数
+        int m_credit[ MAX_LANES ];    // 平滑加权轮询中各通道当前的积分
+        locker m_queuelocker;         // 保护请求队列、m_codel和排队时间统计的互斥锁
+        notifier m_queuestat;         // 是否有任务需要处理，计数是队列中的任务数加上等待退出的线程数
+        int m_node;                   // 所属的NUMA节点
+        codel m_codel[ MAX_LANES ];   // 每个通道按排队时间丢弃请求
+        std::atomic< unsigned long > m_lane_dequeued[ MAX_LANES ];
+        int64_t m_delay_sum;          // 上次检查以来取出的任务的排队时间之和（微秒）
+        unsigned long m_delay_count;  // 上次检查以来取出的任务数
+        std::atomic< unsigned long > m_processed;   // 处理过的任务数
+        std::atomic< unsigned long > m_shed;        // 丢弃的任务数
+        std::atomic< unsigned long > m_rejected;    // 队列满时没能添加的任务数
+        std::atomic< unsigned long > m_dequeues;    // 取任务的次数
+        std::atomic< int > m_threads; // 处理这个队列的线程数
+        std::atomic< int > m_retire;  // 管理线程要求退出、还没有退出的线程数
+        std::atomic< unsigned long > m_grown[ GROW_REASONS ];
+        std::atomic< unsigned long > m_shrunk;
+        std::atomic< int64_t > m_delay;
+        std::atomic< int > m_blocked;
+        int m_calm_ticks;             // 连续空闲的检查次数，只由管理线程使用
+        int m_cpus;                   // 这个队列的线程可以使用的CPU数
+        work_queue() : m_size(0), m_node(0), m_delay_sum(0), m_delay_count(0), m_processed(0), m_shed(0), m_rejected(0),
+                       m_dequeues(0), m_threads(0), m_retire(0), m_shrunk(0), m_delay(0), m_blocked(0), m_calm_ticks(0), m_cpus(1) {
+            for ( int i = 0; i < GROW_REASONS; ++i ) {
+                m_grown[i] = 0;
+            }
+            for ( int i = 0; i < MAX_LANES; ++i ) {
+                m_credit[i] = 0;
+                m_lane_dequeued[i] = 0;
+            }
+        }
+    };
+    // 线程槽的状态：没有线程；线程在运行；线程已经退出、等待回收
+    enum SLOT_STATE { SLOT_EMPTY = 0, SLOT_RUNNING, SLOT_EXITED };
+    // 传给工作线程的参数，每个线程槽一个
+    struct worker_arg {
+        threadpool* m_pool;
+        work_queue* m_queue;
+        int m_cpu;                          // 绑定的CPU，-1表示不绑定
+        std::atomic< int > m_state;
+        std::atomic< uint64_t > m_busy;     // 处理任务的累计时间（TSC计数）
+        std::atomic< int > m_tid;           // 线程ID，线程启动后设置，0表示还不知道
+        bool m_has_clock;
+        clockid_t m_clock;                  // 线程的CPU时间时钟，读不到schedstat时使用
+        uint64_t m_last_busy;               // 管理线程上次读到的m_busy
+        int64_t m_last_ready;               // 管理线程上次读到的在CPU上运行和等待CPU的累计时间（微秒），-1表示没有
+        worker_arg() : m_pool(NULL), m_queue(NULL), m_cpu(-1), m_state(SLOT_EMPTY), m_busy(0), m_tid(0), m_has_clock(false),
+                       m_clock(0), m_last_busy(0), m_last_ready(-1) {}
+    };
+
     /*工作线程运行的函数，它不断从工作队列中取出任务并执行之*/
     static void* worker(void* arg);
-    void run();    //启动线程池
+    void run(worker_arg* self);     //启动线程池
+    bool retire(work_queue* queue); // 管理线程要求这个队列减少线程时返回true，调用的线程应当退出
+    work_queue* queue_of(int node); // 节点对应的请求队列
+    queued take(work_queue* queue, int& lane);  // 按权重选一个非空的通道取出队首的任务，调用者持有锁并保证队列非空
+    bool start_thread(int i);       // 在第i个线程槽上创建线程
+    static void* manager(void* arg);
+    void adjust(int64_t elapsed, int64_t now);  // 管理线程的一次检查，elapsed是距上次检查的微秒数
+    int grow(work_queue* queue, int n);         // 为队列增加至多n个线程，返回增加的个数
+    int64_t ready_time(worker_arg* arg);        // 线程在CPU上运行和等待CPU的累计时间（微秒），读不到时返回-1
 
     
-    int m_thread_number;          // 线程的数量
-    pthread_t * m_threads;        // 描述线程池的数组，大小为m_thread_number      
-    int m_max_requests;           // 请求队列中最多允许的、等待处理的请求的数量  
-    std::list< T* > m_workqueue;  // 请求队列
-    locker m_queuelocker;         // 保护请求队列的互斥锁   
-    sem m_queuestat;              // 是否有任务需要处理
+    int m_max_threads;            // 线程槽的数量，即线程数的上限
+    pthread_t * m_threads;        // 描述线程池的数组，大小为m_max_threads
+    worker_arg * m_args;          // 每个线程的参数
+    std::atomic< int > m_running; // 正在运行的线程数
+    int m_max_requests;           // 每个请求队列中最多允许的、等待处理的请求的数量  
+    int m_queue_number;           // 请求队列的个数
+    work_queue * m_queues;        // 请求队列，每个NUMA节点一个
+    std::vector< int > m_node_queue;    // NUMA节点 -> 请求队列下标
+    int m_lane_number;            // 优先级通道的个数
+    int m_weights[ MAX_LANES ];   // 各通道的权重
+
+    // 自适应线程数
+    bool m_manager_started;
+    pthread_t m_manager;          // 管理线程
+    notifier m_manager_wake;      // stop时唤醒管理线程
+    int m_min_threads;
+    int64_t m_grow_delay;         // 微秒
+    int64_t m_tick;               // 微秒
 
     // 是否结束线程          
-    bool m_stop;                    
+    std::atomic< bool > m_stop;                    
 };
 
 
 //构造函数
 template< typename T >
-threadpool< T >::threadpool(int thread_number, int max_requests) : 
-        m_thread_number(thread_number), m_max_requests(max_requests), m_stop(false), m_threads(NULL) {
-    if((thread_number <= 0) || (max_requests <= 0) ) {
+threadpool< T >::threadpool(int thread_number, int max_requests, const std::vector<int>& cpus, int max_threads) : 
+        m_max_threads(max_threads > 0 ? max_threads : thread_number), m_threads(NULL), m_args(NULL), m_running(0),
+        m_max_requests(max_requests), m_queue_number(1), m_queues(NULL), m_lane_number(1), m_manager_started(false),
+        m_min_threads(thread_number), m_grow_delay(0), m_tick(0), m_stop(false) {
+    if((thread_number <= 0) || (max_requests <= 0) || (m_max_threads < thread_number) ) {
         throw std::exception();
     }
+    for ( int i = 0; i < MAX_LANES; ++i ) {
+        m_weights[i] = 1;
+    }
 
-    m_threads = new pthread_t[m_thread_number];
-    if(!m_threads) {
-        throw std::exception();
+    // 按照线程绑定的CPU所在的NUMA节点划分请求队列；不绑定CPU时只有一个队列。
+    // 之后增加的线程也按所在的线程槽绑定CPU，所以按线程数的上限计算
+    std::vector< int > thread_node( m_max_threads, 0 );
+    std::vector< int > nodes;
+    for ( int i = 0; i < m_max_threads && !cpus.empty(); ++i ) {
+        thread_node[i] = cpu_to_node( cpus[ i % cpus.size() ] );
+        bool found = false;
+        for ( size_t j = 0; j < nodes.size(); ++j ) {
+            found = found || nodes[j] == thread_node[i];
+        }
+        if ( !found ) {
+            nodes.push_back( thread_node[i] );
+        }
+    }
+    if ( nodes.empty() ) {
+        nodes.push_back( 0 );
+    }
+    m_queue_number = nodes.size();
+    m_queues = new work_queue[ m_queue_number ];
+    int max_node = 0;
+    for ( int i = 0; i < m_queue_number; ++i ) {
+        m_queues[i].m_node = nodes[i];
+        m_queues[i].m_lanes[0].m_items.resize( m_max_requests + 1 );
+        max_node = nodes[i] > max_node ? nodes[i] : max_node;
+    }
+    // 没有工作线程的节点上来的任务，分散到其他队列
+    m_node_queue.resize( max_node + 1 );
+    for ( int node = 0; node <= max_node; ++node ) {
+        m_node_queue[node] = node % m_queue_number;
+        for ( int i = 0; i < m_queue_number; ++i ) {
+            if ( nodes[i] == node ) {
+                m_node_queue[node] = i;
+            }
+        }
+    }
+
+    m_threads = new pthread_t[m_max_threads];
+    m_args = new worker_arg[m_max_threads];
+    for ( int i = 0; i < m_max_threads; ++i ) {
+        m_args[i].m_pool = this;
+        m_args[i].m_queue = m_queues + m_node_queue[ thread_node[i] ];
+        m_args[i].m_cpu = cpus.empty() ? -1 : cpus[ i % cpus.size() ];
+    }
+    // 每个队列的线程绑定的不同CPU的个数，不绑定时是所有在线的CPU
+    for ( int q = 0; q < m_queue_number; ++q ) {
+        std::vector< int > used;
+        for ( int i = 0; i < m_max_threads && !cpus.empty(); ++i ) {
+            if ( m_args[i].m_queue == m_queues + q && std::find( used.begin(), used.end(), m_args[i].m_cpu ) == used.end() ) {
+                used.push_back( m_args[i].m_cpu );
+            }
+        }
+        long online = sysconf( _SC_NPROCESSORS_ONLN );
+        m_queues[q].m_cpus = !used.empty() ? used.size() : ( online > 0 ? online : 1 );
     }
 
-    /*
-    int pthread_create(pthread_t* thread, const pthread_attr_t* attr, void*(*start_routine)(void*), void* arg);
-    调用成功返回0，失败时返回错误码。
-    - thread参数：新线程的标识符，数据类型为长整型
-    - attr参数：用于设置新线程的属性，NULL表示使用默认线程属性
-    */
-    // 创建thread_number 个线程，并将他们设置为脱离线程。
+    // 创建thread_number 个线程。线程不再分离，析构时等待它们全部退出
     for ( int i = 0; i < thread_number; ++i ) {
         printf( "创建第%d个线程:\n", i);
-        if(pthread_create(m_threads + i, NULL, worker, this ) != 0) {  //创建出错
-            delete [] m_threads;
-            throw std::exception();
-        }
-        //创建成功，设置线程分离
-        if( pthread_detach( m_threads[i] ) ) {
+        if ( !start_thread( i ) ) {     //创建出错，先让已经创建的线程退出
+            stop();
             delete [] m_threads;
+            delete [] m_args;
+            delete [] m_queues;
             throw std::exception();
         }
     }
@@ -73,53 +272,486 @@ threadpool< T >::threadpool(int thread_number, int max_requests) :
 //析构函数
 template< typename T >
 threadpool< T >::~threadpool() {
+    stop();
     delete [] m_threads;
-    m_stop = true;
+    delete [] m_args;
+    delete [] m_queues;
+}
+
+// 通知所有线程退出并等待它们结束。线程把手上的任务做完才会退出，队列中剩下的任务不再处理
+template< typename T >
+void threadpool< T >::stop() {
+    if ( m_stop.exchange( true ) ) {
+        return;
+    }
+    // 先停管理线程，之后线程数不再变化
+    if ( m_manager_started ) {
+        m_manager_wake.post();
+        pthread_join( m_manager, NULL );
+    }
+    // 每个线程都可能阻塞在自己队列的信号量上，各唤醒一次。先数出每个队列的线程数再post，
+    // 边数边post时先被唤醒的线程会在数到它之前就退出，少post一次
+    std::vector< int > running( m_queue_number, 0 );
+    for ( int i = 0; i < m_max_threads; ++i ) {
+        if ( m_args[i].m_state == SLOT_RUNNING ) {
+            running[ m_args[i].m_queue - m_queues ]++;
+        }
+    }
+    for ( int q = 0; q < m_queue_number; ++q ) {
+        m_queues[q].m_queuestat.post( running[q] );
+    }
+    for ( int i = 0; i < m_max_threads; ++i ) {
+        if ( m_args[i].m_state != SLOT_EMPTY ) {
+            pthread_join( m_threads[i], NULL );
+            m_args[i].m_state = SLOT_EMPTY;
+        }
+    }
+}
+
+
+/*
+int pthread_create(pthread_t* thread, const pthread_attr_t* attr, void*(*start_routine)(void*), void* arg);
+调用成功返回0，失败时返回错误码。
+- thread参数：新线程的标识符，数据类型为长整型
+- attr参数：用于设置新线程的属性，NULL表示使用默认线程属性
+*/
+template< typename T >
+bool threadpool< T >::start_thread( int i ) {
+    worker_arg* arg = m_args + i;
+    // 需要绑定CPU时，在线程创建前设置好亲和性
+    pthread_attr_t attr;
+    pthread_attr_init( &attr );
+    if ( arg->m_cpu >= 0 && !set_attr_cpu( &attr, arg->m_cpu ) ) {
+        pthread_attr_destroy( &attr );
+        return false;
+    }
+    arg->m_busy = 0;
+    arg->m_last_busy = 0;
+    arg->m_last_ready = -1;
+    arg->m_tid = 0;
+    arg->m_state = SLOT_RUNNING;
+    arg->m_queue->m_threads++;
+    m_running++;
+    int ret = pthread_create( m_threads + i, &attr, worker, arg );
+    pthread_attr_destroy( &attr );
+    if ( ret != 0 ) {
+        arg->m_state = SLOT_EMPTY;
+        arg->m_queue->m_threads--;
+        m_running--;
+        return false;
+    }
+    // 没有schedstat时管理线程用它算出线程不在CPU上的时间
+    arg->m_has_clock = pthread_getcpuclockid( m_threads[i], &arg->m_clock ) == 0;
+    return true;
+}
+
+
+template< typename T >
+typename threadpool< T >::work_queue* threadpool< T >::queue_of( int node ) {
+    if ( node >= 0 && node < ( int )m_node_queue.size() ) {
+        return m_queues + m_node_queue[node];
+    }
+    return m_queues;
 }
 
 
 //往队列中添加任务
 template< typename T >
-bool threadpool< T >::append( T* request ) {
+bool threadpool< T >::append( T* request, int node, int lane ) {
+    work_queue* queue = queue_of( node );
+    lane = lane >= 0 && lane < m_lane_number ? lane : m_lane_number - 1;
     // 操作工作队列时一定要加锁，因为它被所有线程共享。
-    m_queuelocker.lock();
-    if ( m_workqueue.size() > m_max_requests ) {
-        m_queuelocker.unlock();
+    queue->m_queuelocker.lock();
+    if ( queue->m_size > ( size_t )m_max_requests ) {
+        queue->m_queuelocker.unlock();
+        queue->m_rejected.fetch_add( 1, std::memory_order_relaxed );
         return false;
     }
-    m_workqueue.push_back(request);
-    m_queuelocker.unlock();
-    m_queuestat.post();  //信号量增加
+    queued item;
+    item.m_request = request;
+    item.m_enqueued = tsc::to_usec( tsc::now() );
+    queue->m_lanes[lane].push_back(item);
+    queue->m_size++;
+    queue->m_queuelocker.unlock();
+    queue->m_queuestat.post();  //计数增加，有线程在等待时唤醒一个
     return true;
 }
 
 
-//子线程需要执行的代码  通过参数arg
+// 一次epoll_wait返回的所有请求一起添加：锁外先数出每个通道的任务数，加锁后一次放进各通道的队尾
 template< typename T >
-void* threadpool< T >::worker( void* arg ) {
+int threadpool< T >::append_batch( T* const* requests, const int* nodes, const int* lanes, int count, T** rejected ) {
+    int rejected_count = 0;
+    for ( int q = 0; q < m_queue_number; ++q ) {
+        work_queue* queue = m_queues + q;
+        size_t wanted[ MAX_LANES ] = { 0 };
+        size_t total = 0;
+        for ( int i = 0; i < count; ++i ) {
+            if ( queue_of( nodes ? nodes[i] : 0 ) == queue ) {
+                int lane = lanes ? lanes[i] : 0;
+                wanted[ lane >= 0 && lane < m_lane_number ? lane : m_lane_number - 1 ]++;
+                ++total;
+            }
+        }
+        if ( total == 0 ) {
+            continue;
+        }
+        queued item;
+        item.m_enqueued = tsc::to_usec( tsc::now() );
+        // 和append一样，队列中已有的任务超过m_max_requests时不再添加，放不下时先保证高优先级的通道
+        queue->m_queuelocker.lock();
+        size_t room = queue->m_size > ( size_t )m_max_requests ? 0 : m_max_requests + 1 - queue->m_size;
+        size_t added = 0;
+        size_t quota[ MAX_LANES ];
+        for ( int lane = 0; lane < m_lane_number; ++lane ) {
+            quota[lane] = wanted[lane] < room - added ? wanted[lane] : room - added;
+            added += quota[lane];
+        }
+        // 各通道中排在前面的quota个任务放进队列，其余的按原来的顺序返回
+        for ( int i = 0; i < count; ++i ) {
+            if ( queue_of( nodes ? nodes[i] : 0 ) != queue ) {
+                continue;
+            }
+            int lane = lanes ? lanes[i] : 0;
+            lane = lane >= 0 && lane < m_lane_number ? lane : m_lane_number - 1;
+            if ( quota[lane] > 0 ) {
+                item.m_request = requests[i];
+                queue->m_lanes[lane].push_back( item );
+                quota[lane]--;
+            } else {
+                rejected[ rejected_count++ ] = requests[i];
+            }
+        }
+        queue->m_size += added;
+        queue->m_queuelocker.unlock();
+        queue->m_queuestat.post( added );
+        queue->m_rejected.fetch_add( total - added, std::memory_order_relaxed );
+    }
+    return rejected_count;
+}
+
+
+template< typename T >
+bool threadpool< T >::set_lanes( const std::vector< int >& weights ) {
+    if ( weights.empty() || weights.size() > ( size_t )MAX_LANES ) {
+        return false;
+    }
+    for ( size_t i = 0; i < weights.size(); ++i ) {
+        if ( weights[i] <= 0 ) {
+            return false;
+        }
+    }
+    for ( size_t i = 0; i < weights.size(); ++i ) {
+        m_weights[i] = weights[i];
+        for ( int q = 0; q < m_queue_number; ++q ) {
+            m_queues[q].m_lanes[i].m_items.resize( m_max_requests + 1 );
+        }
+    }
+    m_lane_number = weights.size();
+    return true;
+}
+
+
+// 平滑加权轮询：每次给非空的通道加上各自的权重，取积分最高的，再从它的积分中减去这些通道的权重之和。
+// 空的通道积分清零，空闲过的通道不会因为积攒了积分而连续占用工作线程
+template< typename T >
+typename threadpool< T >::queued threadpool< T >::take( work_queue* queue, int& lane ) {
+    int best = -1;
+    int total = 0;
+    for ( int i = 0; i < m_lane_number; ++i ) {
+        if ( queue->m_lanes[i].empty() ) {
+            queue->m_credit[i] = 0;
+            continue;
+        }
+        queue->m_credit[i] += m_weights[i];
+        total += m_weights[i];
+        if ( best < 0 || queue->m_credit[i] > queue->m_credit[best] ) {
+            best = i;
+        }
+    }
+    queue->m_credit[best] -= total;
+    lane = best;
+    queued item = queue->m_lanes[best].front();
+    queue->m_lanes[best].pop_front();
+    queue->m_size--;
+    return item;
+}
+
+
+template< typename T >
+void threadpool< T >::set_queue_delay_limit( int64_t target_usec, int64_t interval_usec ) {
+    for ( int i = 0; i < m_queue_number; ++i ) {
+        for ( int lane = 0; lane < MAX_LANES; ++lane ) {
+            m_queues[i].m_codel[lane].set( target_usec, interval_usec );
+        }
+    }
+}
+
+
+template< typename T >
+size_t threadpool< T >::queue_size( int i ) {
+    m_queues[i].m_queuelocker.lock();
+    size_t size = m_queues[i].m_size;
+    m_queues[i].m_queuelocker.unlock();
+    return size;
+}
+
+
+template< typename T >
+size_t threadpool< T >::lane_size( int i, int lane ) {
+    m_queues[i].m_queuelocker.lock();
+    size_t size = m_queues[i].m_lanes[lane].size();
+    m_queues[i].m_queuelocker.unlock();
+    return size;
+}
+
+
+template< typename T >
+bool threadpool< T >::set_adaptive( int min_threads, int64_t grow_delay_usec, int64_t tick_usec ) {
+    if ( m_manager_started || min_threads >= m_max_threads || min_threads <= 0 ) {
+        return false;
+    }
+    m_min_threads = min_threads < m_queue_number ? m_queue_number : min_threads;
+    m_grow_delay = grow_delay_usec > 0 ? grow_delay_usec : 1;
+    m_tick = tick_usec >= 1000 ? tick_usec : 1000;
+    if ( pthread_create( &m_manager, NULL, manager, this ) != 0 ) {
+        return false;
+    }
+    m_manager_started = true;
+    return true;
+}
+
+
+template< typename T >
+void* threadpool< T >::manager( void* arg ) {
     threadpool* pool = ( threadpool* )arg;
-    pool->run();
+    int64_t last = tsc::to_usec( tsc::now() );
+    // 只有stop会post，超时就做一次检查
+    while ( !pool->m_manager_wake.wait( pool->m_tick / 1000 ) ) {
+        int64_t now = tsc::to_usec( tsc::now() );
+        pool->adjust( now - last, now );
+        last = now;
+    }
     return pool;
 }
 
 
 template< typename T >
-void threadpool< T >::run() {
-    while (!m_stop) {
-        m_queuestat.wait();  //取一个任务
-        m_queuelocker.lock();
-        if ( m_workqueue.empty() ) {
-            m_queuelocker.unlock();
+void threadpool< T >::adjust( int64_t elapsed, int64_t now ) {
+    if ( elapsed <= 0 ) {
+        return;
+    }
+    // 回收已经退出的线程，释放它们的栈
+    for ( int i = 0; i < m_max_threads; ++i ) {
+        if ( m_args[i].m_state == SLOT_EXITED ) {
+            pthread_join( m_threads[i], NULL );
+            m_args[i].m_state = SLOT_EMPTY;
+        }
+    }
+    // 不算已经要求退出的线程
+    int live = m_running;
+    for ( int q = 0; q < m_queue_number; ++q ) {
+        live -= m_queues[q].m_retire;
+    }
+
+    for ( int q = 0; q < m_queue_number; ++q ) {
+        work_queue* queue = m_queues + q;
+        queue->m_queuelocker.lock();
+        int64_t delay = queue->m_delay_count ? queue->m_delay_sum / ( int64_t )queue->m_delay_count : 0;
+        // 线程全都阻塞时没有任务出队，看各通道的队首已经等了多久
+        for ( int lane = 0; lane < m_lane_number; ++lane ) {
+            if ( !queue->m_lanes[lane].empty() && now - queue->m_lanes[lane].front().m_enqueued > delay ) {
+                delay = now - queue->m_lanes[lane].front().m_enqueued;
+            }
+        }
+        bool waiting = queue->m_size > 0;
+        queue->m_delay_sum = 0;
+        queue->m_delay_count = 0;
+        queue->m_queuelocker.unlock();
+
+        // 各线程这段时间内处理任务的时间，以及其中阻塞的时间：忙碌时间减去这段时间内在CPU上运行和排队等待CPU的时间，
+        // 剩下的是睡眠在stat、缺页、磁盘读等上面的时间。CPU不够用时线程排队等待CPU不算阻塞
+        int64_t busy = 0;
+        int64_t blocked = 0;
+        for ( int i = 0; i < m_max_threads; ++i ) {
+            worker_arg* arg = m_args + i;
+            if ( arg->m_queue != queue || arg->m_state != SLOT_RUNNING ) {
+                continue;
+            }
+            uint64_t ticks = arg->m_busy.load( std::memory_order_relaxed );
+            int64_t busy_usec = tsc::to_usec( ticks - arg->m_last_busy );
+            arg->m_last_busy = ticks;
+            int64_t ready = ready_time( arg );
+            if ( ready >= 0 && arg->m_last_ready >= 0 && busy_usec > ready - arg->m_last_ready ) {
+                blocked += busy_usec - ( ready - arg->m_last_ready );
+            }
+            arg->m_last_ready = ready;
+            busy += busy_usec;
+        }
+        int threads = queue->m_threads - queue->m_retire;
+        queue->m_delay = delay;
+        queue->m_blocked = busy > 0 ? ( int )( blocked * 1000 / busy ) : 0;
+
+        // 线程不多于CPU时排队说明线程不够；线程比CPU多时，只有线程大部分时间阻塞着，增加线程才有用
+        bool mostly_blocked = busy > 0 && blocked * 2 >= busy;
+        bool saturated = waiting && busy * 10 >= elapsed * threads * 9;
+        bool short_of_cpus = delay > m_grow_delay && threads < queue->m_cpus;
+        bool short_of_blocked = mostly_blocked && ( delay > m_grow_delay || saturated );
+        if ( short_of_cpus || short_of_blocked ) {
+            queue->m_calm_ticks = 0;
+            int n = threads / 4 > 1 ? threads / 4 : 1;
+            n = n < m_max_threads - live ? n : m_max_threads - live;
+            if ( n > 0 ) {
+                n = grow( queue, n );
+                live += n;
+                queue->m_grown[ short_of_blocked ? GROW_BLOCKED : GROW_DELAY ] += n;
+            }
             continue;
         }
-        T* request = m_workqueue.front();
-        m_workqueue.pop_front();
-        m_queuelocker.unlock();
-        if ( !request ) {     //任务为空
+        // 空闲超过一个半线程的时间，排队时间也远低于阈值。持续SHRINK_TICKS次之后，每次减少空闲线程的四分之一，
+        // 直到不再满足条件
+        int64_t idle = ( threads * elapsed - busy ) / elapsed;
+        if ( delay * 2 < m_grow_delay && threads * elapsed - busy > elapsed * 3 / 2 ) {
+            ++queue->m_calm_ticks;
+        } else {
+            queue->m_calm_ticks = 0;
+        }
+        if ( queue->m_calm_ticks >= SHRINK_TICKS ) {
+            int n = idle / 4 > 1 ? idle / 4 : 1;
+            n = n < threads - 1 ? n : threads - 1;
+            n = n < live - m_min_threads ? n : live - m_min_threads;
+            if ( n > 0 ) {
+                queue->m_retire += n;
+                queue->m_queuestat.post( n );   // 唤醒空闲的线程让它们退出
+                queue->m_shrunk += n;
+                live -= n;
+            }
+        }
+    }
+}
+
+
+// 优先读 /proc/self/task/<tid>/schedstat，它的前两项是在CPU上运行的时间和在运行队列中等待的时间（纳秒）。
+// 内核没有开启schedstat时退回到线程的CPU时钟，这时等待CPU的时间也会被算作阻塞
+template< typename T >
+int64_t threadpool< T >::ready_time( worker_arg* arg ) {
+    int tid = arg->m_tid;
+    if ( tid > 0 ) {
+        char path[ 64 ];
+        snprintf( path, sizeof( path ), "/proc/self/task/%d/schedstat", tid );
+        FILE* fp = fopen( path, "r" );
+        if ( fp ) {
+            unsigned long long run = 0, wait = 0;
+            int n = fscanf( fp, "%llu %llu", &run, &wait );
+            fclose( fp );
+            if ( n == 2 ) {
+                return ( int64_t )( ( run + wait ) / 1000 );
+            }
+        }
+    }
+    struct timespec ts;
+    if ( arg->m_has_clock && clock_gettime( arg->m_clock, &ts ) == 0 ) {
+        return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    }
+    return -1;
+}
+
+
+template< typename T >
+int threadpool< T >::grow( work_queue* queue, int n ) {
+    int started = 0;
+    for ( int i = 0; i < m_max_threads && started < n; ++i ) {
+        if ( m_args[i].m_queue == queue && m_args[i].m_state == SLOT_EMPTY && start_thread( i ) ) {
+            ++started;
+        }
+    }
+    return started;
+}
+
+
+//子线程需要执行的代码  通过参数arg
+template< typename T >
+void* threadpool< T >::worker( void* arg ) {
+    worker_arg* warg = ( worker_arg* )arg;
+    warg->m_pool->run( warg );
+    return warg->m_pool;
+}
+
+
+template< typename T >
+bool threadpool< T >::retire( work_queue* queue ) {
+    int n = queue->m_retire;
+    while ( n > 0 ) {
+        if ( queue->m_retire.compare_exchange_weak( n, n - 1 ) ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+template< typename T >
+void threadpool< T >::run( worker_arg* self ) {
+    work_queue* queue = self->m_queue;
+    self->m_tid = ( int )syscall( SYS_gettid );
+    T* batch[ MAX_BATCH ];
+    bool drop[ MAX_BATCH ];
+    while (!m_stop) {
+        queue->m_queuestat.wait();  //等待任务
+        if ( m_stop ) {
+            break;
+        }
+        queue->m_queuelocker.lock();
+        if ( queue->m_size == 0 ) {
+            queue->m_queuelocker.unlock();
+            // 只在队列空时响应减少线程的要求，即使退出通知的计数被别的线程当作任务取走，也不会有任务没人处理
+            if ( retire( queue ) ) {
+                break;
+            }
             continue;
         }
-        request->process();  //任务的函数
+        // 一次取出一批：队列里的任务平均分给这个队列上的线程，每个线程最多MAX_BATCH个，
+        // 队列不长时仍然一次取一个，不让一个线程攒着任务而其他线程空闲
+        int threads = queue->m_threads;
+        size_t n = queue->m_size / ( threads > 0 ? threads : 1 );
+        n = n < 1 ? 1 : ( n > ( size_t )MAX_BATCH ? MAX_BATCH : n );
+        int64_t now = tsc::to_usec( tsc::now() );
+        for ( size_t i = 0; i < n; ++i ) {
+            int lane = 0;
+            queued item = take( queue, lane );
+            batch[i] = item.m_request;
+            drop[i] = queue->m_codel[lane].enabled()
+                      && queue->m_codel[lane].drop( now - item.m_enqueued, now, queue->m_lanes[lane].size() );
+            queue->m_delay_sum += now - item.m_enqueued;
+            queue->m_lane_dequeued[lane].fetch_add( 1, std::memory_order_relaxed );
+        }
+        queue->m_delay_count += n;
+        queue->m_queuelocker.unlock();
+        queue->m_dequeues.fetch_add( 1, std::memory_order_relaxed );
+        // 多取的任务各自对应的计数。添加任务的线程可能还没来得及post，减不掉的会在之后成为一次空的唤醒
+        for ( size_t i = 1; i < n; ++i ) {
+            queue->m_queuestat.trywait();
+        }
+
+        uint64_t start = tsc::now();
+        for ( size_t i = 0; i < n; ++i ) {
+            T* request = batch[i];
+            if ( !request ) {     //任务为空
+                continue;
+            }
+            if ( drop[i] ) {
+                request->shed();    //排队太久，不处理直接拒绝
+                queue->m_shed.fetch_add( 1, std::memory_order_relaxed );
+                continue;
+            }
+            request->process();  //任务的函数
+            queue->m_processed.fetch_add( 1, std::memory_order_relaxed );
+        }
+        self->m_busy.fetch_add( tsc::now() - start, std::memory_order_relaxed );
     }
+    queue->m_threads--;
+    m_running--;
+    self->m_state = SLOT_EXITED;    // 由管理线程或者stop回收
 }
 
 #endif
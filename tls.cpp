@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "tls.h"
+
+#ifdef WEBSERVER_TLS
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#include <openssl/core_names.h>
+
+// 从文件读入的会话票据密钥
+static bool ticket_key_loaded = false;
+static unsigned char ticket_key_name[ 16 ];
+static unsigned char ticket_hmac_key[ 32 ];
+static unsigned char ticket_aes_key[ 32 ];
+
+// 加密新票据（enc为1）或者找到解密旧票据的密钥（enc为0）
+static int ticket_key_cb( SSL*, unsigned char key_name[ 16 ], unsigned char* iv, EVP_CIPHER_CTX* ctx,
+                          EVP_MAC_CTX* hctx, int enc ) {
+    OSSL_PARAM params[ 3 ];
+    params[0] = OSSL_PARAM_construct_octet_string( OSSL_MAC_PARAM_KEY, ticket_hmac_key, sizeof( ticket_hmac_key ) );
+    params[1] = OSSL_PARAM_construct_utf8_string( OSSL_MAC_PARAM_DIGEST, ( char* )"SHA256", 0 );
+    params[2] = OSSL_PARAM_construct_end();
+    if ( enc ) {
+        if ( RAND_bytes( iv, 16 ) != 1 ) {
+            return -1;
+        }
+        memcpy( key_name, ticket_key_name, sizeof( ticket_key_name ) );
+        if ( EVP_EncryptInit_ex( ctx, EVP_aes_256_cbc(), NULL, ticket_aes_key, iv ) != 1
+             || EVP_MAC_CTX_set_params( hctx, params ) != 1 ) {
+            return -1;
+        }
+        return 1;
+    }
+    // 不认识的密钥名：票据是用别的密钥加密的，做完整握手
+    if ( memcmp( key_name, ticket_key_name, sizeof( ticket_key_name ) ) != 0 ) {
+        return 0;
+    }
+    if ( EVP_DecryptInit_ex( ctx, EVP_aes_256_cbc(), NULL, ticket_aes_key, iv ) != 1
+         || EVP_MAC_CTX_set_params( hctx, params ) != 1 ) {
+        return -1;
+    }
+    return 1;
+}
+
+static bool load_ticket_key( const char* path ) {
+    FILE* fp = fopen( path, "rb" );
+    if ( !fp ) {
+        printf( "cannot open tls_ticket_key %s: %s\n", path, strerror( errno ) );
+        return false;
+    }
+    unsigned char key[ 81 ];
+    size_t n = fread( key, 1, sizeof( key ), fp );
+    fclose( fp );
+    if ( n != 80 ) {
+        printf( "tls_ticket_key %s must be exactly 80 bytes\n", path );
+        return false;
+    }
+    memcpy( ticket_key_name, key, 16 );
+    memcpy( ticket_hmac_key, key + 16, 32 );
+    memcpy( ticket_aes_key, key + 48, 32 );
+    ticket_key_loaded = true;
+    return true;
+}
+
+tls_server::tls_server() : m_ctx( NULL ), m_handshakes( 0 ), m_resumed( 0 ), m_ktls( 0 ), m_failed( 0 ) {
+}
+
+tls_server::~tls_server() {
+    if ( m_ctx ) {
+        SSL_CTX_free( m_ctx );
+    }
+}
+
+bool tls_server::init( const char* cert, const char* key, const char* ticket_key ) {
+    SSL_CTX* ctx = SSL_CTX_new( TLS_server_method() );
+    if ( !ctx ) {
+        return false;
+    }
+    SSL_CTX_set_min_proto_version( ctx, TLS1_2_VERSION );
+    // 握手之后尽量让内核做加解密；部分写入时下次从新的位置继续（缓冲区随iovec移动）
+    SSL_CTX_set_options( ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION );
+    SSL_CTX_set_mode( ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS );
+    // TLS 1.2的会话缓存，TLS 1.3和1.2的会话票据默认开启
+    static const unsigned char sid_ctx[] = "webserver";
+    SSL_CTX_set_session_id_context( ctx, sid_ctx, sizeof( sid_ctx ) - 1 );
+    SSL_CTX_set_session_cache_mode( ctx, SSL_SESS_CACHE_SERVER );
+    if ( SSL_CTX_use_certificate_chain_file( ctx, cert ) != 1 ) {
+        printf( "cannot load tls_cert %s\n", cert );
+        SSL_CTX_free( ctx );
+        return false;
+    }
+    if ( SSL_CTX_use_PrivateKey_file( ctx, key, SSL_FILETYPE_PEM ) != 1 || SSL_CTX_check_private_key( ctx ) != 1 ) {
+        printf( "cannot load tls_key %s\n", key );
+        SSL_CTX_free( ctx );
+        return false;
+    }
+    if ( ticket_key && *ticket_key ) {
+        if ( !load_ticket_key( ticket_key ) ) {
+            SSL_CTX_free( ctx );
+            return false;
+        }
+        SSL_CTX_set_tlsext_ticket_key_evp_cb( ctx, ticket_key_cb );
+    }
+    m_ctx = ctx;
+    return true;
+}
+
+SSL* tls_server::accept( int fd ) {
+    SSL* ssl = SSL_new( m_ctx );
+    if ( !ssl ) {
+        return NULL;
+    }
+    if ( SSL_set_fd( ssl, fd ) != 1 ) {
+        SSL_free( ssl );
+        return NULL;
+    }
+    SSL_set_accept_state( ssl );
+    return ssl;
+}
+
+tls_server::RESULT tls_server::handshake( SSL* ssl ) {
+    int ret = SSL_do_handshake( ssl );
+    if ( ret == 1 ) {
+        m_handshakes.fetch_add( 1, std::memory_order_relaxed );
+        if ( SSL_session_reused( ssl ) ) {
+            m_resumed.fetch_add( 1, std::memory_order_relaxed );
+        }
+        if ( ktls_send( ssl ) ) {
+            m_ktls.fetch_add( 1, std::memory_order_relaxed );
+        }
+        return TLS_OK;
+    }
+    switch ( SSL_get_error( ssl, ret ) ) {
+        case SSL_ERROR_WANT_READ:
+            return TLS_WANT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return TLS_WANT_WRITE;
+        default:
+            m_failed.fetch_add( 1, std::memory_order_relaxed );
+            ERR_clear_error();
+            return TLS_ERROR;
+    }
+}
+
+tls_server::RESULT tls_server::read( SSL* ssl, char* buf, size_t len, size_t& n ) {
+    if ( SSL_read_ex( ssl, buf, len, &n ) == 1 ) {
+        return TLS_OK;
+    }
+    switch ( SSL_get_error( ssl, 0 ) ) {
+        case SSL_ERROR_WANT_READ:
+            return TLS_WANT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return TLS_WANT_WRITE;
+        case SSL_ERROR_ZERO_RETURN:
+            return TLS_CLOSED;
+        default:
+            ERR_clear_error();
+            return TLS_ERROR;
+    }
+}
+
+tls_server::RESULT tls_server::write( SSL* ssl, const char* buf, size_t len, size_t& n ) {
+    if ( SSL_write_ex( ssl, buf, len, &n ) == 1 ) {
+        return TLS_OK;
+    }
+    switch ( SSL_get_error( ssl, 0 ) ) {
+        case SSL_ERROR_WANT_READ:
+            return TLS_WANT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return TLS_WANT_WRITE;
+        default:
+            ERR_clear_error();
+            return TLS_ERROR;
+    }
+}
+
+bool tls_server::ktls_send( SSL* ssl ) {
+    return BIO_get_ktls_send( SSL_get_wbio( ssl ) ) != 0;
+}
+
+void tls_server::close( SSL* ssl ) {
+    // 非阻塞的socket上只尝试一次，发不出close_notify也不等待
+    if ( SSL_is_init_finished( ssl ) ) {
+        SSL_shutdown( ssl );
+    }
+    SSL_free( ssl );
+    ERR_clear_error();
+}
+
+#else   // 没有编译TLS支持
+
+tls_server::tls_server() : m_ctx( NULL ), m_handshakes( 0 ), m_resumed( 0 ), m_ktls( 0 ), m_failed( 0 ) {}
+tls_server::~tls_server() {}
+
+bool tls_server::init( const char*, const char*, const char* ) {
+    printf( "built without TLS support (WEBSERVER_TLS)\n" );
+    return false;
+}
+SSL* tls_server::accept( int ) { return NULL; }
+tls_server::RESULT tls_server::handshake( SSL* ) { return TLS_ERROR; }
+tls_server::RESULT tls_server::read( SSL*, char*, size_t, size_t& ) { return TLS_ERROR; }
+tls_server::RESULT tls_server::write( SSL*, const char*, size_t, size_t& ) { return TLS_ERROR; }
+bool tls_server::ktls_send( SSL* ) { return false; }
+void tls_server::close( SSL* ) {}
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <atomic>
+
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+
+/*
+    TLS（OpenSSL 3），编译时定义了WEBSERVER_TLS才可用，否则init总是失败
+    - 监听地址后面加 " ssl" 的连接在accept之后先做非阻塞的握手，握手的读写由主线程在epoll事件中推进
+    - 握手完成后尝试开启内核TLS（kTLS）：发送方向开启后，加密在内核中完成，应答照常用writev直接写socket，
+      读请求仍通过SSL_read（开启了接收方向的kTLS时OpenSSL内部改用recvmsg）；内核不支持时在用户态加解密
+    - 会话恢复：TLS 1.3/1.2 的会话票据（session ticket）和TLS 1.2的会话缓存。票据密钥默认每个进程随机生成，
+      配置了tls_ticket_key文件时从文件读取，多个进程、重启前后都能恢复会话
+    所有函数都不阻塞，同一个SSL对象同一时刻只被一个线程使用（EPOLLONESHOT保证）
+*/
+class tls_server {
+public:
+    static tls_server* get_instance() {
+        static tls_server instance;
+        return &instance;
+    }
+
+    // 加载证书和私钥；ticket_key为空或者80字节的票据密钥文件（16字节名字、32字节HMAC密钥、32字节AES密钥）
+    bool init( const char* cert, const char* key, const char* ticket_key );
+    bool enabled() const { return m_ctx != NULL; }
+
+    // handshake、read、write的结果
+    enum RESULT { TLS_OK = 0, TLS_WANT_READ, TLS_WANT_WRITE, TLS_CLOSED, TLS_ERROR };
+
+    SSL* accept( int fd );                  // 为新连接创建服务端的SSL对象，失败返回NULL
+    RESULT handshake( SSL* ssl );           // 推进握手，完成时返回TLS_OK
+    // 读写应用数据，n返回读到/写出的字节数，只有返回TLS_OK时有效
+    RESULT read( SSL* ssl, char* buf, size_t len, size_t& n );
+    RESULT write( SSL* ssl, const char* buf, size_t len, size_t& n );
+    bool ktls_send( SSL* ssl );             // 发送方向是否已经由内核加密，是则可以直接写socket
+    void close( SSL* ssl );                 // 尽量发送close_notify，然后释放SSL对象
+
+    unsigned long handshakes() const { return m_handshakes.load( std::memory_order_relaxed ); }
+    unsigned long resumed() const { return m_resumed.load( std::memory_order_relaxed ); }
+    unsigned long ktls() const { return m_ktls.load( std::memory_order_relaxed ); }
+    unsigned long failed() const { return m_failed.load( std::memory_order_relaxed ); }
+
+private:
+    tls_server();
+    ~tls_server();
+    tls_server( const tls_server& );
+    tls_server& operator=( const tls_server& );
+
+    SSL_CTX* m_ctx;
+    std::atomic< unsigned long > m_handshakes;  // 完成的握手
+    std::atomic< unsigned long > m_resumed;     // 其中恢复了会话的
+    std::atomic< unsigned long > m_ktls;        // 其中开启了kTLS发送的
+    std::atomic< unsigned long > m_failed;      // 失败的握手
+};
+
+#endif
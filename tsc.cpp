@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <string.h>
+#include "tsc.h"
+
+bool tsc::m_use_rdtsc = false;
+double tsc::m_usec_per_tick = 0.001;      // 没有校准时now()返回纳秒
+
+// /proc/cpuinfo的flags中是否同时有constant_tsc和nonstop_tsc
+static bool invariant_tsc() {
+    FILE* fp = fopen( "/proc/cpuinfo", "r" );
+    if ( !fp ) {
+        return false;
+    }
+    char line[ 4096 ];
+    bool found = false;
+    while ( fgets( line, sizeof( line ), fp ) ) {
+        if ( strncmp( line, "flags", 5 ) == 0 ) {
+            found = strstr( line, " constant_tsc" ) && strstr( line, " nonstop_tsc" );
+            break;
+        }
+    }
+    fclose( fp );
+    return found;
+}
+
+void tsc::calibrate() {
+#if defined( __x86_64__ ) || defined( __i386__ )
+    if ( !invariant_tsc() ) {
+        return;
+    }
+    // 用10毫秒的CLOCK_MONOTONIC时间量出TSC的频率
+    struct timespec start, end;
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    uint64_t t0 = __rdtsc();
+    struct timespec wait = { 0, 10 * 1000 * 1000 };
+    nanosleep( &wait, NULL );
+    clock_gettime( CLOCK_MONOTONIC, &end );
+    uint64_t t1 = __rdtsc();
+    double usec = ( end.tv_sec - start.tv_sec ) * 1e6 + ( end.tv_nsec - start.tv_nsec ) / 1e3;
+    if ( t1 <= t0 || usec <= 0 ) {
+        return;
+    }
+    m_usec_per_tick = usec / ( t1 - t0 );
+    m_use_rdtsc = true;
+#endif
+}
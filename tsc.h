@@ -0,0 +1,40 @@
+#ifndef TSC_H
+#define TSC_H
+
+#include <stdint.h>
+#include <time.h>
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <x86intrin.h>
+#endif
+
+/*
+    低开销的时间戳，用于给请求处理的各个阶段计时
+    CPU的TSC是恒定频率且各核同步（constant_tsc、nonstop_tsc）时直接读TSC（约几纳秒），
+    否则退回到clock_gettime(CLOCK_MONOTONIC)。启动时调用一次calibrate测出TSC的频率。
+*/
+class tsc {
+public:
+    static uint64_t now() {
+#if defined( __x86_64__ ) || defined( __i386__ )
+        if ( m_use_rdtsc ) {
+            return __rdtsc();
+        }
+#endif
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return ( uint64_t )ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    // 两个时间戳之差换算成微秒
+    static int64_t to_usec( uint64_t ticks ) { return ( int64_t )( ( int64_t )ticks * m_usec_per_tick ); }
+
+    // 检查TSC是否可用并测量频率，在创建其他线程之前调用
+    static void calibrate();
+    static bool using_rdtsc() { return m_use_rdtsc; }
+
+private:
+    static bool m_use_rdtsc;
+    static double m_usec_per_tick;
+};
+
+#endif